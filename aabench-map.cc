@@ -0,0 +1,67 @@
+/*
+** pem 2026-10-19
+**
+** std::map for aabench to compare with, behind a C interface.
+**
+*/
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+struct bench_map
+{
+    bool strkeys;
+    std::map<uint64_t, void *> imap;
+    std::map<std::string, void *> smap;
+};
+
+extern "C"
+{
+
+void *
+map_create(int strkeys)
+{
+    bench_map *m = new bench_map;
+
+    m->strkeys = (strkeys != 0);
+    return m;
+}
+
+int
+map_insert(void *mp, uint64_t key, const char *skey)
+{
+    bench_map *m = static_cast<bench_map *>(mp);
+
+    if (m->strkeys)
+        return m->smap.emplace(skey, nullptr).second;
+    return m->imap.emplace(key, nullptr).second;
+}
+
+int
+map_find(void *mp, uint64_t key, const char *skey)
+{
+    bench_map *m = static_cast<bench_map *>(mp);
+
+    if (m->strkeys)
+        return m->smap.find(skey) != m->smap.end();
+    return m->imap.find(key) != m->imap.end();
+}
+
+int
+map_remove(void *mp, uint64_t key, const char *skey)
+{
+    bench_map *m = static_cast<bench_map *>(mp);
+
+    if (m->strkeys)
+        return m->smap.erase(skey) > 0;
+    return m->imap.erase(key) > 0;
+}
+
+void
+map_destroy(void *mp)
+{
+    delete static_cast<bench_map *>(mp);
+}
+
+}
@@ -1,148 +1,907 @@
 /*
 ** pem 2018-10-28
 **
+** Benchmark of the trees, and of tsearch(3) and std::map to compare with.
+**
+**   aabench [-H] [-L] [-X] [-C entries] [-F] [-i impl] [-k int|str]
+**           [-p seq|random|sorted|zipf] [-n size] [-o ops] [-r read%]
+**           [-s seed]
+**
+** The tree is filled with 'size' keys in the order of the pattern, then
+** 'ops' mixed operations are done, where a write removes a key and
+** inserts a new one, and finally all keys are removed. For each phase,
+** one line is printed with the throughput and the latency percentiles.
+**
+** The patterns are:
+**   seq     0, 1, 2, ...
+**   random  distinct random keys, uniform lookups
+**   sorted  the random keys in order, loaded in one go where possible
+**   zipf    keys drawn with a Zipf distribution (theta 0.99), so there
+**           are duplicates, and lookups and writes are just as skewed
+**
+** String keys are the 64 bit integer keys as 16 hex digits.
+**
 */
 
+#define _GNU_SOURCE             /* For tdestroy() */
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <search.h>
+
+#include "aatreem.h"
+#include "aatreeb.h"
+#include "aatreet.h"
+
+#define UNUSED(x) ((void)(x))
+
+#define KEYLEN 17
 
-#include "aatree.h"
+#define ZIPF_THETA 0.99
 
-#define STV2DOUBLE(T) ((T)->tv_sec + (T)->tv_usec/1000000.0)
-#define STVDIFF(T1, T0) (STV2DOUBLE(T1) - STV2DOUBLE(T0))
+#ifdef AABENCH_MAP
+/* In aabench-map.cc */
+void *map_create(int strkeys);
+int map_insert(void *m, uint64_t key, const char *skey);
+int map_find(void *m, uint64_t key, const char *skey);
+int map_remove(void *m, uint64_t key, const char *skey);
+void map_destroy(void *m);
+#endif
+
+static bool strkeys = false;
+static size_t cachesize = 0;
+static size_t bloomsize = 0;
+static bool hindex = false;
+
+/*
+** Random numbers and keys
+*/
+
+static uint64_t rstate;
+
+/* splitmix64 */
+static uint64_t
+rnext(void)
+{
+    uint64_t z = (rstate += 0x9e3779b97f4a7c15);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n) */
+static uint64_t
+runiform(uint64_t n)
+{
+    return (uint64_t)((rnext() >> 11) * 0x1.0p-53 * n);
+}
+
+/* A bijection, so distinct numbers make distinct keys */
+static uint64_t
+mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
 
 static void
-print_time(const char *s, struct timeval *t0, struct timeval *t1)
+keystr(uint64_t key, char *buf)
 {
-    printf("%s: %4.3f ms\n", s, 1000*STVDIFF(t1, t0));
+    snprintf(buf, KEYLEN, "%016" PRIx64, key);
 }
 
-int
-main(int argc, char **argv)
+/* From "Quickly Generating Billion-Record Synthetic Databases" by Gray
+   et al., as in YCSB. Setting up is linear in n. */
+typedef struct zipf_s
 {
-    size_t i, count;
-    struct timeval t0, t1;
-    bool mvariant = false;
-    char buf[128];
-    char **a = NULL;
-    size_t size = 0;
-    aatree_t t = NULL;
+    uint64_t n;
+    double alpha, zetan, eta;
+} zipf_t;
 
-    if (argc == 2 && strcmp(argv[1], "-m") == 0)
-        mvariant = true;
+static zipf_t zipf;
 
-    count = 0;
-    while (fgets(buf, sizeof(buf), stdin) != NULL)
+static void
+zipf_init(uint64_t n)
+{
+    double zeta2 = 1.0 + pow(0.5, ZIPF_THETA);
+
+    zipf.n = n;
+    zipf.zetan = 0.0;
+    for (uint64_t i = 1 ; i <= n ; i++)
+        zipf.zetan += 1.0 / pow((double)i, ZIPF_THETA);
+    zipf.alpha = 1.0 / (1.0 - ZIPF_THETA);
+    zipf.eta = (1.0 - pow(2.0 / n, 1.0 - ZIPF_THETA)) /
+        (1.0 - zeta2 / zipf.zetan);
+}
+
+/* A rank in [0, n), where 0 is the most frequent */
+static uint64_t
+zipf_next(void)
+{
+    double u = (rnext() >> 11) * 0x1.0p-53;
+    double uz = u * zipf.zetan;
+
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, ZIPF_THETA))
+        return 1;
+
+    uint64_t r = (uint64_t)(zipf.n * pow(zipf.eta * u - zipf.eta + 1.0,
+                                         zipf.alpha));
+
+    return (r < zipf.n ? r : zipf.n - 1);
+}
+
+static int
+keycmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/*
+** Latency histogram, with 16 buckets per power of two, so within 6%
+*/
+
+#define HIST_SUB 16
+#define HIST_BUCKETS (HIST_SUB * 62)
+
+typedef struct hist_s
+{
+    uint64_t count;
+    uint64_t bucket[HIST_BUCKETS];
+} hist_t;
+
+static void
+hist_add(hist_t *h, uint64_t ns)
+{
+    size_t b = ns;
+
+    if (ns >= HIST_SUB)
     {
-        size_t len = strlen(buf);
+        unsigned e = 4;
 
-        while (len > 0 && buf[len-1] < ' ')
-            buf[--len] = '\0';
-        if (len == 0)
-            continue;           /* Empty line */
-        if (count >= size)
-        {
-            size += 100;
-            a = realloc(a, size * sizeof(char *));
-            if (!a)
-            {
-                fprintf(stderr, "realloc(a, %lu) failed\n",
-                        (unsigned long)size * sizeof(char *));
-                exit(1);
-            }
-        }
-        a[count] = strdup(buf);
-        if (!a[count])
-        {
-            fprintf(stderr, "strdup(\"%s\") failed\n", buf);
-            exit(1);
-        }
-        count += 1;
+        while ((ns >> (e + 1)) != 0)
+            e += 1;
+        b = HIST_SUB * (e - 3) + (ns >> (e - 4)) - HIST_SUB;
+        if (b >= HIST_BUCKETS)
+            b = HIST_BUCKETS - 1;
     }
+    h->bucket[b] += 1;
+    h->count += 1;
+}
 
-    gettimeofday(&t0, NULL);
-    for (i = 0 ; i < count ; i++)
-        if (mvariant)
-        {
-            if ((t = aatreem_insert(t, a[i], (void *)i)) == NULL)
-            {
-                fprintf(stderr, "aatreem_insert(t, \"%s\", %lu) failed\n",
-                        a[i], (unsigned long)i);
-                exit(1);
-            }
-        }
-        else
+/* The lower bound of the bucket where the fraction q is reached */
+static uint64_t
+hist_quantile(hist_t *h, double q)
+{
+    uint64_t want = (uint64_t)ceil(q * h->count), sum = 0;
+    size_t b;
+
+    for (b = 0 ; b < HIST_BUCKETS - 1 ; b++)
+        if ((sum += h->bucket[b]) >= want)
+            break;
+    if (b < HIST_SUB)
+        return b;
+    return (uint64_t)(HIST_SUB + b % HIST_SUB) << (b / HIST_SUB - 1);
+}
+
+static inline uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+** The implementations
+*/
+
+typedef struct impl_s
+{
+    const char *name;
+    bool ints, strs;            /* Key types supported */
+    void *(*create)(void);
+    /* Returns false if the key already is there */
+    bool (*insert)(void *, uint64_t key, const char *skey);
+    bool (*find)(void *, uint64_t key, const char *skey);
+    bool (*remove)(void *, uint64_t key, const char *skey);
+    /* Fill an empty tree with sorted keys in one go, or NULL */
+    bool (*load_sorted)(void *, uint64_t *keys, size_t n);
+    void (*destroy)(void *);
+} impl_t;
+
+/* aatree, with nodes allocated one by one like the others */
+
+typedef struct bnode_s
+{
+    aatree_node_t n;
+    uint64_t key;
+    char skey[KEYLEN];          /* Not allocated for integer keys */
+} bnode_t;
+
+static int
+bcompare_int(aatree_t *t, void *keyp, aatree_node_t *n)
+{
+    UNUSED(t);
+    uint64_t a = *(uint64_t *)keyp, b = ((bnode_t *)n)->key;
+
+    return (a < b ? -1 : a > b);
+}
+
+static int
+bcompare_str(aatree_t *t, void *keyp, aatree_node_t *n)
+{
+    UNUSED(t);
+    return strcmp(keyp, ((bnode_t *)n)->skey);
+}
+
+static void
+bswap(aatree_t *t, aatree_node_t *a, aatree_node_t *b)
+{
+    UNUSED(t);
+    bnode_t *x = (bnode_t *)a, *y = (bnode_t *)b;
+    uint64_t tmp = x->key;
+
+    x->key = y->key;
+    y->key = tmp;
+    if (strkeys)
+    {
+        char stmp[KEYLEN];
+
+        memcpy(stmp, x->skey, KEYLEN);
+        memcpy(x->skey, y->skey, KEYLEN);
+        memcpy(y->skey, stmp, KEYLEN);
+    }
+}
+
+static void *
+bkey(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    return (strkeys ? (void *)((bnode_t *)n)->skey : &((bnode_t *)n)->key);
+}
+
+static uint64_t
+bhash(aatree_t *t, void *keyp)
+{
+    UNUSED(t);
+    uint64_t h = 0xcbf29ce484222325;
+
+    if (! strkeys)
+        return mix(*(uint64_t *)keyp);
+    for (const unsigned char *p = keyp ; *p != '\0' ; p++)
+        h = (h ^ *p) * 0x100000001b3;
+    return h;
+}
+
+static bnode_t *
+bnode(uint64_t key, const char *skey)
+{
+    bnode_t *n = malloc(strkeys ? sizeof(bnode_t) : offsetof(bnode_t, skey));
+
+    if (n == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    aatree_init_node(&n->n);
+    n->key = key;
+    if (strkeys)
+        memcpy(n->skey, skey, KEYLEN);
+    return n;
+}
+
+static void *
+aatree_create(void)
+{
+    aatree_t *t = calloc(1, sizeof(aatree_t));
+
+    t->compare = (strkeys ? bcompare_str : bcompare_int);
+    t->swap = bswap;
+    t->key = bkey;
+    if (cachesize > 0 && ! aatree_cache_attach(t, cachesize, bhash))
+        fprintf(stderr, "aatree_cache_attach failed\n");
+    if (bloomsize > 0 && ! aatree_bloom_attach(t, bloomsize, bhash))
+        fprintf(stderr, "aatree_bloom_attach failed\n");
+    return t;
+}
+
+static bool
+aatree_ins(void *t, uint64_t key, const char *skey)
+{
+    bnode_t *n = bnode(key, skey);
+
+    if (aatree_insert_unique_node(t, bkey(t, &n->n), &n->n) != NULL)
+    {
+        free(n);
+        return false;
+    }
+    return true;
+}
+
+static bool
+aatree_fnd(void *t, uint64_t key, const char *skey)
+{
+    return (aatree_find_key(t, (strkeys ? (void *)skey : &key), NULL) != NULL);
+}
+
+static bool
+aatree_rem(void *t, uint64_t key, const char *skey)
+{
+    aatree_node_t *n = aatree_remove_node(t, (strkeys ? (void *)skey : &key),
+                                          NULL);
+
+    free(n);
+    return (n != NULL);
+}
+
+static bool
+aatree_load(void *t, uint64_t *keys, size_t n)
+{
+    aatree_node_t **nodes = malloc(n * sizeof(aatree_node_t *));
+    char skey[KEYLEN];
+
+    if (nodes == NULL)
+        return false;
+    for (size_t i = 0 ; i < n ; i++)
+    {
+        keystr(keys[i], skey);
+        nodes[i] = &bnode(keys[i], skey)->n;
+    }
+    aatree_insert_sorted(t, nodes, n);
+    free(nodes);
+    return true;
+}
+
+static void
+bfree(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    free(n);
+}
+
+static void
+aatree_dest(void *t)
+{
+    aatree_clear(t, bfree);
+    aatree_cache_detach(t);
+    aatree_bloom_detach(t);
+    free(t);
+}
+
+/* aatreem */
+
+static void *
+aatreem_create_bench(void)
+{
+    aatree_t *t = aatreem_create(0);
+
+    if (cachesize > 0 && ! aatreem_cache_attach(t, cachesize))
+        fprintf(stderr, "aatreem_cache_attach failed\n");
+    if (bloomsize > 0 && ! aatreem_bloom_attach(t, bloomsize))
+        fprintf(stderr, "aatreem_bloom_attach failed\n");
+    if (hindex && ! aatreem_index_attach(t))
+        fprintf(stderr, "aatreem_index_attach failed\n");
+    return t;
+}
+
+static bool
+aatreem_ins(void *t, uint64_t key, const char *skey)
+{
+    UNUSED(key);
+    return aatreem_insert_unique(t, skey, NULL, NULL);
+}
+
+static bool
+aatreem_fnd(void *t, uint64_t key, const char *skey)
+{
+    UNUSED(key);
+    return (aatreem_find(t, skey) != NULL);
+}
+
+static bool
+aatreem_rem(void *t, uint64_t key, const char *skey)
+{
+    UNUSED(key);
+    return aatreem_delete(t, skey, NULL, NULL);
+}
+
+static void
+aatreem_dest(void *t)
+{
+    aatreem_destroy(t, NULL);
+}
+
+/* aatreeb */
+
+static void *
+aatreeb_create(void)
+{
+    aatreeb_t *t = malloc(sizeof(aatreeb_t));
+
+    aatreeb_init(t);
+    return t;
+}
+
+static bool
+aatreeb_ins(void *t, uint64_t key, const char *skey)
+{
+    UNUSED(skey);
+    void *x;
+
+    return aatreeb_insert_unique(t, key, NULL, &x);
+}
+
+static bool
+aatreeb_fnd(void *t, uint64_t key, const char *skey)
+{
+    UNUSED(skey);
+    return aatreeb_find(t, key, NULL);
+}
+
+static bool
+aatreeb_rem(void *t, uint64_t key, const char *skey)
+{
+    UNUSED(skey);
+    return aatreeb_remove(t, key, NULL);
+}
+
+static void
+aatreeb_dest(void *t)
+{
+    aatreeb_destroy(t, NULL);
+    free(t);
+}
+
+/* tsearch(3), with the keys allocated, and the same on aatreet */
+
+typedef struct tfuns_s
+{
+    void *(*search)(const void *, void **,
+                    int (*)(const void *, const void *));
+    void *(*find)(const void *, void *const *,
+                  int (*)(const void *, const void *));
+    void *(*delete)(const void *, void **,
+                    int (*)(const void *, const void *));
+    void (*destroy)(void *, void (*)(void *));
+} tfuns_t;
+
+typedef struct troot_s
+{
+    void *root;
+    const tfuns_t *f;
+} troot_t;
+
+static const tfuns_t tsearch_funs = { tsearch, tfind, tdelete, tdestroy };
+static const tfuns_t aatreet_funs =
+    { aatreet_search, aatreet_find, aatreet_delete, aatreet_destroy };
+
+static int
+tcompare_int(const void *a, const void *b)
+{
+    return keycmp(a, b);
+}
+
+static int
+tcompare_str(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+static void *
+troot_create(const tfuns_t *f)
+{
+    troot_t *t = calloc(1, sizeof(troot_t));
+
+    if (t != NULL)
+        t->f = f;
+    return t;
+}
+
+static void *
+tsearch_create(void)
+{
+    return troot_create(&tsearch_funs);
+}
+
+static void *
+aatreet_create(void)
+{
+    return troot_create(&aatreet_funs);
+}
+
+static bool
+tsearch_ins(void *tp, uint64_t key, const char *skey)
+{
+    troot_t *t = tp;
+    void *k;
+    void **p;
+
+    if (strkeys)
+        k = strdup(skey);
+    else if ((k = malloc(sizeof(uint64_t))) != NULL)
+        *(uint64_t *)k = key;
+    if (k == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    p = t->f->search(k, &t->root, (strkeys ? tcompare_str : tcompare_int));
+    if (p == NULL)
+    {
+        perror("tsearch");
+        exit(1);
+    }
+    if (*p != k)
+    {
+        free(k);
+        return false;
+    }
+    return true;
+}
+
+static bool
+tsearch_fnd(void *tp, uint64_t key, const char *skey)
+{
+    troot_t *t = tp;
+
+    return (t->f->find((strkeys ? (void *)skey : &key), &t->root,
+                       (strkeys ? tcompare_str : tcompare_int)) != NULL);
+}
+
+static bool
+tsearch_rem(void *tp, uint64_t key, const char *skey)
+{
+    troot_t *t = tp;
+    const void *k = (strkeys ? (void *)skey : &key);
+    int (*cmp)(const void *, const void *) =
+        (strkeys ? tcompare_str : tcompare_int);
+    void **p = t->f->find(k, &t->root, cmp);
+    void *old;
+
+    if (p == NULL)
+        return false;
+    old = *p;
+    (void)t->f->delete(k, &t->root, cmp);
+    free(old);
+    return true;
+}
+
+static void
+tsearch_dest(void *tp)
+{
+    troot_t *t = tp;
+
+    t->f->destroy(t->root, free);
+    free(t);
+}
+
+#ifdef AABENCH_MAP
+
+static void *
+map_create_bench(void)
+{
+    return map_create(strkeys);
+}
+
+static bool
+map_ins(void *m, uint64_t key, const char *skey)
+{
+    return map_insert(m, key, skey);
+}
+
+static bool
+map_fnd(void *m, uint64_t key, const char *skey)
+{
+    return map_find(m, key, skey);
+}
+
+static bool
+map_rem(void *m, uint64_t key, const char *skey)
+{
+    return map_remove(m, key, skey);
+}
+
+#endif /* AABENCH_MAP */
+
+static impl_t impls[] =
+{
+    { "aatree", true, true, aatree_create, aatree_ins, aatree_fnd,
+      aatree_rem, aatree_load, aatree_dest },
+    { "aatreem", false, true, aatreem_create_bench, aatreem_ins, aatreem_fnd,
+      aatreem_rem, NULL, aatreem_dest },
+    { "aatreeb", true, false, aatreeb_create, aatreeb_ins, aatreeb_fnd,
+      aatreeb_rem, NULL, aatreeb_dest },
+    { "tsearch", true, true, tsearch_create, tsearch_ins, tsearch_fnd,
+      tsearch_rem, NULL, tsearch_dest },
+    { "aatreet", true, true, aatreet_create, tsearch_ins, tsearch_fnd,
+      tsearch_rem, NULL, tsearch_dest },
+#ifdef AABENCH_MAP
+    { "map", true, true, map_create_bench, map_ins, map_fnd, map_rem,
+      NULL, map_destroy },
+#endif
+    { NULL, false, false, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/*
+** The phases
+*/
+
+typedef struct run_s
+{
+    impl_t *impl;
+    char name[16];              /* With +C, +F and +X for the options */
+    const char *pattern;
+    size_t size;
+    bool latency;
+} run_t;
+
+static void
+report(run_t *r, const char *phase, size_t ops, uint64_t ns, hist_t *h)
+{
+    printf("%-10s %-3s %-6s %10lu %-7s %10lu",
+           r->name, (strkeys ? "str" : "int"), r->pattern,
+           (unsigned long)r->size, phase, (unsigned long)ops);
+    if (ns > 0)
+        printf(" %8.3f", 1000.0 * ops / ns);
+    else
+        printf(" %8s", "-");
+    if (h != NULL && h->count > 0)
+        printf(" %7lu %7lu %7lu\n",
+               (unsigned long)hist_quantile(h, 0.50),
+               (unsigned long)hist_quantile(h, 0.99),
+               (unsigned long)hist_quantile(h, 0.999));
+    else
+        printf(" %7s %7s %7s\n", "-", "-", "-");
+    fflush(stdout);
+}
+
+/* Time one operation into the histogram, if any */
+#define TIMED(H, OP)                            \
+    do {                                        \
+        if ((H) != NULL)                        \
+        {                                       \
+            uint64_t t0_ = now();               \
+            OP;                                 \
+            hist_add((H), now() - t0_);         \
+        }                                       \
+        else                                    \
+            OP;                                 \
+    } while (0)
+
+static void
+usage(void)
+{
+    fprintf(stderr, "aabench [-H] [-L] [-X] [-C entries] [-F] [-i impl] [-k int|str] [-p seq|random|sorted|zipf] [-n size] [-o ops] [-r read%%] [-s seed]\n");
+    fprintf(stderr, "impl is one of:");
+    for (impl_t *i = impls ; i->name != NULL ; i++)
+        fprintf(stderr, " %s", i->name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int c;
+    const char *iname = "aatree", *pattern = "random";
+    size_t size = 100000, ops = 0;
+    unsigned readpct = 90;
+    bool header = false, latency = true, bloom = false;
+    uint64_t seed = 1;
+    run_t r;
+
+    while ((c = getopt(argc, argv, "C:FHLXi:k:n:o:p:r:s:")) != EOF)
+        switch (c)
         {
-            aatree_t n = malloc(aatree_sizeof());
-
-            aatree_init_node(n, a[i], (void *)i);
-            if ((t = aatree_insert_node(t, n)) == NULL)
-            {
-                fprintf(stderr, "aatree_insert_node(t, \"%s\", %lu) failed\n",
-                        a[i], (unsigned long)i);
-                exit(1);
-            }
+        case 'C':
+            cachesize = strtoul(optarg, NULL, 10);
+            break;
+        case 'F':
+            bloom = true;
+            break;
+        case 'H':
+            header = true;
+            break;
+        case 'L':
+            latency = false;
+            break;
+        case 'X':
+            hindex = true;
+            break;
+        case 'i':
+            iname = optarg;
+            break;
+        case 'k':
+            if (strcmp(optarg, "str") == 0)
+                strkeys = true;
+            else if (strcmp(optarg, "int") != 0)
+                usage();
+            break;
+        case 'n':
+            size = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            pattern = optarg;
+            break;
+        case 'r':
+            readpct = (unsigned)atoi(optarg);
+            if (readpct > 100)
+                usage();
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage();
         }
-    gettimeofday(&t1, NULL);
-    print_time("Insert:", &t0, &t1);
+    if (optind != argc || size == 0)
+        usage();
+    if (ops == 0)
+        ops = (size < 100000 ? 100000 : size);
 
-    i = count;
-    gettimeofday(&t0, NULL);
-    while (i--)
+    r.impl = NULL;
+    for (impl_t *i = impls ; i->name != NULL ; i++)
+        if (strcmp(i->name, iname) == 0)
+            r.impl = i;
+    if (r.impl == NULL)
+        usage();
+    if (strkeys ? ! r.impl->strs : ! r.impl->ints)
     {
-        aatree_t n;
+        fprintf(stderr, "%s doesn't do %s keys\n",
+                iname, (strkeys ? "string" : "integer"));
+        exit(2);
+    }
+    if (bloom)
+        bloomsize = size;
+    snprintf(r.name, sizeof(r.name), "%s%s%s%s", r.impl->name,
+             (cachesize > 0 ? "+C" : ""), (bloom ? "+F" : ""),
+             (hindex ? "+X" : ""));
+    r.pattern = pattern;
+    r.size = size;
+    r.latency = latency;
+    rstate = seed;
+
+    bool zipfian = (strcmp(pattern, "zipf") == 0);
+    uint64_t *keys = malloc(size * sizeof(uint64_t));
+    uint64_t next = size;       /* For new keys */
 
-        if ((n = aatree_find_key(t, a[i])) == NULL)
-            printf("FIND: No \"%s\" found\n", a[i]);
+    if (keys == NULL)
+    {
+        perror("malloc");
+        exit(1);
     }
-    gettimeofday(&t1, NULL);
-    print_time("Find:  ", &t0, &t1);
+    if (zipfian)
+        zipf_init(size);
+    for (size_t i = 0 ; i < size ; i++)
+        if (strcmp(pattern, "seq") == 0)
+            keys[i] = i;
+        else if (zipfian)
+            keys[i] = mix(zipf_next() + seed);
+        else if (strcmp(pattern, "random") == 0 ||
+                 strcmp(pattern, "sorted") == 0)
+            keys[i] = mix(i + seed);
+        else
+            usage();
+    if (strcmp(pattern, "sorted") == 0)
+        qsort(keys, size, sizeof(uint64_t), keycmp);
 
-    printf("Root level: %u\n", (unsigned)aatree_level(t));
+    if (header)
+        printf("%-10s %-3s %-6s %10s %-7s %10s %8s %7s %7s %7s\n",
+               "impl", "key", "order", "size", "phase", "ops", "Mops/s",
+               "p50ns", "p99ns", "p999ns");
 
-    i = count;
-    gettimeofday(&t0, NULL);
-    while (i--)
-        if (mvariant)
-        {
-            bool removed = false;
+    static hist_t hins, hread, hwrite, hrem;
+    hist_t *hi = (latency ? &hins : NULL), *hr = (latency ? &hread : NULL);
+    hist_t *hw = (latency ? &hwrite : NULL), *hd = (latency ? &hrem : NULL);
+    void *t = r.impl->create();
+    char skey[KEYLEN];
+    size_t count, misses = 0;
+    uint64_t t0;
 
-            t = aatreem_delete(t, a[i], &removed, NULL);
-            if (! removed)
-                printf("REM: No \"%s\" found\n", a[i]);
+    /* Fill */
+    if (strcmp(pattern, "sorted") == 0 && r.impl->load_sorted != NULL)
+    {
+        t0 = now();
+        if (! r.impl->load_sorted(t, keys, size))
+        {
+            fprintf(stderr, "%s: load failed\n", iname);
+            exit(1);
         }
-        else
+        report(&r, "load", size, now() - t0, NULL);
+    }
+    else
+    {
+        t0 = now();
+        for (size_t i = 0 ; i < size ; i++)
         {
-            aatree_t n = NULL;
-
-            t = aatree_remove_node(t, a[i], &n);
-            if (n == NULL)
-                printf("REM: No \"%s\" found\n", a[i]);
-            else
-                free(n);
+            if (strkeys)
+                keystr(keys[i], skey);
+            TIMED(hi, (void)r.impl->insert(t, keys[i], skey));
         }
-    gettimeofday(&t1, NULL);
-    print_time("Delete:", &t0, &t1);
+        report(&r, "insert", size, now() - t0, hi);
+    }
 
-    if (t != NULL)
+    /* Mixed reads and writes */
+    count = 0;
+    t0 = now();
+    for (size_t i = 0 ; i < ops ; i++)
     {
-        printf("Tree is not empty; destroying...\n");
-        if (mvariant)
-            aatreem_destroy(t, NULL);
+        bool read = (runiform(100) < readpct);
+        uint64_t key;
+        size_t j = 0;
+
+        if (zipfian)
+            key = mix(zipf_next() + seed);
         else
+            key = keys[j = runiform(size)];
+        if (strkeys)
+            keystr(key, skey);
+        if (read)
         {
-            aatree_t n = NULL;
+            bool found;
 
-            while ((t = aatree_remove_node(t, aatree_key(t), &n)) != NULL)
-                free(n);
+            TIMED(hr, found = r.impl->find(t, key, skey));
+            if (! found && ! zipfian)
+                misses += 1;
+            count += 1;
         }
+        else
+        {
+            uint64_t nkey = (zipfian ? mix(zipf_next() + seed) : mix(seed + next++));
+            char nskey[KEYLEN];
+
+            if (strkeys)
+                keystr(nkey, nskey);
+            TIMED(hw, ((void)r.impl->remove(t, key, skey),
+                       (void)r.impl->insert(t, nkey, nskey)));
+            if (! zipfian)
+                keys[j] = nkey;
+        }
+    }
+    {
+        char phase[16];
+
+        snprintf(phase, sizeof(phase), "read%u", readpct);
+        report(&r, phase, ops, now() - t0, NULL);
+        if (latency && count > 0)
+            report(&r, "find", count, 0, hr);
+        if (latency && count < ops)
+            report(&r, "write", ops - count, 0, hw);
     }
 
-    for (i = 0 ; i < count ; i++)
-        free(a[i]);
-    free(a);
+    /* Empty it */
+    t0 = now();
+    for (size_t i = 0 ; i < size ; i++)
+    {
+        if (strkeys)
+            keystr(keys[i], skey);
+        TIMED(hd, (void)r.impl->remove(t, keys[i], skey));
+    }
+    report(&r, "remove", size, now() - t0, hd);
 
+    r.impl->destroy(t);
+    free(keys);
+    if (misses > 0)
+    {
+        fprintf(stderr, "%s: %lu keys not found\n",
+                iname, (unsigned long)misses);
+        exit(1);
+    }
     exit(0);
 }
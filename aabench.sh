@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# pem 2026-10-19
+#
+# Run aabench over the implementations, key types and insert orders, for
+# each size given, and then over some read/write mixes.
+#
+# Usage: aabench.sh [size ...]
+#
+
+sizes=${*:-"1000 100000 1000000"}
+impls="aatree aatreem aatreeb tsearch aatreet map"
+header=-H
+
+# std::map is only there if built with a C++ compiler
+if ! ./aabench -i map -n 1 > /dev/null 2>&1 ; then
+    impls="aatree aatreem aatreeb tsearch aatreet"
+fi
+
+run() {
+    ./aabench $header "$@" || exit 1
+    header=
+}
+
+for n in $sizes ; do
+    for k in int str ; do
+	for p in seq random sorted zipf ; do
+	    for i in $impls ; do
+		case $i-$k in
+		    aatreem-int|aatreeb-str) continue ;;
+		esac
+		run -i $i -k $k -p $p -n $n
+	    done
+	done
+    done
+done
+
+# The last size, with features that trade memory for lookups
+for n in $sizes ; do
+    last=$n
+done
+echo
+header=-H
+for r in 0 50 99 ; do
+    for i in $impls ; do
+	case $i in
+	    aatreem) continue ;;
+	esac
+	run -i $i -k int -p random -r $r -n $last
+    done
+done
+echo
+header=-H
+run -i aatreem -k str -p zipf -n $last
+run -i aatreem -k str -p zipf -n $last -C 4096
+run -i aatreem -k str -p zipf -n $last -F
+run -i aatreem -k str -p zipf -n $last -X
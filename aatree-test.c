@@ -8,8 +8,18 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
 
 #include "aatreem.h"
+#include "aatreeb.h"
+#include "aatreei.h"
+#include "aatreel.h"
+#include "aatreep.h"
+#include "aatrees.h"
+#include "aatreet.h"
+#include "aatreew.h"
+#include "aatreex.h"
 
 #define UNUSED(x) ((void)(x))
 
@@ -133,10 +143,1266 @@ cnode(aatree_t *t, aatree_node_t *n)
     return true;
 }
 
+static void usage(void);
+
+/* For the sharded tree and build tests. Same layout as the aatreem nodes,
+   so ptree() and cnode() work on these too. */
+typedef struct snode_s
+{
+    aatree_node_t n;
+    char *key;
+    char *value;
+    size_t count;               /* Aggregate, nodes in the subtree */
+} snode_t;
+
+static int
+scompare(aatree_t *t, void *keyp, aatree_node_t *n)
+{
+    UNUSED(t);
+    return strcmp(keyp, ((snode_t *)n)->key);
+}
+
+static void
+sswap(aatree_t *t, aatree_node_t *a, aatree_node_t *b)
+{
+    UNUSED(t);
+    char *tmp = ((snode_t *)a)->key;
+
+    ((snode_t *)a)->key = ((snode_t *)b)->key;
+    ((snode_t *)b)->key = tmp;
+    tmp = ((snode_t *)a)->value;
+    ((snode_t *)a)->value = ((snode_t *)b)->value;
+    ((snode_t *)b)->value = tmp;
+}
+
+static void *
+skey(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    return ((snode_t *)n)->key;
+}
+
+static int
+skeycmp(aatrees_t *s, void *akeyp, void *bkeyp)
+{
+    UNUSED(s);
+    return strcmp(akeyp, bkeyp);
+}
+
+static void *
+skeydup(aatrees_t *s, void *keyp)
+{
+    UNUSED(s);
+    return strdup(keyp);
+}
+
+static void
+pshards(aatrees_t *s)
+{
+    aatrees_iter_t iter;
+    aatree_node_t *n;
+
+    for (uint32_t i = 0 ; i < s->nshards ; i++)
+    {
+        aatree_t *t = &s->shard[i].tree;
+        aatree_iter_t titer;
+
+        printf("Shard %u (%lu):", (unsigned)i,
+               (unsigned long)s->shard[i].count);
+        if (aatree_iter_init(t, &titer))
+            while ((n = aatree_iter_next(&titer)) != NULL)
+                printf(" %s", ((snode_t *)n)->key);
+        putchar('\n');
+    }
+    printf("Merged:");
+    if (aatrees_iter_init(s, &iter))
+    {
+        while ((n = aatrees_iter_next(&iter)) != NULL)
+            printf(" %s", ((snode_t *)n)->key);
+        aatrees_iter_fini(&iter);
+    }
+    printf("\n--------------------\n");
+}
+
+/* Insert the keys in a range routed sharded tree, rebalance, and remove
+   the first key in the second range. */
+static void
+stest(uint32_t nshards, int argc, char **argv)
+{
+    aatrees_t *s = aatrees_create(nshards, scompare, sswap, skey,
+                                  NULL, skeycmp, skeydup);
+    snode_t *snodes = calloc(argc, sizeof(snode_t));
+    aatree_node_t **nodes = calloc(argc, sizeof(aatree_node_t *));
+
+    for (int i = 0 ; i < argc ; i++)
+    {
+        aatree_init_node(&snodes[i].n);
+        snodes[i].key = strdup(argv[i]);
+        nodes[i] = &snodes[i].n;
+    }
+    printf("Shards: %u\n", (unsigned)nshards);
+    aatrees_insert_batch(s, nodes, argc, 2);
+    pshards(s);
+    aatrees_rebalance(s);
+    printf("Rebalanced\n");
+    pshards(s);
+    if (s->nranges > 1)
+    {
+        char *key = strdup(s->range[1].low);
+        aatree_node_t *n;
+
+        printf("Removing: %s\n", key);
+        if ((n = aatrees_remove_node(s, key, NULL)) == NULL)
+            printf("  Not removed\n");
+        if (aatrees_find_key(s, key, NULL) != NULL)
+            printf("  Still found\n");
+        free(key);
+        pshards(s);
+    }
+    for (int i = 0 ; i < argc ; i++)
+        free(snodes[i].key);
+    free(nodes);
+    free(snodes);
+    aatrees_destroy(s);
+}
+
+static atomic_uint PCount;
+
+static bool
+pcount(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    UNUSED(n);
+    atomic_fetch_add(&PCount, 1);
+    return true;
+}
+
+/* Concatenate the keys, for the ordered reduction */
+static void *
+cinit(aatree_t *t, void *arg)
+{
+    UNUSED(t);
+    UNUSED(arg);
+    char **accp = malloc(sizeof(char *));
+
+    *accp = calloc(1, 1);
+    return accp;
+}
+
+static void
+cfold(aatree_t *t, void *acc, aatree_node_t *n)
+{
+    UNUSED(t);
+    char **accp = acc, *key = ((snode_t *)n)->key;
+    size_t len = strlen(*accp);
+
+    *accp = realloc(*accp, len + strlen(key) + 2);
+    sprintf(*accp + len, " %s", key);
+}
+
+static void
+ccombine(aatree_t *t, void *acc, void *other)
+{
+    UNUSED(t);
+    char **accp = acc, **otherp = other;
+    size_t len = strlen(*accp);
+
+    *accp = realloc(*accp, len + strlen(*otherp) + 1);
+    strcpy(*accp + len, *otherp);
+    free(*otherp);
+    free(otherp);
+}
+
+/* Build a tree from the keys with aatree_build_parallel(), and
+   traverse it in parallel */
+static void
+btest(unsigned threads, int argc, char **argv)
+{
+    aatree_t t = { .compare = scompare, .swap = sswap, .key = skey };
+    snode_t *snodes = calloc(argc, sizeof(snode_t));
+    aatree_node_t **nodes = calloc(argc, sizeof(aatree_node_t *));
+
+    for (int i = 0 ; i < argc ; i++)
+    {
+        aatree_init_node(&snodes[i].n);
+        snodes[i].key = strdup(argv[i]);
+        if ((snodes[i].value = strchr(snodes[i].key, ':')) != NULL)
+            *snodes[i].value++ = '\0';
+        nodes[i] = &snodes[i].n;
+    }
+    printf("Build: %u threads\n", threads);
+    if (! aatree_build_parallel(&t, nodes, argc, threads))
+        printf("aatree_build_parallel failed\n");
+    if (! aatree_each(&t, cnode))
+        printf("aatree_each cnode returned false\n");
+    ptree(t.root, 0);
+    printf("--------------------\n");
+    printf("Order:");
+    if (! aatree_each(&t, pnode))
+        printf("aatree_each pnode returned false\n");
+    printf("\n--------------------\n");
+    atomic_init(&PCount, 0);
+    if (! aatree_each_parallel(&t, pcount, threads, false))
+        printf("aatree_each_parallel returned false\n");
+    printf("Parallel count: %u\n", (unsigned)atomic_load(&PCount));
+    printf("Parallel order:");
+    if (! aatree_each_parallel(&t, pnode, threads, true))
+        printf("aatree_each_parallel returned false\n");
+    printf("\n");
+
+    char **accp = aatree_reduce_parallel(&t, cinit, cfold, ccombine,
+                                         NULL, threads, true);
+
+    printf("Reduced:%s\n", *accp);
+    printf("--------------------\n");
+    free(*accp);
+    free(accp);
+    for (int i = 0 ; i < argc ; i++)
+        free(snodes[i].key);
+    free(nodes);
+    free(snodes);
+}
+
+static size_t
+scount(aatree_node_t *n)
+{
+    return (n == NULL ? 0 : ((snode_t *)n)->count);
+}
+
+static void
+supdate(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    ((snode_t *)n)->count =
+        1 + scount(aatree_left(n)) + scount(aatree_right(n));
+}
+
+static bool
+scheck(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    size_t count = 1 + scount(aatree_left(n)) + scount(aatree_right(n));
+
+    if (scount(n) != count)
+        printf("Node %s has count %lu, not %lu\n",
+               ((snode_t *)n)->key, (unsigned long)scount(n),
+               (unsigned long)count);
+    return true;
+}
+
+static void
+sfold(aatree_t *t, void *acc, aatree_node_t *n, bool subtree)
+{
+    UNUSED(t);
+    *(size_t *)acc += (subtree ? scount(n) : 1);
+}
+
+static void
+pcount_range(aatree_t *t, char *lo, char *hi)
+{
+    size_t count = 0;
+
+    if (! aatree_aggregate(t, lo, hi, sfold, &count))
+        printf("aatree_aggregate returned false\n");
+    printf("Count in [%s, %s): %lu\n",
+           (lo == NULL ? "-" : lo), (hi == NULL ? "-" : hi),
+           (unsigned long)count);
+}
+
+/* Insert the keys in a tree with subtree counts, and count the nodes in
+   the range 'lo/hi' ("-" is unbounded), while inserting, and while
+   removing the keys again. */
+static void
+atest(char *range, int argc, char **argv)
+{
+    aatree_t t = { .compare = scompare, .swap = sswap, .key = skey,
+                   .update = supdate };
+    snode_t *snodes = calloc(argc, sizeof(snode_t));
+    char *lo = strdup(range), *hi = strchr(lo, '/');
+
+    if (hi == NULL)
+    {
+        free(lo);
+        free(snodes);
+        usage();
+    }
+    *hi++ = '\0';
+    printf("Aggregate: [%s, %s)\n", lo, hi);
+    for (int i = 0 ; i < argc ; i++)
+    {
+        aatree_init_node(&snodes[i].n);
+        snodes[i].key = argv[i];
+        aatree_insert_node(&t, argv[i], &snodes[i].n);
+        (void)aatree_each(&t, scheck);
+        printf("Inserted %s: ", argv[i]);
+        pcount_range(&t, (strcmp(lo, "-") == 0 ? NULL : lo),
+                     (strcmp(hi, "-") == 0 ? NULL : hi));
+    }
+    for (int i = 0 ; i < argc ; i++)
+    {
+        if (aatree_remove_node(&t, argv[i], NULL) == NULL)
+            printf("Didn't remove %s\n", argv[i]);
+        (void)aatree_each(&t, scheck);
+        printf("Removed %s: ", argv[i]);
+        pcount_range(&t, (strcmp(lo, "-") == 0 ? NULL : lo),
+                     (strcmp(hi, "-") == 0 ? NULL : hi));
+    }
+    printf("--------------------\n");
+    free(lo);
+    free(snodes);
+}
+
+static bool
+pinterval(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    aatreei_node_t *in = (aatreei_node_t *)n;
+
+    printf(" [%ld,%ld)", (long)in->iv.start, (long)in->iv.end);
+    return true;
+}
+
+static bool
+icheck(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    aatreei_node_t *in = (aatreei_node_t *)n;
+    aatreei_point_t maxend = in->iv.end;
+
+    aatreei_node_t *l = (aatreei_node_t *)aatree_left(n);
+    aatreei_node_t *r = (aatreei_node_t *)aatree_right(n);
+
+    if (l != NULL && l->maxend > maxend)
+        maxend = l->maxend;
+    if (r != NULL && r->maxend > maxend)
+        maxend = r->maxend;
+    if (in->maxend != maxend)
+        printf("Node [%ld,%ld) has max end %ld, not %ld\n",
+               (long)in->iv.start, (long)in->iv.end,
+               (long)in->maxend, (long)maxend);
+    return true;
+}
+
+static void
+iquery(aatreei_t *t, char *query)
+{
+    char *b = strchr(query, '/');
+
+    aatree_each(&t->base, icheck);
+    printf("All:");
+    aatree_each(&t->base, pinterval);
+    putchar('\n');
+    if (b == NULL)
+    {
+        printf("Stab %s:", query);
+        aatreei_stab(t, atol(query), pinterval);
+    }
+    else
+    {
+        printf("Overlap [%ld,%ld):", atol(query), atol(b+1));
+        aatreei_overlap(t, atol(query), atol(b+1), pinterval);
+    }
+    putchar('\n');
+}
+
+/* Insert the intervals "start-end" in an interval tree, and query it
+   for overlaps with "a/b", or stabbing "p". Then remove the first
+   interval and query again. */
+static void
+itest(char *query, int argc, char **argv)
+{
+    aatreei_t t;
+    aatreei_node_t *inodes = calloc(argc, sizeof(aatreei_node_t));
+
+    aatreei_init(&t, NULL);
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char *end = strchr(argv[i], '-');
+
+        aatreei_insert(&t, &inodes[i], atol(argv[i]),
+                       (end == NULL ? atol(argv[i]) : atol(end+1)));
+    }
+    iquery(&t, query);
+    if (argc > 0)
+    {
+        aatreei_node_t *in = aatreei_remove(&t, inodes[0].iv.start,
+                                            inodes[0].iv.end);
+
+        if (in == NULL)
+            printf("Didn't remove the first interval\n");
+        else
+            printf("Removed [%ld,%ld)\n",
+                   (long)in->iv.start, (long)in->iv.end);
+        iquery(&t, query);
+    }
+    printf("--------------------\n");
+    free(inodes);
+}
+
+static void
+pwide(aatreeb_t *t, aatreeb_key_t lo, aatreeb_key_t hi)
+{
+    aatreeb_iter_t iter;
+    aatreeb_key_t key;
+    void *value;
+
+    printf("Count: %lu, height: %lu\n",
+           (unsigned long)aatreeb_count(t), (unsigned long)aatreeb_height(t));
+    printf("Order:");
+    aatreeb_iter_init(t, &iter);
+    while (aatreeb_iter_next(&iter, &key, &value))
+        printf(" %lu:%s", (unsigned long)key, (char *)value);
+    printf("\nRange [%lu,%lu):", (unsigned long)lo, (unsigned long)hi);
+    aatreeb_iter_range_init(t, lo, hi, &iter);
+    while (aatreeb_iter_next(&iter, &key, &value))
+        printf(" %lu:%s", (unsigned long)key, (char *)value);
+    putchar('\n');
+}
+
+/* Insert the numeric keys in a wide-node tree, with the arguments as
+   values, and list the range "lo/hi". Then remove the first key
+   and list again. */
+static void
+wtest(char *range, int argc, char **argv)
+{
+    aatreeb_t t;
+    char *hi = strchr(range, '/');
+
+    if (hi == NULL)
+        usage();
+    aatreeb_init(&t);
+    for (int i = 0 ; i < argc ; i++)
+        if (! aatreeb_insert(&t, strtoul(argv[i], NULL, 10), argv[i]))
+            printf("aatreeb_insert failed\n");
+    pwide(&t, strtoul(range, NULL, 10), strtoul(hi+1, NULL, 10));
+    if (argc > 0)
+    {
+        void *value;
+
+        if (! aatreeb_remove(&t, strtoul(argv[0], NULL, 10), &value))
+            printf("Didn't remove %s\n", argv[0]);
+        else
+            printf("Removed %s\n", (char *)value);
+        pwide(&t, strtoul(range, NULL, 10), strtoul(hi+1, NULL, 10));
+    }
+    printf("--------------------\n");
+    aatreeb_destroy(&t, NULL);
+}
+
+/* Insert the keys through a write buffer of 'size' nodes, look them
+   up, and remove the first one before the last flush. */
+static void
+buftest(size_t size, int argc, char **argv)
+{
+    aatree_t t = { .compare = scompare, .swap = sswap, .key = skey };
+    snode_t *snodes = calloc(argc, sizeof(snode_t));
+    aatreew_t w;
+
+    if (! aatreew_init(&w, &t, size))
+    {
+        printf("aatreew_init failed\n");
+        free(snodes);
+        return;
+    }
+    for (int i = 0 ; i < argc ; i++)
+    {
+        aatree_init_node(&snodes[i].n);
+        snodes[i].key = strdup(argv[i]);
+        if ((snodes[i].value = strchr(snodes[i].key, ':')) != NULL)
+            *snodes[i].value++ = '\0';
+        aatreew_insert_node(&w, &snodes[i].n);
+    }
+    printf("Buffer: %lu, buffered: %lu\n",
+           (unsigned long)size, (unsigned long)w.n);
+    for (int i = 0 ; i < argc ; i++)
+        if (aatreew_find_key(&w, snodes[i].key, NULL) == NULL)
+            printf("Didn't find %s\n", snodes[i].key);
+    if (argc > 0)
+    {
+        char *key = strdup(snodes[0].key);
+        aatree_node_t *n = aatreew_remove_node(&w, key, NULL);
+
+        if (n == NULL)
+            printf("Didn't remove %s\n", key);
+        else
+            printf("Removed %s:%s\n", ((snode_t *)n)->key,
+                   (((snode_t *)n)->value == NULL ?
+                    "(null)" : ((snode_t *)n)->value));
+        free(key);
+    }
+    aatreew_fini(&w);
+    if (! aatree_each(&t, cnode))
+        printf("aatree_each cnode returned false\n");
+    ptree(t.root, 0);
+    printf("--------------------\n");
+    printf("Order:");
+    if (! aatree_each(&t, pnode))
+        printf("aatree_each pnode returned false\n");
+    printf("\n--------------------\n");
+    for (int i = 0 ; i < argc ; i++)
+        free(snodes[i].key);
+    free(snodes);
+}
+
+static void
+srelease(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    printf(" %s", ((snode_t *)n)->key);
+}
+
+/* Insert the keys, and destroy the tree releasing at most 'max' nodes
+   at a time. */
+static void
+dtest(size_t max, int argc, char **argv)
+{
+    aatree_t t = { .compare = scompare, .swap = sswap, .key = skey };
+    snode_t *snodes = calloc(argc, sizeof(snode_t));
+    bool done = false;
+
+    for (int i = 0 ; i < argc ; i++)
+    {
+        aatree_init_node(&snodes[i].n);
+        snodes[i].key = argv[i];
+        aatree_insert_node(&t, snodes[i].key, &snodes[i].n);
+    }
+    printf("Destroy: %lu at a time\n", (unsigned long)max);
+    for (int step = 1 ; ! done ; step++)
+    {
+        printf("Step %d:", step);
+        done = aatree_destroy_step(&t, max, srelease);
+        putchar('\n');
+    }
+    printf("--------------------\n");
+    free(snodes);
+}
+
+static void
+pends(aatree_t *t)
+{
+    printf("Min: %s, max: %s\n",
+           (aatree_min(t) == NULL ? "-" : ((snode_t *)aatree_min(t))->key),
+           (aatree_max(t) == NULL ? "-" : ((snode_t *)aatree_max(t))->key));
+}
+
+/* Insert the keys, pop the first and the last, and then pop up to n
+   from the start, with keys below 'below' if given as "n/below". */
+static void
+ptest(char *arg, int argc, char **argv)
+{
+    aatree_t t = { .compare = scompare, .swap = sswap, .key = skey };
+    snode_t *snodes = calloc(argc, sizeof(snode_t));
+    aatree_node_t **nodes = calloc(argc + 1, sizeof(aatree_node_t *));
+    size_t n = strtoul(arg, NULL, 10), m;
+    char *below = strchr(arg, '/');
+    aatree_node_t *x;
+
+    if (below != NULL)
+        below += 1;
+    for (int i = 0 ; i < argc ; i++)
+    {
+        aatree_init_node(&snodes[i].n);
+        snodes[i].key = strdup(argv[i]);
+        if ((snodes[i].value = strchr(snodes[i].key, ':')) != NULL)
+            *snodes[i].value++ = '\0';
+        aatree_insert_node(&t, snodes[i].key, &snodes[i].n);
+    }
+    pends(&t);
+    if ((x = aatree_pop_min(&t)) != NULL)
+    {
+        printf("Popped min:");
+        (void)pnode(&t, x);
+        putchar('\n');
+    }
+    if ((x = aatree_pop_max(&t)) != NULL)
+    {
+        printf("Popped max:");
+        (void)pnode(&t, x);
+        putchar('\n');
+    }
+    pends(&t);
+    m = aatree_pop_min_n(&t, nodes, (n > (size_t)argc ? (size_t)argc : n),
+                         below);
+    printf("Popped %lu:", (unsigned long)m);
+    for (size_t i = 0 ; i < m ; i++)
+        (void)pnode(&t, nodes[i]);
+    putchar('\n');
+    pends(&t);
+    if (! aatree_each(&t, cnode))
+        printf("aatree_each cnode returned false\n");
+    ptree(t.root, 0);
+    printf("--------------------\n");
+    for (int i = 0 ; i < argc ; i++)
+        free(snodes[i].key);
+    free(nodes);
+    free(snodes);
+}
+
+static void
+efree(void *value)
+{
+    printf(" %s", (char *)value);
+    free(value);
+}
+
+static bool
+pexpiry(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    printf(" %s@%lu", aatree_key(n), (unsigned long)aatreem_expiry(n));
+    return true;
+}
+
+/* Insert the keys, with the values as expiry times, and expire at most
+   'budget' of them at 'now', given as "now/budget". Then look them all
+   up, and expire the rest. */
+static void
+etest(char *arg, int argc, char **argv)
+{
+    aatree_t *t = aatreem_create(0);
+    uint64_t now = strtoul(arg, NULL, 10);
+    char *budget = strchr(arg, '/');
+    size_t n;
+
+    if (budget == NULL)
+        usage();
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char *key = strdup(argv[i]);
+        char *when = strchr(key, ':');
+        aatree_node_t *x;
+
+        if (when != NULL)
+            *when++ = '\0';
+        if (! aatreem_insert(t, key, key))
+            printf("aatreem_insert failed\n");
+        else if (when != NULL &&
+                 ((x = aatreem_find(t, key)) == NULL ||
+                  ! aatreem_set_expiry(t, x, strtoul(when, NULL, 10))))
+            printf("aatreem_set_expiry failed for %s\n", key);
+    }
+    printf("Expiry:");
+    (void)aatree_each(t, pexpiry);
+    printf("\nExpired at %lu:", (unsigned long)now);
+    n = aatreem_expire(t, now, strtoul(budget+1, NULL, 10), efree);
+    printf("\nCount: %lu\nFound:", (unsigned long)n);
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char *key = strdup(argv[i]);
+        char *when = strchr(key, ':');
+
+        if (when != NULL)
+            *when = '\0';
+        if (aatreem_find(t, key) != NULL)
+            printf(" %s", key);
+        free(key);
+    }
+    printf("\nExpired the rest:");
+    n = aatreem_expire(t, now, SIZE_MAX, efree);
+    printf("\nCount: %lu\n", (unsigned long)n);
+    if (! aatree_each(t, cnode))
+        printf("aatree_each cnode returned false\n");
+    ptree(t->root, 0);
+    printf("--------------------\n");
+    aatreem_destroy(t, free);
+}
+
+static void
+levict(aatree_t *t, const char *key, void *value)
+{
+    UNUSED(t);
+    UNUSED(value);
+    printf("Evicted %s\n", key);
+}
+
+/* Insert the keys in a tree bounded to 'max' keys, except for those
+   starting with '+', which are looked up instead. */
+static void
+ltest(size_t max, int argc, char **argv)
+{
+    aatree_t *t = aatreem_create(0);
+    aatreem_capacity_stats_t stats;
+
+    aatreem_capacity_attach(t, max, 0, levict);
+    for (int i = 0 ; i < argc ; i++)
+        if (argv[i][0] != '+')
+            (void)aatreem_insert(t, argv[i], NULL);
+        else if (aatreem_find(t, argv[i]+1) == NULL)
+            printf("Miss %s\n", argv[i]+1);
+        else
+            printf("Hit %s\n", argv[i]+1);
+    printf("Order:");
+    (void)aatree_each(t, pnode);
+    aatreem_capacity_stats(t, &stats);
+    printf("\nEntries: %lu, hits: %lu, misses: %lu, evictions: %lu\n",
+           (unsigned long)stats.entries, (unsigned long)stats.hits,
+           (unsigned long)stats.misses, (unsigned long)stats.evictions);
+    if (! aatree_each(t, cnode))
+        printf("aatree_each cnode returned false\n");
+    printf("--------------------\n");
+    aatreem_destroy(t, NULL);
+}
+
+static bool
+gchange(const aatreem_change_t *c, void *arg)
+{
+    static const char *ops[] = { "insert", "replace", "delete", "rename" };
+
+    printf("%lu %s %s", (unsigned long)c->seq, ops[c->op], c->key);
+    if (c->newkey != NULL)
+        printf(" %s", c->newkey);
+    if (c->value != NULL)
+        printf(":%s", (char *)c->value);
+    printf("\n");
+    if (! aatreem_feed_apply(arg, c))
+        printf("aatreem_feed_apply failed\n");
+    return true;
+}
+
+/* Make the changes to a tree with a feed of 'size' bytes: insert "key"
+   or "key:val", delete "-key", replace "=key:val", and rename
+   "old/new". Then drain the feed into a replica, and compare them. */
+static void
+gtest(size_t size, int argc, char **argv)
+{
+    aatree_t *t = aatreem_create(0);
+    aatree_t *replica = aatreem_create(0);
+    aatreem_feed_t *f = aatreem_feed_attach(t, size);
+    char **keys = calloc(argc + 1, sizeof(char *));
+
+    if (f == NULL || keys == NULL)
+    {
+        printf("aatreem_feed_attach failed\n");
+        return;
+    }
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char *key = keys[i] = strdup(argv[i]);
+        char *val = strchr(key, ':');
+        char *newkey = strchr(key, '/');
+
+        if (val != NULL)
+            *val++ = '\0';
+        if (key[0] == '-')
+            (void)aatreem_delete(t, key+1, NULL, NULL);
+        else if (key[0] == '=')
+            (void)aatreem_replace(t, key+1, val, NULL);
+        else if (newkey != NULL)
+        {
+            *newkey++ = '\0';
+            (void)aatreem_rename(t, key, newkey);
+        }
+        else
+            (void)aatreem_insert(t, key, val);
+    }
+    printf("Drained: %lu\n",
+           (unsigned long)aatreem_feed_drain(f, SIZE_MAX, gchange, replica));
+    printf("Lost: %lu\nOrder:", (unsigned long)aatreem_feed_lost(f));
+    (void)aatree_each(t, pnode);
+    printf("\nReplica:");
+    (void)aatree_each(replica, pnode);
+    printf("\n");
+    if (! aatree_each(replica, cnode))
+        printf("aatree_each cnode returned false\n");
+    printf("--------------------\n");
+    aatreem_destroy(replica, NULL);
+    aatreem_destroy(t, NULL);
+    for (int i = 0 ; i < argc ; i++)
+        free(keys[i]);
+    free(keys);
+}
+
+static size_t
+jencode(const void *value, const void **bytesp)
+{
+    *bytesp = value;
+    return (value == NULL ? 0 : strlen(value) + 1);
+}
+
+static void *
+jdecode(const void *bytes, size_t len)
+{
+    return (len == 0 ? NULL : memcpy(malloc(len), bytes, len));
+}
+
+/* Damage the end of the log as a crash could: append half a record
+   header by default, cut the last record short with "cut", or change
+   its last byte with "crc". */
+static void
+jcrash(const char *file, const char *crash)
+{
+    FILE *f;
+    long size;
+
+    if ((f = fopen(file, (crash == NULL ? "a" : "r+"))) == NULL)
+        return;
+    if (crash == NULL)
+        fwrite("\x30\0\0\0\1\2\3\4zz", 10, 1, f);
+    else if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0)
+    {
+        if (strcmp(crash, "cut") == 0)
+        {
+            if (ftruncate(fileno(f), size - 3) < 0)
+                printf("ftruncate failed\n");
+        }
+        else if (fseek(f, -1, SEEK_END) == 0)
+        {
+            int c = getc(f);
+
+            fseek(f, -1, SEEK_END);
+            putc(c ^ 0x55, f);
+        }
+    }
+    fclose(f);
+}
+
+/* Make the changes to a logged tree, as for gtest(), with the changes
+   written in groups of 'group' bytes, and "!" for a snapshot. Then
+   damage the log, as if it crashed, and recover. */
+static void
+jtest(size_t group, const char *crash, int argc, char **argv)
+{
+    aatreel_options_t opts = {
+        .sync = aatreel_sync_commit, .group_bytes = group,
+        .encode = jencode, .decode = jdecode, .freefun = free
+    };
+    char dir[64], file[128];
+    aatree_t *t = aatreem_create(0);
+    char **keys = calloc(argc + 1, sizeof(char *));
+    aatreel_t *l;
+
+    snprintf(dir, sizeof(dir), "/tmp/aatree-test-%ld", (long)getpid());
+    if ((l = aatreel_open(t, dir, &opts)) == NULL)
+    {
+        printf("aatreel_open failed\n");
+        return;
+    }
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char *key = keys[i] = strdup(argv[i]);
+        char *val = strchr(key, ':');
+        char *newkey = strchr(key, '/');
+
+        if (val != NULL)
+            *val++ = '\0';
+        if (strcmp(key, "!") == 0)
+        {
+            if (! aatreel_snapshot(l))
+                printf("aatreel_snapshot failed\n");
+        }
+        else if (key[0] == '-')
+            (void)aatreem_delete(t, key+1, NULL, NULL);
+        else if (key[0] == '=')
+            (void)aatreem_replace(t, key+1, val, NULL);
+        else if (newkey != NULL)
+        {
+            *newkey++ = '\0';
+            (void)aatreem_rename(t, key, newkey);
+        }
+        else
+            (void)aatreem_insert(t, key, val);
+    }
+    printf("Order:");
+    (void)aatree_each(t, pnode);
+    printf("\n");
+    if (! aatreel_close(l))
+        printf("aatreel_close failed\n");
+    snprintf(file, sizeof(file), "%s/log", dir);
+    jcrash(file, crash);
+    aatreem_destroy(t, NULL);
+    t = aatreem_create(0);
+    if ((l = aatreel_open(t, dir, &opts)) == NULL)
+        printf("aatreel_open failed again\n");
+    else
+    {
+        printf("Recovered:");
+        (void)aatree_each(t, pnode);
+        printf("\n");
+        if (! aatree_each(t, cnode))
+            printf("aatree_each cnode returned false\n");
+        (void)aatreel_close(l);
+    }
+    aatreem_destroy(t, free);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s/snapshot", dir);
+    unlink(file);
+    rmdir(dir);
+    printf("--------------------\n");
+    for (int i = 0 ; i < argc ; i++)
+        free(keys[i]);
+    free(keys);
+}
+
+/* Insert the keys, and list those starting with 'prefix' */
+static void
+ntest(char *prefix, int argc, char **argv)
+{
+    aatree_t *t = aatreem_create(0);
+    aatreem_prefix_iter_t iter;
+    aatree_node_t *n;
+
+    for (int i = 0 ; i < argc ; i++)
+        (void)aatreem_insert(t, argv[i], NULL);
+    printf("Prefix %s:", prefix);
+    if (! aatreem_prefix_iter_init(t, prefix, &iter))
+        printf(" aatreem_prefix_iter_init failed");
+    while ((n = aatreem_prefix_iter_next(&iter)) != NULL)
+        printf(" %s", aatree_key(n));
+    printf("\nCount: %lu\n", (unsigned long)aatreem_prefix_count(t, prefix));
+    printf("--------------------\n");
+    aatreem_destroy(t, NULL);
+}
+
+/* Decode the "%xx" in the key in place.
+   Returns the length. */
+static size_t
+yunescape(char *key)
+{
+    char *p = key;
+
+    for (char *s = key ; *s != '\0' ; s++)
+    {
+        unsigned x;
+
+        if (s[0] == '%' && sscanf(s+1, "%2x", &x) == 1)
+        {
+            *p++ = (char)x;
+            s += 2;
+        }
+        else
+            *p++ = *s;
+    }
+    return (size_t)(p - key);
+}
+
+static void
+ykey(const char *key, size_t len)
+{
+    putchar(' ');
+    for (size_t i = 0 ; i < len ; i++)
+        if (key[i] > ' ' && key[i] <= '~' && key[i] != '%')
+            putchar(key[i]);
+        else
+            printf("%%%02x", (unsigned char)key[i]);
+}
+
+static bool
+ynode(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    const aatreem_bkey_t *k = aatreem_bkey(n);
+    char *val = aatree_value(n);
+
+    ykey(k->data, k->len);
+    if (val != NULL)
+        printf(":%s", val);
+    return true;
+}
+
+static bool
+ychange(const aatreem_change_t *c, void *arg)
+{
+    static const char *ops[] = { "insert", "replace", "delete", "rename" };
+
+    printf("%lu %s", (unsigned long)c->seq, ops[c->op]);
+    ykey(c->key, c->keylen);
+    if (c->newkey != NULL)
+        ykey(c->newkey, c->newkeylen);
+    printf("\n");
+    if (! aatreem_feed_apply(arg, c))
+        printf("aatreem_feed_apply failed\n");
+    return true;
+}
+
+/* As gtest(), with binary keys, with "%xx" for any byte, and "?key" to
+   find the key. The tree has a hash index, and is compacted at the end. */
+static void
+ytest(int argc, char **argv)
+{
+    aatree_t *t = aatreem_create_binary(0);
+    aatree_t *replica = aatreem_create_binary(0);
+    aatreem_feed_t *f = aatreem_feed_attach(t, 4096);
+    char **keys = calloc(argc + 1, sizeof(char *));
+
+    if (f == NULL || keys == NULL || ! aatreem_index_attach(t))
+    {
+        printf("ytest setup failed\n");
+        return;
+    }
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char *key = keys[i] = strdup(argv[i]);
+        char *val = strchr(key, ':');
+        char *newkey = strchr(key, '/');
+        aatree_node_t *n;
+
+        if (val != NULL)
+            *val++ = '\0';
+        if (newkey != NULL)
+            *newkey++ = '\0';
+        if (key[0] == '-')
+            (void)aatreem_bdelete(t, key+1, yunescape(key+1), NULL, NULL);
+        else if (key[0] == '=')
+            (void)aatreem_breplace(t, key+1, yunescape(key+1), val, NULL);
+        else if (key[0] == '?')
+        {
+            size_t len = yunescape(key+1);
+
+            printf("Find");
+            ykey(key+1, len);
+            if ((n = aatreem_bfind(t, key+1, len)) == NULL)
+                printf(": not found\n");
+            else if (aatree_value(n) == NULL)
+                printf(": found\n");
+            else
+                printf(": found %s\n", (char *)aatree_value(n));
+        }
+        else if (newkey != NULL)
+        {
+            size_t len = yunescape(key);
+
+            (void)aatreem_brename(t, key, len, newkey, yunescape(newkey));
+        }
+        else
+            (void)aatreem_binsert(t, key, yunescape(key), val);
+    }
+    printf("Drained: %lu\n",
+           (unsigned long)aatreem_feed_drain(f, SIZE_MAX, ychange, replica));
+    printf("Order:");
+    (void)aatree_each(t, ynode);
+    printf("\nReplica:");
+    (void)aatree_each(replica, ynode);
+    if (! aatreem_compact(t))
+        printf("\naatreem_compact failed");
+    printf("\nCompacted:");
+    (void)aatree_each(t, ynode);
+    printf("\n");
+    if (! aatree_each(t, cnode) || ! aatree_each(replica, cnode))
+        printf("aatree_each cnode returned false\n");
+    printf("--------------------\n");
+    aatreem_destroy(replica, NULL);
+    aatreem_destroy(t, NULL);
+    for (int i = 0 ; i < argc ; i++)
+        free(keys[i]);
+    free(keys);
+}
+
+static bool
+mnode(const char *key, uint64_t value, void *arg)
+{
+    UNUSED(arg);
+    printf(" %s:%lu", key, (unsigned long)value);
+    return true;
+}
+
+static void
+mfind(aatreex_t *x, int argc, char **argv)
+{
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char *key = strdup(argv[i]);
+        char *val = strchr(key, ':');
+        uint64_t value;
+
+        if (val != NULL)
+            *val = '\0';
+        if (aatreex_find(x, key, &value))
+            printf(" %s:%lu", key, (unsigned long)value);
+        free(key);
+    }
+}
+
+/* Insert the keys, as key:value with numeric values, or else with their
+   position as the value, in a tree in a shared memory object of 'size'
+   bytes. A child process opens it, finds the keys, and deletes the first
+   one. Then the parent finds them, and opens it again. */
+static void
+mtest(size_t size, int argc, char **argv)
+{
+    char name[64];
+    aatreex_t *x;
+    pid_t pid;
+
+    snprintf(name, sizeof(name), "/aatree-test-%ld", (long)getpid());
+    if ((x = aatreex_open(name, size)) == NULL)
+    {
+        printf("aatreex_open failed\n");
+        return;
+    }
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char *key = strdup(argv[i]);
+        char *val = strchr(key, ':');
+
+        if (val != NULL)
+            *val++ = '\0';
+        if (! aatreex_replace(x, key,
+                              (val == NULL ? (uint64_t)i :
+                               strtoull(val, NULL, 10))))
+            printf("aatreex_replace failed for %s\n", key);
+        free(key);
+    }
+    printf("Order:");
+    (void)aatreex_each(x, mnode, NULL);
+    printf("\nCount: %lu\n", (unsigned long)aatreex_count(x));
+    fflush(stdout);
+    if ((pid = fork()) == 0)
+    {
+        aatreex_t *y = aatreex_open(name, 0);
+
+        if (y == NULL)
+            printf("Child: aatreex_open failed\n");
+        else
+        {
+            printf("Child found:");
+            mfind(y, argc, argv);
+            printf("\n");
+            if (argc > 0)
+            {
+                char *key = strdup(argv[0]);
+
+                key[strcspn(key, ":")] = '\0';
+                if (! aatreex_delete(y, key, NULL))
+                    printf("Child: didn't delete %s\n", key);
+                free(key);
+            }
+            aatreex_close(y);
+        }
+        fflush(stdout);
+        _exit(0);
+    }
+    if (pid < 0)
+        printf("fork failed\n");
+    else
+        (void)waitpid(pid, NULL, 0);
+    printf("Found:");
+    mfind(x, argc, argv);
+    printf("\nCount: %lu\n", (unsigned long)aatreex_count(x));
+    aatreex_close(x);
+    if ((x = aatreex_open(name, 0)) == NULL)
+        printf("aatreex_open failed again\n");
+    else
+    {
+        printf("Reopened:");
+        (void)aatreex_each(x, mnode, NULL);
+        printf("\n");
+        aatreex_close(x);
+    }
+    if (! aatreex_unlink(name))
+        printf("aatreex_unlink failed\n");
+    printf("--------------------\n");
+}
+
+static int
+tcompare(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+static void
+twalker(const void *nodep, aatreet_visit_t which, int depth)
+{
+    if (which == aatreet_postorder || which == aatreet_leaf)
+    {
+        for (int i = depth ; i > 0 ; i--)
+            printf("  ");
+        printf("%s\n", *(char **)nodep);
+    }
+}
+
+static void
+twalker_r(const void *nodep, aatreet_visit_t which, void *closure)
+{
+    if (which == aatreet_postorder || which == aatreet_leaf)
+    {
+        *(int *)closure += 1;
+        printf(" %s", *(char **)nodep);
+    }
+}
+
+static void
+tfree(void *key)
+{
+    printf(" %s", (char *)key);
+}
+
+/* Check that the nodes of the keys not yet deleted still point to them */
+static void
+tcheck(char ***node, char **argv, int from, int argc)
+{
+    for (int i = from ; i < argc ; i++)
+        if (node[i] != NULL && *node[i] != argv[i])
+            printf("Node of %s moved\n", argv[i]);
+}
+
+/* Insert the keys with the tsearch(3) layer, delete the first one, and
+   destroy the tree. Then insert them again and delete them all, which
+   must leave the root NULL. The nodes must stay put in between. */
+static void
+ttest(int argc, char **argv)
+{
+    void *root = NULL;
+    int count = 0;
+    char ***node = calloc(argc + 1, sizeof(char **));
+
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char **p = aatreet_search(argv[i], &root, tcompare);
+
+        if (p == NULL)
+            printf("aatreet_search failed\n");
+        else if (*p != argv[i])
+            printf("Duplicate %s\n", argv[i]);
+        else
+            node[i] = p;
+    }
+    aatreet_walk(root, twalker);
+    printf("--------------------\n");
+    for (int i = 0 ; i < argc ; i++)
+        if (aatreet_find(argv[i], &root, tcompare) == NULL)
+            printf("Didn't find %s\n", argv[i]);
+    if (argc > 0)
+    {
+        char **parent = aatreet_delete(argv[0], &root, tcompare);
+
+        if (parent == NULL)
+            printf("Didn't delete %s\n", argv[0]);
+        else if (root != NULL && parent != (char **)&root)
+            printf("Parent: %s\n", *parent);
+        tcheck(node, argv, 1, argc);
+        if (aatreet_delete(argv[0], &root, tcompare) != NULL)
+            printf("Deleted %s twice\n", argv[0]);
+        if (aatreet_find(argv[0], &root, tcompare) != NULL)
+            printf("Found deleted %s\n", argv[0]);
+    }
+    printf("Order:");
+    aatreet_walk_r(root, twalker_r, &count);
+    printf("\nCount: %d\n", count);
+    printf("Destroy:");
+    aatreet_destroy(root, tfree);
+    printf("\n");
+    root = NULL;
+    for (int i = 0 ; i < argc ; i++)
+    {
+        char **p = aatreet_search(argv[i], &root, tcompare);
+
+        node[i] = (p != NULL && *p == argv[i] ? p : NULL);
+    }
+    for (int i = 0 ; i < argc ; i++)
+    {
+        (void)aatreet_delete(argv[i], &root, tcompare);
+        tcheck(node, argv, i+1, argc);
+    }
+    printf("Root after deleting all: %s\n",
+           (root == NULL ? "NULL" : "not NULL"));
+    printf("--------------------\n");
+    free(node);
+}
+
 static void
 usage(void)
 {
-    fprintf(stderr, "aatree-test [-D|-r|-u|-R old/new] [-v] [-d <key>[:<val>]] [-f <key>[:<val>]] keys...\n");
+    fprintf(stderr, "aatree-test [-D|-r|-u|-R old/new] [-C] [-E now/budget] [-F keys] [-G size] [-A lo/hi] [-B threads] [-I a/b|p] [-J group[/cut|crc]] [-K entries] [-L max] [-M size] [-N prefix] [-P n[/below]] [-S shards] [-T] [-W lo/hi] [-X] [-Y] [-w size] [-x max] [-v] [-d <key>[:<val>]] [-f <key>[:<val>]] keys...\n");
     exit(1);
 }
 
@@ -144,23 +1410,100 @@ int
 main(int argc, char **argv)
 {
     int c;
-    char *delkey, *findkey, *oldkey = NULL, *newkey = NULL;
+    char *delkey, *findkey, *oldkey = NULL, *newkey = NULL, *range = NULL,
+        *query = NULL, *wrange = NULL, *pop = NULL, *expire = NULL,
+        *prefix = NULL, *crash = NULL;
     bool verbose = false, delete = false, find = false, unique = false,
-        replace = false, rename = false, height = false;
-    uint32_t count = 0;
+        replace = false, rename = false, height = false, compact = false,
+        index = false, tsearch = false, binary = false;
+    uint32_t count = 0, shards = 0, threads = 0, bufsize = 0, dmax = 0,
+        cachesize = 0, bloomsize = 0, capacity = 0, shmsize = 0,
+        feedsize = 0, group = 0;
     taatree_t *root = NULL;
 
     opterr = 0;
-    while ((c = getopt(argc, argv, "HR:d:f:ruv")) != EOF)
+    while ((c = getopt(argc, argv, "A:B:CE:F:G:HI:J:K:L:M:N:P:R:S:TW:XYd:f:ruvw:x:")) != EOF)
         switch (c)
         {
+        case 'A':
+            range = optarg;
+            break;
+        case 'B':
+            threads = (uint32_t)atoi(optarg);
+            if (threads == 0)
+                usage();
+            break;
+        case 'C':
+            compact = true;
+            break;
+        case 'E':
+            expire = optarg;
+            break;
+        case 'F':
+            bloomsize = (uint32_t)atoi(optarg);
+            if (bloomsize == 0)
+                usage();
+            break;
+        case 'G':
+            feedsize = (uint32_t)atoi(optarg);
+            if (feedsize == 0)
+                usage();
+            break;
         case 'H':
             height = true;
             break;
+        case 'I':
+            query = optarg;
+            break;
+        case 'J':
+            group = (uint32_t)atoi(optarg);
+            if (group == 0)
+                usage();
+            if ((crash = strchr(optarg, '/')) != NULL)
+                crash += 1;
+            break;
+        case 'K':
+            cachesize = (uint32_t)atoi(optarg);
+            if (cachesize == 0)
+                usage();
+            break;
+        case 'L':
+            capacity = (uint32_t)atoi(optarg);
+            if (capacity == 0)
+                usage();
+            break;
+        case 'M':
+            shmsize = (uint32_t)atoi(optarg);
+            if (shmsize == 0)
+                usage();
+            break;
+        case 'N':
+            prefix = optarg;
+            break;
+        case 'P':
+            pop = optarg;
+            break;
         case 'R':
             rename = true;
             oldkey = optarg;
             break;
+        case 'S':
+            shards = (uint32_t)atoi(optarg);
+            if (shards == 0)
+                usage();
+            break;
+        case 'W':
+            wrange = optarg;
+            break;
+        case 'T':
+            tsearch = true;
+            break;
+        case 'X':
+            index = true;
+            break;
+        case 'Y':
+            binary = true;
+            break;
         case 'd':
             delete = true;
             delkey = strdup(optarg);
@@ -178,6 +1521,16 @@ main(int argc, char **argv)
         case 'v':
             verbose = true;
             break;
+        case 'w':
+            bufsize = (uint32_t)atoi(optarg);
+            if (bufsize == 0)
+                usage();
+            break;
+        case 'x':
+            dmax = (uint32_t)atoi(optarg);
+            if (dmax == 0)
+                usage();
+            break;
         default:
             usage();
         }
@@ -185,6 +1538,12 @@ main(int argc, char **argv)
         usage();
 
     root = (taatree_t *)aatreem_create(sizeof(taatree_t));
+    if (cachesize > 0 && ! aatreem_cache_attach(&root->base, cachesize))
+        printf("aatreem_cache_attach failed\n");
+    if (index && ! aatreem_index_attach(&root->base))
+        printf("aatreem_index_attach failed\n");
+    if (bloomsize > 0 && ! aatreem_bloom_attach(&root->base, bloomsize))
+        printf("aatreem_bloom_attach failed\n");
 
     if (rename)
     {
@@ -255,6 +1614,17 @@ main(int argc, char **argv)
         if (! aatree_each(&root->base, cnode))
             printf("aatree_each cnode returned false\n");
     }
+    if (compact)
+    {
+        aatree_compact(&root->base);
+        if (! aatree_each(&root->base, cnode))
+            printf("aatree_each cnode returned false\n");
+        if (! aatreem_compact(&root->base))
+            printf("aatreem_compact failed\n");
+        if (! aatree_each(&root->base, cnode))
+            printf("aatree_each cnode returned false\n");
+        printf("Compacted\n");
+    }
     if (! verbose)
     {
         ptree(root->base.root, 0);
@@ -275,7 +1645,7 @@ main(int argc, char **argv)
 
         if (val != NULL)
             *val++ = '\0';
-        n = aatree_find_key(&root->base, key, NULL);
+        n = aatreem_find(&root->base, key);
         if (n == NULL)
             printf("Didn't find %s\n", argv[i]);
         free(key);
@@ -394,11 +1764,85 @@ main(int argc, char **argv)
         printf("\n--------------------\n");
         free(oldkey);
     }
+    if (cachesize > 0 || index || bloomsize > 0)
+    {
+        /* Again, after any delete or rename */
+        for (int i = optind ; i < argc ; i++)
+        {
+            char *key = strdup(argv[i]);
+            char *val = strchr(key, ':');
+
+            if (val != NULL)
+                *val = '\0';
+            if (aatreem_find(&root->base, key) == NULL)
+                printf("Didn't find %s\n", argv[i]);
+            free(key);
+        }
+        if (cachesize > 0)
+            printf("Cache: %lu hits, %lu misses\n",
+                   (unsigned long)root->base.cache->hits,
+                   (unsigned long)root->base.cache->misses);
+        if (bloomsize > 0)
+        {
+            aatree_bloom_t *b = root->base.bloom;
+
+            printf("Bloom: %lu rejects, %lu added, %lu removed\n",
+                   (unsigned long)b->rejects, (unsigned long)b->added,
+                   (unsigned long)b->removed);
+            if (! aatree_bloom_rebuild(&root->base))
+                printf("aatree_bloom_rebuild failed\n");
+            printf("Rebuilt: %lu added, %lu removed\n",
+                   (unsigned long)b->added, (unsigned long)b->removed);
+        }
+        printf("--------------------\n");
+    }
 
     if (! aatree_each(&root->base, abortminus))
         printf("Aborted on minus\n");
+#ifdef AATREE_STATS
+    if (verbose)
+    {
+        aatree_stats_t stats;
+
+        aatree_stats_get(&root->base, &stats);
+        aatree_stats_dump(&stats, stderr);
+    }
+#endif
 
     aatreem_destroy(&root->base, free);
 
+    if (shards > 0)
+        stest(shards, argc - optind, argv + optind);
+    if (threads > 0)
+        btest(threads, argc - optind, argv + optind);
+    if (range != NULL)
+        atest(range, argc - optind, argv + optind);
+    if (query != NULL)
+        itest(query, argc - optind, argv + optind);
+    if (wrange != NULL)
+        wtest(wrange, argc - optind, argv + optind);
+    if (bufsize > 0)
+        buftest(bufsize, argc - optind, argv + optind);
+    if (dmax > 0)
+        dtest(dmax, argc - optind, argv + optind);
+    if (pop != NULL)
+        ptest(pop, argc - optind, argv + optind);
+    if (expire != NULL)
+        etest(expire, argc - optind, argv + optind);
+    if (capacity > 0)
+        ltest(capacity, argc - optind, argv + optind);
+    if (tsearch)
+        ttest(argc - optind, argv + optind);
+    if (feedsize > 0)
+        gtest(feedsize, argc - optind, argv + optind);
+    if (group > 0)
+        jtest(group, crash, argc - optind, argv + optind);
+    if (prefix != NULL)
+        ntest(prefix, argc - optind, argv + optind);
+    if (binary)
+        ytest(argc - optind, argv + optind);
+    if (shmsize > 0)
+        mtest(shmsize, argc - optind, argv + optind);
+
     exit(0);
 }
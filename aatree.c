@@ -11,81 +11,307 @@
 
 #include "aatree.h"
 
+#ifdef AATREE_STATS
+#ifdef AATREE_STATS_THREAD
+static _Thread_local aatree_stats_t thread_stats;
+#define STATS(t) ((void)(t), &thread_stats)
+#else
+#define STATS(t) (&(t)->stats)
+#endif
+#define COUNT(t, counter) (STATS(t)->counter += 1)
+#else
+#define COUNT(t, counter) ((void)0)
+#endif
+
 void
 aatree_init_node(aatree_node_t *n)
 {
-    memset(n, 0, sizeof(struct aatree_s));
-    n->level = 1;
+    memset(n, 0, sizeof(aatree_node_t));
+    aatree_set_level(n, 1);
+}
+
+/* Recompute the node's aggregate, if any, after its subtree changed.
+   A rotation doesn't change the set of nodes below the new subtree root,
+   so only the nodes rotated have to be updated. */
+static inline void
+update(aatree_t *b, aatree_node_t *t)
+{
+    if (b->update != NULL)
+        b->update(b, t);
+}
+
+static inline int
+compare(aatree_t *t, void *keyp, aatree_node_t *n)
+{
+    COUNT(t, compares);
+    return t->compare(t, keyp, n);
+}
+
+static inline void
+swap(aatree_t *t, aatree_node_t *a, aatree_node_t *b)
+{
+    COUNT(t, swaps);
+    t->swap(t, a, b);
+}
+
+/* The depth of a descent is the number of compares it took, so we note
+   the count before, and add to the histogram after. */
+static inline uint64_t
+depth_mark(aatree_t *t)
+{
+#ifdef AATREE_STATS
+    return STATS(t)->compares;
+#else
+    (void)t;
+    return 0;
+#endif
+}
+
+static inline void
+depth_note(aatree_t *t, uint64_t mark)
+{
+#ifdef AATREE_STATS
+    uint64_t depth = STATS(t)->compares - mark;
+
+    if (depth >= AATREE_STATS_DEPTHS)
+        depth = AATREE_STATS_DEPTHS - 1;
+    STATS(t)->descents += 1;
+    STATS(t)->depth[depth] += 1;
+#else
+    (void)t;
+    (void)mark;
+#endif
+}
+
+/* The ways an insertion's descent went */
+#define WENT_LEFT  1
+#define WENT_RIGHT 2
+
+/* Keep min and max up to date when n has been inserted with key keyp.
+   It's the new min if the descent only went left, and the new max if it
+   only went right, with equal keys going right. */
+static inline void
+note_insert(aatree_t *t, void *keyp, aatree_node_t *n, unsigned went)
+{
+    aatree_bloom_add(t, keyp);
+    if (! (went & WENT_RIGHT))
+        t->min = n;
+    if (! (went & WENT_LEFT))
+        t->max = n;
+}
+
+static inline aatree_node_t *
+leftmost(aatree_node_t *n)
+{
+    if (n != NULL)
+        while (aatree_get_left(n) != NULL)
+            n = aatree_get_left(n);
+    return n;
+}
+
+static inline aatree_node_t *
+rightmost(aatree_node_t *n)
+{
+    if (n != NULL)
+        while (aatree_get_right(n) != NULL)
+            n = aatree_get_right(n);
+    return n;
 }
 
+/* After the shape of the tree changed wholesale */
+static void
+set_ends(aatree_t *t)
+{
+    t->min = leftmost(t->root);
+    t->max = rightmost(t->root);
+}
+
+static aatree_node_t *
+aatree_find_key_recursive(aatree_t *t, aatree_node_t *n, void *key,
+                          aatree_condition_fun_t *cond);
+
+/* Ten bits per key and seven bits set gives about 1% false positives,
+   a bit more in practice since the blocks fill unevenly */
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_K 7
+
+/* The block is picked by the low bits of the hash, and the bits in it by
+   the high bits of a remix, nine at a time */
+static bool
+bloom_maybe(aatree_bloom_t *b, uint64_t h)
+{
+    uint64_t *block = &b->bits[(h & b->mask) * AATREE_BLOOM_WORDS];
+    uint64_t g = h * 0x9e3779b97f4a7c15;
+
+    for (unsigned i = 1 ; i <= BLOOM_K ; i++)
+    {
+        unsigned bit = (g >> (64 - 9*i)) & 511;
+
+        if ((block[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0)
+            return false;
+    }
+    return true;
+}
+
+/* Drop the cached lookups of the key, and of any key with the same
+   hash, which is simpler and as cheap */
+static void
+cache_forget(aatree_t *t, void *keyp)
+{
+    aatree_cache_t *c = t->cache;
+    aatree_cache_set_t *s = &c->set[c->hash(t, keyp) & c->mask];
+
+    memset(s->node, 0, sizeof(s->node));
+}
+
+/* The set is kept in rough recency order: a hit moves one way towards
+   the front, and a miss goes in front, pushing out the last. Misses in
+   the tree are not cached. */
 static aatree_node_t *
-aatree_skew(aatree_node_t *t)
+cache_find(aatree_t *t, void *keyp)
+{
+    aatree_cache_t *c = t->cache;
+    uint64_t h = c->hash(t, keyp);
+    aatree_cache_set_t *s = &c->set[h & c->mask];
+    aatree_node_t *n;
+
+    for (size_t i = 0 ; i < AATREE_CACHE_WAYS ; i++)
+        if (s->hash[i] == h && (n = s->node[i]) != NULL &&
+            compare(t, keyp, n) == 0)
+        {
+            c->hits += 1;
+            if (i > 0)
+            {
+                s->hash[i] = s->hash[i-1];
+                s->node[i] = s->node[i-1];
+                s->hash[i-1] = h;
+                s->node[i-1] = n;
+            }
+            return n;
+        }
+    c->misses += 1;
+    n = aatree_find_key_recursive(t, t->root, keyp, NULL);
+    if (n != NULL)
+    {
+        memmove(&s->hash[1], &s->hash[0],
+                (AATREE_CACHE_WAYS-1) * sizeof(s->hash[0]));
+        memmove(&s->node[1], &s->node[0],
+                (AATREE_CACHE_WAYS-1) * sizeof(s->node[0]));
+        s->hash[0] = h;
+        s->node[0] = n;
+    }
+    return n;
+}
+
+static aatree_node_t *
+aatree_skew(aatree_t *b, aatree_node_t *t)
 {
     if (t == NULL)
         return NULL;
-    if (t->left == NULL || t->level != t->left->level)
+    aatree_node_t *l = aatree_get_left(t);
+    if (l == NULL || aatree_get_level(t) != aatree_get_level(l))
         return t;
+    COUNT(b, skews);
     aatree_node_t *tmp = t;
-    t = t->left;
-    tmp->left = t->right;
-    t->right = tmp;
+    t = l;
+    aatree_set_left(tmp, aatree_get_right(t));
+    aatree_set_right(t, tmp);
+    update(b, tmp);
+    update(b, t);
     return t;
 }
 
 static aatree_node_t *
-aatree_split(aatree_node_t *t)
+aatree_split(aatree_t *b, aatree_node_t *t)
 {
     if (t == NULL)
         return NULL;
-    if (t->right == NULL || t->right->right == NULL ||
-        t->level != t->right->right->level)
+    aatree_node_t *r = aatree_get_right(t);
+    if (r == NULL || aatree_get_right(r) == NULL ||
+        aatree_get_level(t) != aatree_get_level(aatree_get_right(r)))
         return t;
+    COUNT(b, splits);
     aatree_node_t *tmp = t;
-    t = t->right;
-    tmp->right = t->left;
-    t->left = tmp;
-    t->level += 1;
+    t = r;
+    aatree_set_right(tmp, aatree_get_left(t));
+    aatree_set_left(t, tmp);
+    aatree_set_level(t, aatree_get_level(t) + 1);
+    update(b, tmp);
+    update(b, t);
     return t;
 }
 
 static aatree_node_t *
-insert_node(aatree_t *b, aatree_node_t *t, void *keyp, aatree_node_t *n)
+insert_node(aatree_t *b, aatree_node_t *t, void *keyp, aatree_node_t *n,
+            unsigned *wentp)
 {
     if (t == NULL)
+    {
+        update(b, n);
         return n;
-    if (b->compare(b, keyp, t) < 0)
-        t->left = insert_node(b, t->left, keyp, n);
+    }
+    if (compare(b, keyp, t) < 0)
+    {
+        *wentp |= WENT_LEFT;
+        aatree_set_left(t, insert_node(b, aatree_get_left(t), keyp, n,
+                                       wentp));
+    }
     else
-        t->right = insert_node(b, t->right, keyp, n);
-    t = aatree_skew(t);
-    t = aatree_split(t);
+    {
+        *wentp |= WENT_RIGHT;
+        aatree_set_right(t, insert_node(b, aatree_get_right(t), keyp, n,
+                                        wentp));
+    }
+    update(b, t);
+    t = aatree_skew(b, t);
+    t = aatree_split(b, t);
     return t;
 }
 
 void
 aatree_insert_node(aatree_t *t, void *keyp, aatree_node_t *n)
 {
-    t->root = insert_node(t, t->root, keyp, n);
+    unsigned went = 0;
+    uint64_t mark = depth_mark(t);
+
+    aatree_set_root(t, insert_node(t, t->root, keyp, n, &went));
+    depth_note(t, mark);
+    note_insert(t, keyp, n, went);
 }
 
 static aatree_node_t *
 insert_unique_node(aatree_t *b, aatree_node_t *t,
-                   void *keyp, aatree_node_t *n,  aatree_node_t **xistsp)
+                   void *keyp, aatree_node_t *n,  aatree_node_t **xistsp,
+                   unsigned *wentp)
 {
     if (t == NULL)
+    {
+        update(b, n);
         return n;
-    int cmp = b->compare(b, keyp, t);
+    }
+    int cmp = compare(b, keyp, t);
     if (cmp == 0)
     {
         *xistsp = t;
         return t;
     }
     if (cmp < 0)
-        t->left = insert_unique_node(b, t->left, keyp, n, xistsp);
+    {
+        *wentp |= WENT_LEFT;
+        aatree_set_left(t, insert_unique_node(b, aatree_get_left(t),
+                                              keyp, n, xistsp, wentp));
+    }
     else
-        t->right = insert_unique_node(b, t->right, keyp, n, xistsp);
-    t = aatree_skew(t);
-    t = aatree_split(t);
+    {
+        *wentp |= WENT_RIGHT;
+        aatree_set_right(t, insert_unique_node(b, aatree_get_right(t),
+                                               keyp, n, xistsp, wentp));
+    }
+    if (*xistsp != NULL)
+        return t;               /* Nothing changed */
+    update(b, t);
+    t = aatree_skew(b, t);
+    t = aatree_split(b, t);
     return t;
 }
 
@@ -93,30 +319,50 @@ aatree_node_t *
 aatree_insert_unique_node(aatree_t *t, void *keyp, aatree_node_t *n)
 {
     aatree_node_t *xists = NULL;
+    unsigned went = 0;
+    uint64_t mark = depth_mark(t);
 
-    t->root = insert_unique_node(t, t->root, keyp, n, &xists);
+    aatree_set_root(t, insert_unique_node(t, t->root, keyp, n, &xists,
+                                          &went));
+    depth_note(t, mark);
+    if (xists == NULL)
+        note_insert(t, keyp, n, went);
     return xists;
 }
 
 static aatree_node_t *
 replace_node(aatree_t *b, aatree_node_t *t,
-             void *keyp, aatree_node_t *n, aatree_node_t **replp)
+             void *keyp, aatree_node_t *n, aatree_node_t **replp,
+             unsigned *wentp)
 {
     if (t == NULL)
+    {
+        update(b, n);
         return n;
-    int cmp = b->compare(b, keyp, t);
+    }
+    int cmp = compare(b, keyp, t);
     if (cmp == 0)
     {
-        b->swap(b, n, t);
+        swap(b, n, t);
         *replp = n;
+        update(b, t);
         return t;
     }
     if (cmp < 0)
-        t->left = replace_node(b, t->left, keyp, n, replp);
+    {
+        *wentp |= WENT_LEFT;
+        aatree_set_left(t, replace_node(b, aatree_get_left(t),
+                                        keyp, n, replp, wentp));
+    }
     else
-        t->right = replace_node(b, t->right, keyp, n, replp);
-    t = aatree_skew(t);
-    t = aatree_split(t);
+    {
+        *wentp |= WENT_RIGHT;
+        aatree_set_right(t, replace_node(b, aatree_get_right(t),
+                                         keyp, n, replp, wentp));
+    }
+    update(b, t);
+    t = aatree_skew(b, t);
+    t = aatree_split(b, t);
     return t;
 }
 
@@ -124,39 +370,217 @@ aatree_node_t *
 aatree_replace_node(aatree_t *t, void *keyp, aatree_node_t *n)
 {
     aatree_node_t *repl = NULL;
+    unsigned went = 0;
+    uint64_t mark = depth_mark(t);
 
-    t->root = replace_node(t, t->root, keyp, n, &repl);
+    aatree_set_root(t, replace_node(t, t->root, keyp, n, &repl, &went));
+    depth_note(t, mark);
+    if (repl == NULL)
+        note_insert(t, keyp, n, went);
     return repl;
 }
 
+/* The left subtree gets floor((n-1)/2) nodes, which makes the level one
+   more than that of the left child. */
+static aatree_node_t *
+build_sorted(aatree_t *b, aatree_node_t **nodes, size_t n)
+{
+    if (n == 0)
+        return NULL;
+
+    size_t mid = (n-1) / 2;
+    aatree_node_t *t = nodes[mid];
+
+    aatree_node_t *l = build_sorted(b, nodes, mid);
+
+    aatree_set_left(t, l);
+    aatree_set_right(t, build_sorted(b, nodes+mid+1, n-mid-1));
+    aatree_set_level(t, (l == NULL ? 1 : aatree_get_level(l) + 1));
+    update(b, t);
+    return t;
+}
+
+void
+aatree_build_sorted(aatree_t *t, aatree_node_t *nodes[], size_t n)
+{
+    aatree_set_root(t, build_sorted(t, nodes, n));
+    set_ends(t);
+    if (t->bloom != NULL)
+    {
+        aatree_bloom_clear(t);
+        for (size_t i = 0 ; i < n ; i++)
+            aatree_bloom_add(t, t->key(t, nodes[i]));
+    }
+}
+
+/* Same shape as build_sorted(), taking the nodes from a list linked by
+   the right pointers. */
+static aatree_node_t *
+build_list(aatree_t *b, aatree_node_t **headp, size_t n)
+{
+    if (n == 0)
+        return NULL;
+
+    size_t mid = (n-1) / 2;
+    aatree_node_t *l = build_list(b, headp, mid);
+    aatree_node_t *t = *headp;
+
+    *headp = aatree_get_right(t);
+    aatree_set_left(t, l);
+    aatree_set_right(t, build_list(b, headp, n-mid-1));
+    aatree_set_level(t, (l == NULL ? 1 : aatree_get_level(l) + 1));
+    update(b, t);
+    return t;
+}
+
+/* Flatten the tree into a list ("vine") linked by the right pointers
+   with right rotations, as in the Day-Stout-Warren algorithm. Returns
+   the first node, and the number of nodes in *np. */
+static aatree_node_t *
+flatten(aatree_t *t, size_t *np)
+{
+    aatree_node_t pseudo;
+    aatree_node_t *tail = &pseudo;
+    aatree_node_t *rest = t->root;
+    size_t n = 0;
+
+    aatree_init_node(&pseudo);
+    aatree_set_right(&pseudo, rest);
+    while (rest != NULL)
+    {
+        aatree_node_t *l = aatree_get_left(rest);
+
+        if (l == NULL)
+        {
+            tail = rest;
+            rest = aatree_get_right(rest);
+            n += 1;
+        }
+        else
+        {
+            aatree_set_left(rest, aatree_get_right(l));
+            aatree_set_right(l, rest);
+            aatree_set_right(tail, l);
+            rest = l;
+        }
+    }
+    *np = n;
+    return aatree_get_right(&pseudo);
+}
+
+void
+aatree_compact(aatree_t *t)
+{
+    size_t n;
+    aatree_node_t *list = flatten(t, &n);
+
+    aatree_set_root(t, build_list(t, &list, n));
+    set_ends(t);
+}
+
+/* Merge only when the tree has at most this many times as many nodes
+   as the batch */
+#define MERGE_RATIO 4
+
+/* A tree with root level h has between 2^h - 1 and 3^h - 1 nodes.
+   Merging is linear in the size of the tree, so it's only done when the
+   upper bound is a small multiple of the batch, which makes the cost
+   proportional to the batch. Otherwise the nodes are inserted one by
+   one, in O(n log N). */
+void
+aatree_insert_sorted(aatree_t *t, aatree_node_t *nodes[], size_t n)
+{
+    if (n == 0)
+        return;
+    if (t->root == NULL)
+    {
+        aatree_build_sorted(t, nodes, n);
+        return;
+    }
+
+    aatree_level_t level = aatree_get_level(t->root);
+    size_t limit = MERGE_RATIO * n, most = 1;
+
+    for (aatree_level_t l = 0 ; l < level && most - 1 <= limit ; l++)
+        most *= 3;
+    if (most - 1 > limit)
+    {
+        for (size_t i = 0 ; i < n ; i++)
+            aatree_insert_node(t, t->key(t, nodes[i]), nodes[i]);
+        return;
+    }
+
+    size_t m, i = 0;
+    aatree_node_t *list = flatten(t, &m);
+    aatree_node_t head;
+    aatree_node_t *tail = &head;
+
+    aatree_init_node(&head);
+    while (list != NULL || i < n)
+    {
+        aatree_node_t *x;
+
+        if (i < n &&
+            (list == NULL || compare(t, t->key(t, nodes[i]), list) < 0))
+        {
+            aatree_bloom_add(t, t->key(t, nodes[i]));
+            x = nodes[i++];
+        }
+        else
+        {
+            x = list;
+            list = aatree_get_right(list);
+        }
+        aatree_set_right(tail, x);
+        tail = x;
+    }
+    aatree_set_right(tail, NULL);
+    list = aatree_get_right(&head);
+    aatree_set_root(t, build_list(t, &list, m + n));
+    set_ends(t);
+}
+
 /* Correct the levels and re-balance; refer to the original article or other
    texts about AA Trees for details. */
 static aatree_node_t *
-aatree_post_remove_fix(aatree_node_t *t)
+aatree_post_remove_fix(aatree_t *b, aatree_node_t *t)
 {
     if (t != NULL)
     {
-        if (t->left == NULL || t->right == NULL)
-            t->level = 1;
-        if (t->left != NULL && t->level > t->left->level+1)
-            t->level -= 1;
-        if (t->right != NULL)
+        aatree_node_t *l = aatree_get_left(t);
+        aatree_node_t *r = aatree_get_right(t);
+        aatree_level_t level = aatree_get_level(t);
+
+        update(b, t);
+        if (l == NULL || r == NULL)
+            level = 1;
+        if (l != NULL && level > aatree_get_level(l)+1)
+            level -= 1;
+        if (r != NULL)
         {
-            if (t->level > t->right->level+1)
-                t->level -= 1;
-            if (t->level < t->right->level)
-                t->right->level = t->level;
+            if (level > aatree_get_level(r)+1)
+                level -= 1;
+            if (level < aatree_get_level(r))
+            {
+                COUNT(b, level_changes);
+                aatree_set_level(r, level);
+            }
         }
-        t = aatree_skew(t);
-        if (t->right != NULL)
+        if (level != aatree_get_level(t))
         {
-            t->right = aatree_skew(t->right);
-            if (t->right != NULL)
-                t->right->right = aatree_skew(t->right->right);
+            COUNT(b, level_changes);
+            aatree_set_level(t, level);
         }
-        t = aatree_split(t);
-        if (t->right != NULL)
-            t->right = aatree_split(t->right);
+        t = aatree_skew(b, t);
+        if ((r = aatree_get_right(t)) != NULL)
+        {
+            aatree_set_right(t, r = aatree_skew(b, r));
+            if (r != NULL)
+                aatree_set_right(r, aatree_skew(b, aatree_get_right(r)));
+        }
+        t = aatree_split(b, t);
+        if ((r = aatree_get_right(t)) != NULL)
+            aatree_set_right(t, aatree_split(b, r));
     }
     return t;
 }
@@ -166,14 +590,17 @@ remove_find_successor(aatree_t *b,
                       aatree_node_t *t, aatree_node_t *found,
                       aatree_node_t **removedp)
 {
-    if (t->left == NULL)
+    if (aatree_get_left(t) == NULL)
     {                           /* Found successor */
-        b->swap(b, found, t);
+        if (b->cache != NULL)
+            cache_forget(b, b->key(b, t));
+        swap(b, found, t);
         *removedp = t;
-        return t->right;
+        return aatree_get_right(t);
     }
-    t->left = remove_find_successor(b, t->left, found, removedp);
-    return aatree_post_remove_fix(t);
+    aatree_set_left(t, remove_find_successor(b, aatree_get_left(t),
+                                             found, removedp));
+    return aatree_post_remove_fix(b, t);
 }
 
 /* Will an AA Tree ever have such a shape that we have to find the
@@ -183,14 +610,17 @@ remove_find_predecessor(aatree_t *b,
                         aatree_node_t *t, aatree_node_t *found,
                         aatree_node_t **removedp)
 {
-    if (t->right == NULL)
+    if (aatree_get_right(t) == NULL)
     {                           /* Found predecessor */
-        b->swap(b, found, t);
+        if (b->cache != NULL)
+            cache_forget(b, b->key(b, t));
+        swap(b, found, t);
         *removedp = t;
-        return t->left;
+        return aatree_get_left(t);
     }
-    t->right = remove_find_predecessor(b, t->right, found, removedp);
-    return aatree_post_remove_fix(t);
+    aatree_set_right(t, remove_find_predecessor(b, aatree_get_right(t),
+                                                found, removedp));
+    return aatree_post_remove_fix(b, t);
 }
 
 static aatree_node_t *
@@ -200,40 +630,290 @@ remove_recursive(aatree_t *b,
 {
     if (t == NULL)
         return NULL;            /* Not found */
-    int cmp = b->compare(b, keyp, t);
+    int cmp = compare(b, keyp, t);
     if (cmp == 0 && (cond == NULL || cond(b, t)))
     {                           /* Found it */
-        if (t->right != NULL)   /* Pick right branch, if any */
-            t->right = remove_find_successor(b, t->right, t, removedp);
-        else if (t->left != NULL) /* Will this ever happen? */
-            t->left = remove_find_predecessor(b, t->left, t, removedp);
+        if (aatree_get_right(t) != NULL) /* Pick right branch, if any */
+            aatree_set_right(t, remove_find_successor(b, aatree_get_right(t),
+                                                      t, removedp));
+        else if (aatree_get_left(t) != NULL) /* Will this ever happen? */
+            aatree_set_left(t, remove_find_predecessor(b, aatree_get_left(t),
+                                                       t, removedp));
         else
         {                       /* Found a leaf */
             *removedp = t;
             return NULL;
         }
     }
+    else if (cmp == 0)
+    {                           /* cond said no, and equal keys can be on
+                                   either side */
+        if (aatree_get_left(t) != NULL)
+            aatree_set_left(t, remove_recursive(b, aatree_get_left(t),
+                                                keyp, cond, removedp));
+        if (*removedp == NULL && aatree_get_right(t) != NULL)
+            aatree_set_right(t, remove_recursive(b, aatree_get_right(t),
+                                                 keyp, cond, removedp));
+    }
     else
     {                           /* Keep looking */
-        if (t->left != NULL && cmp < 0)
-            t->left = remove_recursive(b,t->left, keyp, cond, removedp);
-        else if (t->right != NULL)
-            t->right = remove_recursive(b, t->right, keyp, cond, removedp);
+        if (aatree_get_left(t) != NULL && cmp < 0)
+            aatree_set_left(t, remove_recursive(b, aatree_get_left(t),
+                                                keyp, cond, removedp));
+        else if (aatree_get_right(t) != NULL)
+            aatree_set_right(t, remove_recursive(b, aatree_get_right(t),
+                                                 keyp, cond, removedp));
         else
             return t;           /* A leaf */
     }
-    return aatree_post_remove_fix(t);
+    return aatree_post_remove_fix(b, t);
 }
 
 aatree_node_t *
 aatree_remove_node(aatree_t *t, void *keyp, aatree_condition_fun_t *cond)
 {
     aatree_node_t *node = NULL;
+    uint64_t mark = depth_mark(t);
+
+    aatree_set_root(t, remove_recursive(t, t->root, keyp, cond, &node));
+    depth_note(t, mark);
+    /* The node removed may not be the one matched, but it's the one that
+       is gone */
+    if (node != NULL && node == t->min)
+        t->min = leftmost(t->root);
+    if (node != NULL && node == t->max)
+        t->max = rightmost(t->root);
+    /* It now has the removed key; a swapped node's old key has already
+       been forgotten */
+    if (node != NULL && t->cache != NULL)
+        cache_forget(t, t->key(t, node));
+    if (node != NULL && t->bloom != NULL)
+        t->bloom->removed += 1;
+    return node;
+}
+
+aatree_node_t *
+aatree_min(aatree_t *t)
+{
+    return t->min;
+}
+
+aatree_node_t *
+aatree_max(aatree_t *t)
+{
+    return t->max;
+}
+
+/* The first node has no left child, so it's replaced by its right child,
+   if any. The next node is then that child, or else the parent. */
+static aatree_node_t *
+remove_min(aatree_t *b, aatree_node_t *t,
+           aatree_node_t **removedp, aatree_node_t **nextp)
+{
+    if (aatree_get_left(t) == NULL)
+    {
+        *removedp = t;
+        *nextp = aatree_get_right(t);
+        return aatree_get_right(t);
+    }
+    aatree_set_left(t, remove_min(b, aatree_get_left(t), removedp, nextp));
+    if (*nextp == NULL)
+        *nextp = t;
+    return aatree_post_remove_fix(b, t);
+}
+
+/* The last node has no right child, and so no left child either since
+   its level is one. The previous node is the parent. */
+static aatree_node_t *
+remove_max(aatree_t *b, aatree_node_t *t,
+           aatree_node_t **removedp, aatree_node_t **prevp)
+{
+    if (aatree_get_right(t) == NULL)
+    {
+        *removedp = t;
+        *prevp = aatree_get_left(t);
+        return aatree_get_left(t);
+    }
+    aatree_set_right(t, remove_max(b, aatree_get_right(t), removedp, prevp));
+    if (*prevp == NULL)
+        *prevp = t;
+    return aatree_post_remove_fix(b, t);
+}
+
+aatree_node_t *
+aatree_pop_min(aatree_t *t)
+{
+    aatree_node_t *node = NULL, *next = NULL;
+
+    if (t->root == NULL)
+        return NULL;
+    aatree_set_root(t, remove_min(t, t->root, &node, &next));
+    t->min = next;
+    if (node == t->max)
+        t->max = next;
+    if (t->cache != NULL)
+        cache_forget(t, t->key(t, node));
+    if (t->bloom != NULL)
+        t->bloom->removed += 1;
+    return node;
+}
+
+aatree_node_t *
+aatree_pop_max(aatree_t *t)
+{
+    aatree_node_t *node = NULL, *prev = NULL;
+
+    if (t->root == NULL)
+        return NULL;
+    aatree_set_root(t, remove_max(t, t->root, &node, &prev));
+    t->max = prev;
+    if (node == t->min)
+        t->min = prev;
+    if (t->cache != NULL)
+        cache_forget(t, t->key(t, node));
+    if (t->bloom != NULL)
+        t->bloom->removed += 1;
+    return node;
+}
+
+/* As remove_recursive(), but the node found is unlinked, and the
+   successor (or predecessor) is moved into its place in the tree, with
+   its level, instead of swapping them. */
+static aatree_node_t *
+unlink_recursive(aatree_t *b, aatree_node_t *t, aatree_node_t *parent,
+                 void *keyp, aatree_condition_fun_t *cond,
+                 aatree_node_t **removedp, aatree_node_t **parentp)
+{
+    if (t == NULL)
+        return NULL;            /* Not found */
+    int cmp = compare(b, keyp, t);
+    if (cmp == 0 && (cond == NULL || cond(b, t)))
+    {                           /* Found it */
+        aatree_node_t *l = aatree_get_left(t);
+        aatree_node_t *r = aatree_get_right(t);
+        aatree_node_t *s = NULL, *other = NULL;
+
+        *removedp = t;
+        *parentp = parent;
+        if (r != NULL)
+            r = remove_min(b, r, &s, &other);
+        else if (l != NULL)
+            l = remove_max(b, l, &s, &other);
+        else
+            return NULL;        /* A leaf */
+        aatree_set_level(s, aatree_get_level(t));
+        aatree_set_left(s, l);
+        aatree_set_right(s, r);
+        t = s;
+    }
+    else if (cmp == 0)
+    {                           /* cond said no, and equal keys can be on
+                                   either side */
+        if (aatree_get_left(t) != NULL)
+            aatree_set_left(t, unlink_recursive(b, aatree_get_left(t), t,
+                                                keyp, cond,
+                                                removedp, parentp));
+        if (*removedp == NULL && aatree_get_right(t) != NULL)
+            aatree_set_right(t, unlink_recursive(b, aatree_get_right(t), t,
+                                                 keyp, cond,
+                                                 removedp, parentp));
+    }
+    else if (cmp < 0)
+    {
+        if (aatree_get_left(t) == NULL)
+            return t;           /* Not found */
+        aatree_set_left(t, unlink_recursive(b, aatree_get_left(t), t,
+                                            keyp, cond, removedp, parentp));
+    }
+    else
+    {
+        if (aatree_get_right(t) == NULL)
+            return t;           /* Not found */
+        aatree_set_right(t, unlink_recursive(b, aatree_get_right(t), t,
+                                             keyp, cond, removedp, parentp));
+    }
+    return aatree_post_remove_fix(b, t);
+}
+
+aatree_node_t *
+aatree_unlink_node(aatree_t *t, void *keyp, aatree_condition_fun_t *cond,
+                   aatree_node_t **parentp)
+{
+    aatree_node_t *node = NULL, *parent = NULL;
+    uint64_t mark = depth_mark(t);
 
-    t->root = remove_recursive(t, t->root, keyp, cond, &node);
+    aatree_set_root(t, unlink_recursive(t, t->root, NULL, keyp, cond,
+                                        &node, &parent));
+    depth_note(t, mark);
+    if (parentp != NULL)
+        *parentp = parent;
+    if (node == NULL)
+        return NULL;
+    if (node == t->min)
+        t->min = leftmost(t->root);
+    if (node == t->max)
+        t->max = rightmost(t->root);
+    /* No other node changed its key */
+    if (t->cache != NULL)
+        cache_forget(t, t->key(t, node));
+    if (t->bloom != NULL)
+        t->bloom->removed += 1;
     return node;
 }
 
+size_t
+aatree_pop_min_n(aatree_t *t, aatree_node_t *nodes[], size_t n, void *below)
+{
+    size_t i = 0;
+
+    while (i < n && t->min != NULL &&
+           (below == NULL || compare(t, below, t->min) > 0))
+        nodes[i++] = aatree_pop_min(t);
+    return i;
+}
+
+/* A node without a left child is released, and otherwise the left child
+   is rotated up. Each rotation moves a node off a left spine for good,
+   so there are fewer than n of them. */
+bool
+aatree_destroy_step(aatree_t *t, size_t max_nodes,
+                    aatree_release_fun_t *release)
+{
+    aatree_node_t *n = t->root;
+
+    t->min = t->max = NULL;
+    aatree_cache_clear(t);
+    aatree_bloom_clear(t);
+    while (n != NULL && max_nodes > 0)
+    {
+        aatree_node_t *l = aatree_get_left(n);
+
+        if (l == NULL)
+        {
+            aatree_node_t *r = aatree_get_right(n);
+
+            if (release != NULL)
+                release(t, n);
+            n = r;
+            max_nodes -= 1;
+        }
+        else
+        {
+            aatree_set_left(n, aatree_get_right(l));
+            aatree_set_right(l, n);
+            n = l;
+        }
+    }
+    aatree_set_root(t, n);
+    return (n == NULL);
+}
+
+void
+aatree_clear(aatree_t *t, aatree_release_fun_t *release)
+{
+    (void)aatree_destroy_step(t, SIZE_MAX, release);
+}
+
 /* Only actually called recursively if we have a cond that returns false */
 static aatree_node_t *
 aatree_find_key_recursive(aatree_t *t, aatree_node_t *n, void *key,
@@ -241,21 +921,22 @@ aatree_find_key_recursive(aatree_t *t, aatree_node_t *n, void *key,
 {
     while (n != NULL)
     {
-        int cmp = t->compare(t, key, n);
+        int cmp = compare(t, key, n);
 
         if (cmp == 0 && (cond == NULL || cond(t, n)))
             break;
         /* cmp != 0 || (cond != NULL && !cond(t, n)) */
         if (cmp < 0)
-            n = n->left;
+            n = aatree_get_left(n);
         else if (cmp > 0)
-            n = n->right;
+            n = aatree_get_right(n);
         else
         {  /* cmp == 0 but cond said no */
-            aatree_node_t *ln = aatree_find_key_recursive(t, n->left, key, cond);
+            aatree_node_t *ln =
+                aatree_find_key_recursive(t, aatree_get_left(n), key, cond);
             if (ln != NULL)
                 return ln;
-            n = n->right;
+            n = aatree_get_right(n);
         }
     }
     return n;
@@ -265,7 +946,267 @@ aatree_node_t *
 aatree_find_key(aatree_t *t, void *key,
                 aatree_condition_fun_t *cond)
 {
-    return aatree_find_key_recursive(t, t->root, key, cond);
+    if (t->bloom != NULL && ! bloom_maybe(t->bloom, t->bloom->hash(t, key)))
+    {
+        t->bloom->rejects += 1;
+        return NULL;
+    }
+
+    uint64_t mark = depth_mark(t);
+    aatree_node_t *n;
+
+    if (t->cache != NULL && cond == NULL)
+        n = cache_find(t, key);
+    else
+        n = aatree_find_key_recursive(t, t->root, key, cond);
+    depth_note(t, mark);
+    return n;
+}
+
+bool
+aatree_cache_attach(aatree_t *t, size_t entries, aatree_hash_fun_t *hash)
+{
+    size_t nsets = 1;
+    aatree_cache_t *c;
+
+    if (t->key == NULL)
+        return false;
+    while (nsets * AATREE_CACHE_WAYS < entries)
+        nsets *= 2;
+    if ((c = malloc(sizeof(aatree_cache_t))) == NULL)
+        return false;
+    c->set = aligned_alloc(AATREE_CACHE_ALIGN,
+                           nsets * sizeof(aatree_cache_set_t));
+    if (c->set == NULL)
+    {
+        free(c);
+        return false;
+    }
+    c->hash = hash;
+    c->mask = nsets - 1;
+    c->hits = c->misses = 0;
+    aatree_cache_detach(t);
+    t->cache = c;
+    aatree_cache_clear(t);
+    return true;
+}
+
+void
+aatree_cache_detach(aatree_t *t)
+{
+    if (t->cache != NULL)
+    {
+        free(t->cache->set);
+        free(t->cache);
+        t->cache = NULL;
+    }
+}
+
+void
+aatree_cache_clear(aatree_t *t)
+{
+    aatree_cache_t *c = t->cache;
+
+    if (c != NULL)
+        memset(c->set, 0, (c->mask + 1) * sizeof(aatree_cache_set_t));
+}
+
+void
+aatree_bloom_add(aatree_t *t, void *keyp)
+{
+    aatree_bloom_t *b = t->bloom;
+
+    if (b == NULL)
+        return;
+
+    uint64_t h = b->hash(t, keyp);
+    uint64_t *block = &b->bits[(h & b->mask) * AATREE_BLOOM_WORDS];
+    uint64_t g = h * 0x9e3779b97f4a7c15;
+
+    for (unsigned i = 1 ; i <= BLOOM_K ; i++)
+    {
+        unsigned bit = (g >> (64 - 9*i)) & 511;
+
+        block[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+    b->added += 1;
+}
+
+static size_t
+bloom_count(aatree_node_t *n)
+{
+    size_t count = 0;
+
+    while (n != NULL)
+    {
+        count += 1 + bloom_count(aatree_get_left(n));
+        n = aatree_get_right(n);
+    }
+    return count;
+}
+
+static void
+bloom_add_all(aatree_t *t, aatree_node_t *n)
+{
+    while (n != NULL)
+    {
+        bloom_add_all(t, aatree_get_left(n));
+        aatree_bloom_add(t, t->key(t, n));
+        n = aatree_get_right(n);
+    }
+}
+
+/* Returns the bits for 'keys' keys, and sets *maskp, or NULL */
+static uint64_t *
+bloom_alloc(size_t keys, size_t *maskp)
+{
+    size_t nblocks = 1;
+
+    while (nblocks * AATREE_BLOOM_WORDS * 64 < keys * BLOOM_BITS_PER_KEY)
+        nblocks *= 2;
+    *maskp = nblocks - 1;
+    return aligned_alloc(AATREE_CACHE_ALIGN,
+                         nblocks * AATREE_BLOOM_WORDS * sizeof(uint64_t));
+}
+
+bool
+aatree_bloom_attach(aatree_t *t, size_t keys, aatree_hash_fun_t *hash)
+{
+    aatree_bloom_t *b;
+
+    if (t->key == NULL)
+        return false;
+    if ((b = malloc(sizeof(aatree_bloom_t))) == NULL)
+        return false;
+    if ((b->bits = bloom_alloc(keys, &b->mask)) == NULL)
+    {
+        free(b);
+        return false;
+    }
+    b->hash = hash;
+    b->keys = keys;
+    b->rejects = 0;
+    aatree_bloom_detach(t);
+    t->bloom = b;
+    aatree_bloom_clear(t);
+    bloom_add_all(t, t->root);
+    return true;
+}
+
+void
+aatree_bloom_detach(aatree_t *t)
+{
+    if (t->bloom != NULL)
+    {
+        free(t->bloom->bits);
+        free(t->bloom);
+        t->bloom = NULL;
+    }
+}
+
+bool
+aatree_bloom_rebuild(aatree_t *t)
+{
+    aatree_bloom_t *b = t->bloom;
+    size_t n = bloom_count(t->root);
+
+    if (b == NULL)
+        return true;
+    if (n > b->keys)
+    {
+        size_t mask;
+        uint64_t *bits = bloom_alloc(n, &mask);
+
+        if (bits == NULL)
+            return false;
+        free(b->bits);
+        b->bits = bits;
+        b->mask = mask;
+        b->keys = n;
+    }
+    aatree_bloom_clear(t);
+    bloom_add_all(t, t->root);
+    return true;
+}
+
+void
+aatree_bloom_clear(aatree_t *t)
+{
+    aatree_bloom_t *b = t->bloom;
+
+    if (b != NULL)
+    {
+        memset(b->bits, 0,
+               (b->mask + 1) * AATREE_BLOOM_WORDS * sizeof(uint64_t));
+        b->added = b->removed = 0;
+    }
+}
+
+/* True if n >= lo, or lo is unbounded */
+static inline bool
+above_low(aatree_t *t, void *lo, aatree_node_t *n)
+{
+    return (lo == NULL || compare(t, lo, n) <= 0);
+}
+
+/* True if n < hi, or hi is unbounded */
+static inline bool
+below_high(aatree_t *t, void *hi, aatree_node_t *n)
+{
+    return (hi == NULL || compare(t, hi, n) > 0);
+}
+
+bool
+aatree_aggregate(aatree_t *t, void *lo, void *hi,
+                 aatree_fold_fun_t *fold, void *acc)
+{
+    aatree_node_t *n = t->root;
+    aatree_node_t *stack[AATREE_MAX_DEPTH];
+    uint32_t i = 0;
+
+    /* Find the top node in the range */
+    while (n != NULL)
+        if (! above_low(t, lo, n))
+            n = aatree_get_right(n);
+        else if (! below_high(t, hi, n))
+            n = aatree_get_left(n);
+        else
+            break;
+    if (n == NULL)
+        return true;
+    /* Along the lower bound, the nodes and their right subtrees come
+       in reverse order */
+    for (aatree_node_t *m = aatree_get_left(n) ; m != NULL ; )
+        if (above_low(t, lo, m))
+        {
+            if (i >= AATREE_MAX_DEPTH)
+                return false;
+            stack[i++] = m;
+            m = aatree_get_left(m);
+        }
+        else
+            m = aatree_get_right(m);
+    while (i > 0)
+    {
+        aatree_node_t *m = stack[--i];
+
+        fold(t, acc, m, false);
+        if (aatree_get_right(m) != NULL)
+            fold(t, acc, aatree_get_right(m), true);
+    }
+    fold(t, acc, n, false);
+    /* Along the upper bound, the left subtrees and the nodes are in order */
+    for (aatree_node_t *m = aatree_get_right(n) ; m != NULL ; )
+        if (below_high(t, hi, m))
+        {
+            if (aatree_get_left(m) != NULL)
+                fold(t, acc, aatree_get_left(m), true);
+            fold(t, acc, m, false);
+            m = aatree_get_right(m);
+        }
+        else
+            m = aatree_get_left(m);
+    return true;
 }
 
 static bool
@@ -273,11 +1214,11 @@ each(aatree_t *b, aatree_node_t *t, bool (*f)(aatree_t *, aatree_node_t *))
 {
     while (t != NULL)
     {
-        if (! each(b, t->left, f))
+        if (! each(b, aatree_get_left(t), f))
             return false;
         if (! f(b, t))
             return false;
-        t = t->right;
+        t = aatree_get_right(t);
     }
     return true;
 }
@@ -288,18 +1229,153 @@ aatree_each(aatree_t *t, bool (*f)(aatree_t *, aatree_node_t *))
     return each(t, t->root, f);
 }
 
+#ifdef AATREE_PARENT
+
+/* Each edge is walked at most twice in a full iteration, once down and
+   once up, hence the O(1) amortized. */
+aatree_node_t *
+aatree_next_node(aatree_node_t *n)
+{
+    if (aatree_get_right(n) != NULL)
+        return leftmost(aatree_get_right(n));
+
+    aatree_node_t *p = aatree_get_parent(n);
+
+    while (p != NULL && n == aatree_get_right(p))
+    {
+        n = p;
+        p = aatree_get_parent(p);
+    }
+    return p;
+}
+
+aatree_node_t *
+aatree_prev_node(aatree_node_t *n)
+{
+    if (aatree_get_left(n) != NULL)
+        return rightmost(aatree_get_left(n));
+
+    aatree_node_t *p = aatree_get_parent(n);
+
+    while (p != NULL && n == aatree_get_left(p))
+    {
+        n = p;
+        p = aatree_get_parent(p);
+    }
+    return p;
+}
+
+bool
+aatree_iter_init(aatree_t *t, aatree_iter_t *iter)
+{
+    iter->keyp = NULL;
+    iter->base = t;
+    iter->next = t->min;
+    return true;
+}
+
+aatree_node_t *
+aatree_iter_next(aatree_iter_t *iter)
+{
+    aatree_node_t *t = iter->next;
+
+    if (t != NULL)
+        iter->next = aatree_next_node(t);
+    return t;
+}
+
+/* Search from n for the first matching node */
+static aatree_node_t *
+key_descend(aatree_iter_t *iter, aatree_node_t *n)
+{
+    if (n != NULL)
+        COUNT(iter->base, iter_restarts);
+    while (n != NULL)
+    {
+        int cmp = compare(iter->base, iter->keyp, n);
+
+        if (cmp == 0)
+            break;
+        if (cmp < 0)
+            n = aatree_get_left(n);
+        else
+            n = aatree_get_right(n);
+    }
+    return n;
+}
+
+bool
+aatree_iter_key_init(aatree_t *t, void *key, aatree_iter_t *iter)
+{
+    iter->keyp = key;
+    iter->base = t;
+    iter->next = key_descend(iter, t->root);
+    return true;
+}
+
+/* The matching nodes come in the same order as with the stack, i.e.
+   a node, then the matches below its left child, then those below its
+   right child. Instead of popping the stack, we climb to the nearest
+   matching ancestor that we reached from the left. The nodes passed on
+   the way that don't match only have matches on the side we came from. */
+aatree_node_t *
+aatree_iter_key_next(aatree_iter_t *iter)
+{
+    aatree_node_t *t = iter->next;
+
+    if (t == NULL)
+        return NULL;
+
+    aatree_node_t *n = t;
+    aatree_node_t *x = key_descend(iter, aatree_get_left(n));
+
+    if (x == NULL)
+        x = key_descend(iter, aatree_get_right(n));
+    for (aatree_node_t *p = aatree_get_parent(n) ;
+         x == NULL && p != NULL ;
+         n = p, p = aatree_get_parent(p))
+        if (n == aatree_get_left(p) &&
+            compare(iter->base, iter->keyp, p) == 0)
+            x = key_descend(iter, aatree_get_right(p));
+    iter->next = x;
+    return t;
+}
+
+bool
+aatree_iter_from_init(aatree_t *t, void *key, aatree_iter_t *iter)
+{
+    aatree_node_t *n = t->root;
+
+    iter->keyp = key;
+    iter->base = t;
+    iter->next = NULL;
+    while (n != NULL)
+        if (compare(t, key, n) <= 0)
+        {
+            iter->next = n;
+            n = aatree_get_left(n);
+        }
+        else
+            n = aatree_get_right(n);
+    return true;
+}
+
+#else  /* AATREE_PARENT */
+
 bool
 aatree_iter_init(aatree_t *t, aatree_iter_t *iter)
 {
     aatree_node_t *n = t->root;
 
-    memset(iter, 0, sizeof(aatree_iter_t));
+    iter->keyp = NULL;
+    iter->base = t;
+    iter->i = 0;
     while (n != NULL)
     {
         if (iter->i >= AATREE_MAX_DEPTH)
             return false;
         iter->node[iter->i++] = n;
-        n = n->left;
+        n = aatree_get_left(n);
     }
     return true;
 }
@@ -310,7 +1386,9 @@ aatree_iter_next(aatree_iter_t *iter)
     if (iter->i == 0)
         return NULL;
     aatree_node_t *t = iter->node[--iter->i];
-    for (aatree_node_t *tr = t->right ; tr != NULL ; tr = tr->left)
+    for (aatree_node_t *tr = aatree_get_right(t) ;
+         tr != NULL ;
+         tr = aatree_get_left(tr))
     {
         if (iter->i >= AATREE_MAX_DEPTH)
             return NULL;
@@ -322,9 +1400,9 @@ aatree_iter_next(aatree_iter_t *iter)
 bool
 aatree_iter_key_init(aatree_t *t, void *key, aatree_iter_t *iter)
 {
-    memset(iter, 0, sizeof(aatree_iter_t));
     iter->keyp = key;
     iter->base = t;
+    iter->i = 0;
     if (t->root != NULL)
         iter->node[iter->i++] = t->root;
     return true;
@@ -338,44 +1416,71 @@ aatree_iter_key_next(aatree_iter_t *iter)
     while (iter->i > 0)
     {
         t = iter->node[--iter->i];
+        COUNT(iter->base, iter_restarts);
         while (t != NULL)
         {
-            int cmp = iter->base->compare(iter->base, iter->keyp, t);
+            int cmp = compare(iter->base, iter->keyp, t);
 
             if (cmp == 0)
                 break;
             if (cmp < 0)
-                t = t->left;
+                t = aatree_get_left(t);
             else
-                t = t->right;
+                t = aatree_get_right(t);
         }
         if (t != NULL)
             break;
     }
     if (t == NULL)
         return NULL;
-    if (t->right != NULL)
+    if (aatree_get_right(t) != NULL)
     {
         if (iter->i >= AATREE_MAX_DEPTH)
             return NULL;
-        iter->node[iter->i++] = t->right;
+        iter->node[iter->i++] = aatree_get_right(t);
     }
-    if (t->left != NULL)
+    if (aatree_get_left(t) != NULL)
     {
         if (iter->i >= AATREE_MAX_DEPTH)
             return NULL;
-        iter->node[iter->i++] = t->left;
+        iter->node[iter->i++] = aatree_get_left(t);
     }
     return t;
 }
 
+/* The stack gets the nodes where the descent went left, which are the
+   ones aatree_iter_init() would have left there after returning all
+   the nodes before the key. */
+bool
+aatree_iter_from_init(aatree_t *t, void *key, aatree_iter_t *iter)
+{
+    aatree_node_t *n = t->root;
+
+    iter->keyp = key;
+    iter->base = t;
+    iter->i = 0;
+    while (n != NULL)
+        if (compare(t, key, n) <= 0)
+        {
+            if (iter->i >= AATREE_MAX_DEPTH)
+                return false;
+            iter->node[iter->i++] = n;
+            n = aatree_get_left(n);
+        }
+        else
+            n = aatree_get_right(n);
+    return true;
+}
+
+#endif /* AATREE_PARENT */
+
 static uint64_t
 height(aatree_node_t *n)
 {
     if (n == 0)
         return 0;
-    uint64_t ld = 1 + height(n->left);
-    uint64_t rd = 1 + height(n->right);
+    uint64_t ld = 1 + height(aatree_get_left(n));
+    uint64_t rd = 1 + height(aatree_get_right(n));
     return (ld > rd ? ld : rd);
 }
 
@@ -384,3 +1489,54 @@ aatree_height(aatree_t *t)
 {
     return height(t->root);
 }
+
+#ifdef AATREE_STATS
+
+void
+aatree_stats_get(aatree_t *t, aatree_stats_t *s)
+{
+    (void)t;
+    *s = *STATS(t);
+}
+
+void
+aatree_stats_reset(aatree_t *t)
+{
+    (void)t;
+    memset(STATS(t), 0, sizeof(aatree_stats_t));
+}
+
+void
+aatree_stats_dump(const aatree_stats_t *s, FILE *f)
+{
+    uint64_t sum = 0;
+    size_t median = 0, max = 0;
+
+    fprintf(f, "Compares: %lu\n", (unsigned long)s->compares);
+    fprintf(f, "Swaps: %lu\n", (unsigned long)s->swaps);
+    fprintf(f, "Skews: %lu\n", (unsigned long)s->skews);
+    fprintf(f, "Splits: %lu\n", (unsigned long)s->splits);
+    fprintf(f, "Level changes: %lu\n", (unsigned long)s->level_changes);
+    fprintf(f, "Iterator restarts: %lu\n", (unsigned long)s->iter_restarts);
+    fprintf(f, "Descents: %lu", (unsigned long)s->descents);
+    for (size_t i = 0 ; i < AATREE_STATS_DEPTHS ; i++)
+        if (s->depth[i] > 0)
+        {
+            if (sum < (s->descents + 1) / 2)
+                median = i;
+            sum += s->depth[i];
+            max = i;
+        }
+    if (s->descents > 0)
+        fprintf(f, " (depth median %lu, max %lu%s)",
+                (unsigned long)median, (unsigned long)max,
+                (max == AATREE_STATS_DEPTHS - 1 ? "+" : ""));
+    fputc('\n', f);
+    for (size_t i = 0 ; i < AATREE_STATS_DEPTHS ; i++)
+        if (s->depth[i] > 0)
+            fprintf(f, "  Depth %2lu%s: %lu\n", (unsigned long)i,
+                    (i == AATREE_STATS_DEPTHS - 1 ? "+" : ""),
+                    (unsigned long)s->depth[i]);
+}
+
+#endif /* AATREE_STATS */
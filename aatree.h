@@ -17,25 +17,262 @@ typedef uint32_t aatree_level_t;
 
 typedef struct aatree_node_s aatree_node_t;
 
+/* The node's fields should only be accessed with the aatree_get_...()
+   and aatree_set_...() functions below. */
+
+#ifdef AATREE_PARENT
+/* Each node also points to its parent, which is kept up to date when
+   children are set. This makes the iterators constant in size, and
+   stepping to the next node O(1) amortized, at the cost of one more
+   pointer per node. Everything using the tree must be compiled with
+   AATREE_PARENT defined. */
+#define AATREE_LINK_PARENT(c, p) \
+    do { if ((c) != NULL) (c)->parent = (p); } while (0)
+#else
+#define AATREE_LINK_PARENT(c, p) ((void)0)
+#endif
+
+#ifdef AATREE_STATS
+/* Count compares, rotations, swaps and such, for finding out why a tree
+   is slow. The counters are kept in the tree, or with
+   AATREE_STATS_THREAD, in the thread doing the work, for all trees, so
+   that concurrent lookups don't contend. Without AATREE_STATS, nothing
+   is counted and there's no cost. Everything using the tree must be
+   compiled with the same definitions. */
+#include <stdio.h>
+
+#define AATREE_STATS_DEPTHS 64
+
+typedef struct aatree_stats_s
+{
+    uint64_t compares;          /* Calls of the compare function */
+    uint64_t swaps;             /* Calls of the swap function */
+    uint64_t skews, splits;     /* Rotations done */
+    uint64_t level_changes;     /* Levels lowered after removals */
+    uint64_t iter_restarts;     /* Descents by the key iterators */
+    uint64_t descents;          /* Finds, insertions and removals */
+    /* Descents by the number of compares, the last one for the rest */
+    uint64_t depth[AATREE_STATS_DEPTHS];
+} aatree_stats_t;
+#endif
+
+#ifdef AATREE_COMPACT
+
+/* The level is packed into the low bits of the child pointers, three
+   bits in each, which is enough for levels up to 63, i.e. any tree that
+   fits in memory. This makes the node two pointers in size, instead of
+   three. Everything using the tree must be compiled with AATREE_COMPACT
+   defined. */
+#define AATREE_TAG_BITS 3
+#define AATREE_TAG_MASK ((uintptr_t)((1 << AATREE_TAG_BITS) - 1))
+
+struct aatree_node_s
+{
+    _Alignas(1 << AATREE_TAG_BITS) uintptr_t tleft;
+    uintptr_t tright;
+#ifdef AATREE_PARENT
+    aatree_node_t *parent;
+#endif
+};
+
+static inline aatree_node_t *
+aatree_get_left(const aatree_node_t *n)
+{
+    return (aatree_node_t *)(n->tleft & ~AATREE_TAG_MASK);
+}
+
+static inline aatree_node_t *
+aatree_get_right(const aatree_node_t *n)
+{
+    return (aatree_node_t *)(n->tright & ~AATREE_TAG_MASK);
+}
+
+static inline aatree_level_t
+aatree_get_level(const aatree_node_t *n)
+{
+    uintptr_t lo = n->tleft & AATREE_TAG_MASK;
+    uintptr_t hi = n->tright & AATREE_TAG_MASK;
+
+    return (aatree_level_t)(lo | (hi << AATREE_TAG_BITS));
+}
+
+static inline void
+aatree_set_left(aatree_node_t *n, aatree_node_t *left)
+{
+    n->tleft = (uintptr_t)left | (n->tleft & AATREE_TAG_MASK);
+    AATREE_LINK_PARENT(left, n);
+}
+
+static inline void
+aatree_set_right(aatree_node_t *n, aatree_node_t *right)
+{
+    n->tright = (uintptr_t)right | (n->tright & AATREE_TAG_MASK);
+    AATREE_LINK_PARENT(right, n);
+}
+
+static inline void
+aatree_set_level(aatree_node_t *n, aatree_level_t level)
+{
+    n->tleft = (n->tleft & ~AATREE_TAG_MASK) | (level & AATREE_TAG_MASK);
+    n->tright = ((n->tright & ~AATREE_TAG_MASK) |
+                 ((level >> AATREE_TAG_BITS) & AATREE_TAG_MASK));
+}
+
+#else  /* AATREE_COMPACT */
+
 struct aatree_node_s
 {
     aatree_node_t *left, *right;
+#ifdef AATREE_PARENT
+    aatree_node_t *parent;
+#endif
     aatree_level_t level;
 };
 
+static inline aatree_node_t *
+aatree_get_left(const aatree_node_t *n)
+{
+    return n->left;
+}
+
+static inline aatree_node_t *
+aatree_get_right(const aatree_node_t *n)
+{
+    return n->right;
+}
+
+static inline aatree_level_t
+aatree_get_level(const aatree_node_t *n)
+{
+    return n->level;
+}
+
+static inline void
+aatree_set_left(aatree_node_t *n, aatree_node_t *left)
+{
+    n->left = left;
+    AATREE_LINK_PARENT(left, n);
+}
+
+static inline void
+aatree_set_right(aatree_node_t *n, aatree_node_t *right)
+{
+    n->right = right;
+    AATREE_LINK_PARENT(right, n);
+}
+
+static inline void
+aatree_set_level(aatree_node_t *n, aatree_level_t level)
+{
+    n->level = level;
+}
+
+#endif /* AATREE_COMPACT */
+
+#ifdef AATREE_PARENT
+
+/* NULL for the root */
+static inline aatree_node_t *
+aatree_get_parent(const aatree_node_t *n)
+{
+    return n->parent;
+}
+
+#endif /* AATREE_PARENT */
+
 typedef struct aatree_s aatree_t;
+typedef struct aatree_cache_s aatree_cache_t;
+typedef struct aatree_bloom_s aatree_bloom_t;
 
 typedef int aatree_compare_fun_t(aatree_t *, void *keyp, aatree_node_t *);
 typedef void aatree_swap_fun_t(aatree_t *, aatree_node_t *, aatree_node_t *);
 typedef bool aatree_condition_fun_t(aatree_t *, aatree_node_t *);
+typedef void *aatree_key_fun_t(aatree_t *, aatree_node_t *);
+typedef void aatree_update_fun_t(aatree_t *, aatree_node_t *);
+typedef void aatree_release_fun_t(aatree_t *, aatree_node_t *);
+typedef uint64_t aatree_hash_fun_t(aatree_t *, void *keyp);
+typedef void aatree_fold_fun_t(aatree_t *, void *acc, aatree_node_t *,
+                               bool subtree);
 
 struct aatree_s
 {
     aatree_node_t *root;
     aatree_compare_fun_t *compare;
     aatree_swap_fun_t *swap;
+    /* Optional; returns the key of a node. Needed by operations that
+       move or order nodes already in a tree, without a key at hand. */
+    aatree_key_fun_t *key;
+    /* Optional; recomputes a node's aggregate (kept by the user in the
+       node) from the node itself and its children's aggregates. It's
+       called whenever the subtree below a node has changed, children
+       first. The swap function must not swap the aggregates. */
+    aatree_update_fun_t *update;
+    /* The first and last nodes in key order, NULL when empty. Kept up
+       to date by the aatree functions; don't set the root directly. */
+    aatree_node_t *min, *max;
+    /* Optional; see aatree_cache_attach() */
+    aatree_cache_t *cache;
+    /* Optional; see aatree_bloom_attach() */
+    aatree_bloom_t *bloom;
+#if defined(AATREE_STATS) && ! defined(AATREE_STATS_THREAD)
+    aatree_stats_t stats;
+#endif
+};
+
+/* One cache line of cached lookups */
+#define AATREE_CACHE_WAYS 4
+#define AATREE_CACHE_ALIGN 64
+
+typedef struct aatree_cache_set_s
+{
+    _Alignas(AATREE_CACHE_ALIGN) uint64_t hash[AATREE_CACHE_WAYS];
+    aatree_node_t *node[AATREE_CACHE_WAYS]; /* NULL if unused */
+} aatree_cache_set_t;
+
+struct aatree_cache_s
+{
+    aatree_hash_fun_t *hash;
+    size_t mask;                /* Number of sets - 1 */
+    uint64_t hits, misses;
+    aatree_cache_set_t *set;
+};
+
+/* A Bloom filter where all the bits of a key are in one cache line */
+#define AATREE_BLOOM_WORDS 8
+
+struct aatree_bloom_s
+{
+    aatree_hash_fun_t *hash;
+    size_t mask;                /* Number of blocks - 1 */
+    size_t keys;                /* The number of keys it's sized for */
+    uint64_t added, removed;    /* Since it was last cleared */
+    uint64_t rejects;           /* Lookups answered by the filter alone */
+    uint64_t *bits;
 };
 
+/* Code outside aatree.c that links nodes itself must set the root
+   with this. */
+static inline void
+aatree_set_root(aatree_t *t, aatree_node_t *n)
+{
+    t->root = n;
+#ifdef AATREE_PARENT
+    if (n != NULL)
+        n->parent = NULL;
+#endif
+}
+
+#ifdef AATREE_PARENT
+
+typedef struct aatree_iter_s
+{
+    void *keyp;
+    aatree_t *base;
+    aatree_node_t *next;        /* The node to return next, or NULL */
+} aatree_iter_t;
+
+#else  /* AATREE_PARENT */
+
 typedef struct aatree_iter_s
 {
     void *keyp;
@@ -44,6 +281,8 @@ typedef struct aatree_iter_s
     aatree_node_t *node[AATREE_MAX_DEPTH];
 } aatree_iter_t;
 
+#endif /* AATREE_PARENT */
+
 /* Initialize a new node */
 void aatree_init_node(aatree_node_t *n);
 
@@ -64,6 +303,22 @@ aatree_node_t *aatree_insert_unique_node(aatree_t *t,
 aatree_node_t *aatree_replace_node(aatree_t *t,
                                    void *keyp, aatree_node_t *n);
 
+/* Build the tree from 'n' nodes, sorted by key, in linear time. The tree
+   must be empty, and gets minimal height. */
+void aatree_build_sorted(aatree_t *t, aatree_node_t *nodes[], size_t n);
+
+/* Insert 'n' nodes, sorted by key, after any equal keys in the tree.
+   A batch that is a sizable part of the tree is merged with it, in time
+   linear in the batch, and the tree gets minimal height. A smaller one
+   is inserted node by node.
+   The tree must have a key function. */
+void aatree_insert_sorted(aatree_t *t, aatree_node_t *nodes[], size_t n);
+
+/* Rebuild the tree to minimal height, in linear time and without
+   allocating memory. The nodes stay where they are; see
+   aatreem_compact() for relocating them as well. */
+void aatree_compact(aatree_t *t);
+
 /* Remove a node with matching key. If 'cond' is given, the condition
    must return true as well for it to match. *nodep is set to the removed
    node if it was found, or NULL otherwise. It will remove the first matching
@@ -72,6 +327,47 @@ aatree_node_t *aatree_replace_node(aatree_t *t,
 aatree_node_t *aatree_remove_node(aatree_t *t, void *keyp,
                                   aatree_condition_fun_t *cond);
 
+/* As aatree_remove_node(), but the matching node itself is unlinked and
+   another node is moved into its place, so no node changes its key and
+   the swap function isn't called. If 'parentp' isn't NULL, it's set to
+   the removed node's parent before the removal, or NULL for the root.
+   Returns the removed node, or NULL if not found. */
+aatree_node_t *aatree_unlink_node(aatree_t *t, void *keyp,
+                                  aatree_condition_fun_t *cond,
+                                  aatree_node_t **parentp);
+
+/* Returns the first node in key order, or NULL if the tree is empty.
+   O(1). */
+aatree_node_t *aatree_min(aatree_t *t);
+/* Returns the last node in key order, or NULL if the tree is empty.
+   O(1). */
+aatree_node_t *aatree_max(aatree_t *t);
+
+/* Remove the first node in key order. No keys are compared.
+   Returns the removed node, or NULL if the tree is empty. */
+aatree_node_t *aatree_pop_min(aatree_t *t);
+/* Remove the last node in key order. No keys are compared.
+   Returns the removed node, or NULL if the tree is empty. */
+aatree_node_t *aatree_pop_max(aatree_t *t);
+
+/* Remove up to 'n' nodes from the start of the tree, into nodes[], in
+   key order. If 'below' is not NULL, it stops at the first node with
+   a key that isn't less than it, e.g. for expiring timers.
+   Returns the number of nodes removed. */
+size_t aatree_pop_min_n(aatree_t *t, aatree_node_t *nodes[], size_t n,
+                        void *below);
+
+/* Remove all nodes from the tree, calling 'release' (if not NULL) on
+   each in key order, after which the node is no longer touched and may
+   be freed. Iterative and O(n), without rebalancing. */
+void aatree_clear(aatree_t *t, aatree_release_fun_t *release);
+
+/* As aatree_clear(), but release at most 'max_nodes' nodes per call.
+   Returns true when the tree is empty. Once started, the tree is no
+   longer balanced, and must only be passed to this until it's empty. */
+bool aatree_destroy_step(aatree_t *t, size_t max_nodes,
+                         aatree_release_fun_t *release);
+
 /* Find a node matching 'key'. If a 'cond' is provided, this is called
    and must return true for it to be a match.
    It will return the first matching node it encounters in the tree.
@@ -79,13 +375,59 @@ aatree_node_t *aatree_remove_node(aatree_t *t, void *keyp,
 aatree_node_t *aatree_find_key(aatree_t *t, void *keyp,
                                aatree_condition_fun_t *cond);
 
+/* Attach a set associative cache of about 'entries' lookups to the tree,
+   mapping key hashes to nodes, which aatree_find_key() (without 'cond')
+   checks first. Removals drop the affected entries, but if nodes are
+   moved or freed by other means, aatree_cache_clear() must be called.
+   Lookups update the cache, so they are no longer read only.
+   The tree must have a key function.
+   Returns false if memory could not be allocated. */
+bool aatree_cache_attach(aatree_t *t, size_t entries,
+                         aatree_hash_fun_t *hash);
+/* Detach and free the cache, if any. */
+void aatree_cache_detach(aatree_t *t);
+/* Forget all cached lookups, keeping the counters. */
+void aatree_cache_clear(aatree_t *t);
+
+/* Attach a blocked Bloom filter sized for about 'keys' keys, which
+   aatree_find_key() checks first, so that most lookups of keys that are
+   not in the tree take one cache line instead of a descent. The keys
+   already in the tree are added. The insertion functions add keys, but
+   removals can't take them out, and only count them, so the filter
+   should be rebuilt when 'removed' gets large compared to 'added'.
+   The tree must have a key function.
+   Returns false if memory could not be allocated. */
+bool aatree_bloom_attach(aatree_t *t, size_t keys, aatree_hash_fun_t *hash);
+/* Detach and free the filter, if any. */
+void aatree_bloom_detach(aatree_t *t);
+/* Clear the filter and add the keys in the tree again, growing the
+   filter if the tree has more keys than it was sized for.
+   Returns false if memory could not be allocated, in which case the
+   filter is unchanged. */
+bool aatree_bloom_rebuild(aatree_t *t);
+/* Empty the filter, if any. */
+void aatree_bloom_clear(aatree_t *t);
+/* Add a key to the filter, if any. Code outside aatree.c that links
+   nodes itself must do this for their keys. */
+void aatree_bloom_add(aatree_t *t, void *keyp);
+
+/* Fold the nodes with keys in [lo, hi) into 'acc', in key order. When
+   'subtree' is true, fold should add the aggregate of the node's whole
+   subtree, otherwise just the node itself. Subtree aggregates are used
+   wherever possible, so this is O(log n) calls to fold.
+   A NULL lo or hi means unbounded.
+   Returns false if the tree is too deep, true otherwise. */
+bool aatree_aggregate(aatree_t *t, void *lo, void *hi,
+                      aatree_fold_fun_t *fold, void *acc);
+
 /* Call f for each node inte the tree.
    If f returns false for any node, it will abort the iteration
    and aatree_each() returns false, otherwise true is returned. */
 bool aatree_each(aatree_t *, bool (*f)(aatree_t *, aatree_node_t *));
 
 /* Initialize an iterator for t.
-   Returns false if tree is too deep, true otherwise. */
+   Returns false if tree is too deep, true otherwise. With AATREE_PARENT,
+   the iterator holds no stack, and the tree is never too deep. */
 bool aatree_iter_init(aatree_t *t, aatree_iter_t *iter);
 /* Get the next node from the iterator.
    Returns NULL when there is no more, or the tree is too deep. */
@@ -98,5 +440,29 @@ bool aatree_iter_key_init(aatree_t *t, void *keyp, aatree_iter_t *iter);
    Returns NULL when there is no more, or the tree is too deep. */
 aatree_node_t *aatree_iter_key_next(aatree_iter_t *iter);
 
+/* Initialize an iterator for the nodes with keys greater than or equal
+   to 'keyp', in key order with aatree_iter_next(), starting with a
+   descent instead of going through the nodes before it.
+   Returns false if the tree is too deep, true otherwise. */
+bool aatree_iter_from_init(aatree_t *t, void *keyp, aatree_iter_t *iter);
+
+#ifdef AATREE_PARENT
+/* Returns the node following n in key order, or NULL if n is the last.
+   O(1) amortized over a full iteration. */
+aatree_node_t *aatree_next_node(aatree_node_t *n);
+/* Returns the node preceding n in key order, or NULL if n is the first. */
+aatree_node_t *aatree_prev_node(aatree_node_t *n);
+#endif
+
 /* Returns the height of the tree. */
 uint64_t aatree_height(aatree_t *t);
+
+#ifdef AATREE_STATS
+/* Copy the tree's counters to *s. With AATREE_STATS_THREAD, these are
+   the calling thread's counters, and t is ignored. */
+void aatree_stats_get(aatree_t *t, aatree_stats_t *s);
+/* Set the counters to zero. */
+void aatree_stats_reset(aatree_t *t);
+/* Print the counters, and the depths with the median and maximum. */
+void aatree_stats_dump(const aatree_stats_t *s, FILE *f);
+#endif
@@ -0,0 +1,538 @@
+/*
+** pem 2026-10-19
+**
+** A B+tree with the values in the leaves, which are linked in key order
+** for iteration. An internal node with n keys has n+1 children, and key
+** i separates the children: all keys below child i are <= key i, and
+** all keys below child i+1 are >= key i.
+**
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aatreeb.h"
+
+/* Nodes other than the root have at least this many keys */
+#define MIN_SLOTS (AATREEB_SLOTS / 2)
+
+struct aatreeb_node_s
+{
+    _Alignas(AATREEB_ALIGN) uint16_t n; /* Number of keys */
+    bool leaf;
+    aatreeb_key_t key[AATREEB_SLOTS];
+    union
+    {
+        struct                  /* Leaves */
+        {
+            void *value[AATREEB_SLOTS];
+            aatreeb_node_t *next; /* The next leaf */
+        } l;
+        aatreeb_node_t *child[AATREEB_SLOTS+1]; /* Internal nodes */
+        aatreeb_node_t *spare;  /* The next spare node */
+    } u;
+};
+
+_Static_assert(sizeof(aatreeb_node_t) == 2 * AATREEB_ALIGN,
+               "a node should fill two cache lines");
+
+/* A node split off by an insertion, to be added to the parent */
+typedef struct split_s
+{
+    aatreeb_key_t key;
+    aatreeb_node_t *node;       /* NULL if there was no split */
+} split_t;
+
+void
+aatreeb_init(aatreeb_t *t)
+{
+    memset(t, 0, sizeof(aatreeb_t));
+}
+
+static void
+destroy(aatreeb_node_t *n, void (*freefun)(void *))
+{
+    if (n->leaf)
+    {
+        if (freefun != NULL)
+            for (uint32_t i = 0 ; i < n->n ; i++)
+                freefun(n->u.l.value[i]);
+    }
+    else
+        for (uint32_t i = 0 ; i <= n->n ; i++)
+            destroy(n->u.child[i], freefun);
+    free(n);
+}
+
+void
+aatreeb_destroy(aatreeb_t *t, void (*freefun)(void *))
+{
+    if (t->root != NULL)
+        destroy(t->root, freefun);
+    while (t->spare != NULL)
+    {
+        aatreeb_node_t *n = t->spare;
+
+        t->spare = n->u.spare;
+        free(n);
+    }
+    aatreeb_init(t);
+}
+
+/* An insertion splits at most one node per level, plus a new root */
+static bool
+reserve(aatreeb_t *t)
+{
+    while (t->nspare < t->height + 1)
+    {
+        aatreeb_node_t *n = aligned_alloc(AATREEB_ALIGN,
+                                          sizeof(aatreeb_node_t));
+
+        if (n == NULL)
+            return false;
+        n->u.spare = t->spare;
+        t->spare = n;
+        t->nspare += 1;
+    }
+    return true;
+}
+
+static aatreeb_node_t *
+new_node(aatreeb_t *t, bool leaf)
+{
+    aatreeb_node_t *n = t->spare;
+
+    t->spare = n->u.spare;
+    t->nspare -= 1;
+    n->n = 0;
+    n->leaf = leaf;
+    if (leaf)
+        n->u.l.next = NULL;
+    return n;
+}
+
+/* The number of keys < key */
+static inline uint32_t
+lower_bound(const aatreeb_node_t *n, aatreeb_key_t key)
+{
+    uint32_t lo = 0, hi = n->n;
+
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (n->key[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* The number of keys <= key */
+static inline uint32_t
+upper_bound(const aatreeb_node_t *n, aatreeb_key_t key)
+{
+    uint32_t lo = 0, hi = n->n;
+
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (n->key[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Insert in a leaf that isn't full */
+static void
+leaf_put(aatreeb_node_t *n, uint32_t pos, aatreeb_key_t key, void *value)
+{
+    uint32_t m = n->n - pos;
+
+    memmove(&n->key[pos+1], &n->key[pos], m * sizeof(aatreeb_key_t));
+    memmove(&n->u.l.value[pos+1], &n->u.l.value[pos], m * sizeof(void *));
+    n->key[pos] = key;
+    n->u.l.value[pos] = value;
+    n->n += 1;
+}
+
+/* A full leaf is split in two halves, and the pair goes into the one
+   where it belongs. */
+static void
+leaf_insert(aatreeb_t *t, aatreeb_node_t *n, aatreeb_key_t key, void *value,
+            split_t *sp)
+{
+    uint32_t pos = upper_bound(n, key);
+
+    sp->node = NULL;
+    if (n->n < AATREEB_SLOTS)
+    {
+        leaf_put(n, pos, key, value);
+        return;
+    }
+
+    uint32_t half = (AATREEB_SLOTS + 1) / 2;
+    uint32_t from = (pos < half ? half - 1 : half);
+    aatreeb_node_t *r = new_node(t, true);
+
+    r->n = AATREEB_SLOTS - from;
+    memcpy(r->key, &n->key[from], r->n * sizeof(aatreeb_key_t));
+    memcpy(r->u.l.value, &n->u.l.value[from], r->n * sizeof(void *));
+    n->n = from;
+    if (pos < half)
+        leaf_put(n, pos, key, value);
+    else
+        leaf_put(r, pos - from, key, value);
+    r->u.l.next = n->u.l.next;
+    n->u.l.next = r;
+    sp->key = r->key[0];
+    sp->node = r;
+}
+
+/* Add the split child s after child i. A full node is split with the
+   middle key going up. */
+static void
+inner_insert(aatreeb_t *t, aatreeb_node_t *n, uint32_t i, split_t *s,
+             split_t *sp)
+{
+    sp->node = NULL;
+    if (n->n < AATREEB_SLOTS)
+    {
+        uint32_t m = n->n - i;
+
+        memmove(&n->key[i+1], &n->key[i], m * sizeof(aatreeb_key_t));
+        memmove(&n->u.child[i+2], &n->u.child[i+1],
+                m * sizeof(aatreeb_node_t *));
+        n->key[i] = s->key;
+        n->u.child[i+1] = s->node;
+        n->n += 1;
+        return;
+    }
+
+    aatreeb_key_t key[AATREEB_SLOTS+1];
+    aatreeb_node_t *child[AATREEB_SLOTS+2];
+    uint32_t half = (AATREEB_SLOTS + 1) / 2;
+    aatreeb_node_t *r = new_node(t, false);
+
+    memcpy(key, n->key, i * sizeof(aatreeb_key_t));
+    key[i] = s->key;
+    memcpy(&key[i+1], &n->key[i], (n->n - i) * sizeof(aatreeb_key_t));
+    memcpy(child, n->u.child, (i+1) * sizeof(aatreeb_node_t *));
+    child[i+1] = s->node;
+    memcpy(&child[i+2], &n->u.child[i+1],
+           (n->n - i) * sizeof(aatreeb_node_t *));
+
+    n->n = half;
+    memcpy(n->key, key, half * sizeof(aatreeb_key_t));
+    memcpy(n->u.child, child, (half+1) * sizeof(aatreeb_node_t *));
+    r->n = AATREEB_SLOTS - half;
+    memcpy(r->key, &key[half+1], r->n * sizeof(aatreeb_key_t));
+    memcpy(r->u.child, &child[half+1], (r->n+1) * sizeof(aatreeb_node_t *));
+    sp->key = key[half];
+    sp->node = r;
+}
+
+static void
+insert(aatreeb_t *t, aatreeb_node_t *n, aatreeb_key_t key, void *value,
+       split_t *sp)
+{
+    if (n->leaf)
+        leaf_insert(t, n, key, value, sp);
+    else
+    {
+        uint32_t i = upper_bound(n, key);
+        split_t s;
+
+        insert(t, n->u.child[i], key, value, &s);
+        if (s.node == NULL)
+            sp->node = NULL;
+        else
+            inner_insert(t, n, i, &s, sp);
+    }
+}
+
+bool
+aatreeb_insert(aatreeb_t *t, aatreeb_key_t key, void *value)
+{
+    split_t s;
+
+    if (! reserve(t))
+        return false;
+    if (t->root == NULL)
+    {
+        t->root = new_node(t, true);
+        t->height = 1;
+    }
+    insert(t, t->root, key, value, &s);
+    if (s.node != NULL)
+    {                           /* Grow a new root */
+        aatreeb_node_t *r = new_node(t, false);
+
+        r->n = 1;
+        r->key[0] = s.key;
+        r->u.child[0] = t->root;
+        r->u.child[1] = s.node;
+        t->root = r;
+        t->height += 1;
+    }
+    t->count += 1;
+    return true;
+}
+
+/* Find the leaf and position of the first key >= key. The position may
+   be at the end of the leaf, in which case it's the next leaf's first. */
+static aatreeb_node_t *
+seek(aatreeb_t *t, aatreeb_key_t key, uint32_t *ip)
+{
+    aatreeb_node_t *n = t->root;
+
+    if (n == NULL)
+        return NULL;
+    while (! n->leaf)
+        n = n->u.child[lower_bound(n, key)];
+    *ip = lower_bound(n, key);
+    return n;
+}
+
+bool
+aatreeb_find(aatreeb_t *t, aatreeb_key_t key, void **valuep)
+{
+    uint32_t i;
+    aatreeb_node_t *n = seek(t, key, &i);
+
+    if (n != NULL && i == n->n)
+    {
+        n = n->u.l.next;
+        i = 0;
+    }
+    if (n == NULL || n->key[i] != key)
+        return false;
+    if (valuep != NULL)
+        *valuep = n->u.l.value[i];
+    return true;
+}
+
+bool
+aatreeb_insert_unique(aatreeb_t *t, aatreeb_key_t key, void *value,
+                      void **xistsp)
+{
+    if (aatreeb_find(t, key, xistsp))
+        return false;
+    return aatreeb_insert(t, key, value);
+}
+
+/* Move the last pair or child of the left sibling to child i */
+static void
+borrow_left(aatreeb_node_t *p, uint32_t i)
+{
+    aatreeb_node_t *c = p->u.child[i];
+    aatreeb_node_t *l = p->u.child[i-1];
+
+    memmove(&c->key[1], &c->key[0], c->n * sizeof(aatreeb_key_t));
+    if (c->leaf)
+    {
+        memmove(&c->u.l.value[1], &c->u.l.value[0], c->n * sizeof(void *));
+        c->key[0] = l->key[l->n-1];
+        c->u.l.value[0] = l->u.l.value[l->n-1];
+        p->key[i-1] = c->key[0];
+    }
+    else
+    {
+        memmove(&c->u.child[1], &c->u.child[0],
+                (c->n+1) * sizeof(aatreeb_node_t *));
+        c->key[0] = p->key[i-1];
+        c->u.child[0] = l->u.child[l->n];
+        p->key[i-1] = l->key[l->n-1];
+    }
+    c->n += 1;
+    l->n -= 1;
+}
+
+/* Move the first pair or child of the right sibling to child i */
+static void
+borrow_right(aatreeb_node_t *p, uint32_t i)
+{
+    aatreeb_node_t *c = p->u.child[i];
+    aatreeb_node_t *r = p->u.child[i+1];
+
+    if (c->leaf)
+    {
+        c->key[c->n] = r->key[0];
+        c->u.l.value[c->n] = r->u.l.value[0];
+        memmove(&r->u.l.value[0], &r->u.l.value[1],
+                (r->n-1) * sizeof(void *));
+    }
+    else
+    {
+        c->key[c->n] = p->key[i];
+        c->u.child[c->n+1] = r->u.child[0];
+        p->key[i] = r->key[0];
+        memmove(&r->u.child[0], &r->u.child[1],
+                r->n * sizeof(aatreeb_node_t *));
+    }
+    memmove(&r->key[0], &r->key[1], (r->n-1) * sizeof(aatreeb_key_t));
+    c->n += 1;
+    r->n -= 1;
+    if (c->leaf)
+        p->key[i] = r->key[0];
+}
+
+/* Merge child i+1 into child i, and remove it from the parent */
+static void
+merge(aatreeb_node_t *p, uint32_t i)
+{
+    aatreeb_node_t *l = p->u.child[i];
+    aatreeb_node_t *r = p->u.child[i+1];
+
+    if (l->leaf)
+    {
+        memcpy(&l->key[l->n], r->key, r->n * sizeof(aatreeb_key_t));
+        memcpy(&l->u.l.value[l->n], r->u.l.value, r->n * sizeof(void *));
+        l->n += r->n;
+        l->u.l.next = r->u.l.next;
+    }
+    else
+    {
+        l->key[l->n] = p->key[i];
+        memcpy(&l->key[l->n+1], r->key, r->n * sizeof(aatreeb_key_t));
+        memcpy(&l->u.child[l->n+1], r->u.child,
+               (r->n+1) * sizeof(aatreeb_node_t *));
+        l->n += r->n + 1;
+    }
+    free(r);
+    memmove(&p->key[i], &p->key[i+1], (p->n-i-1) * sizeof(aatreeb_key_t));
+    memmove(&p->u.child[i+1], &p->u.child[i+2],
+            (p->n-i-1) * sizeof(aatreeb_node_t *));
+    p->n -= 1;
+}
+
+static void
+fix_underflow(aatreeb_node_t *p, uint32_t i)
+{
+    if (i > 0 && p->u.child[i-1]->n > MIN_SLOTS)
+        borrow_left(p, i);
+    else if (i < p->n && p->u.child[i+1]->n > MIN_SLOTS)
+        borrow_right(p, i);
+    else if (i > 0)
+        merge(p, i-1);
+    else
+        merge(p, i);
+}
+
+/* Remove the first pair with the key below n, and fix the child it was
+   removed from if it got too small. Equal keys can span several
+   children, but only when the separators between them are equal too. */
+static bool
+remove_key(aatreeb_node_t *n, aatreeb_key_t key, void **valuep)
+{
+    uint32_t i = lower_bound(n, key);
+
+    if (n->leaf)
+    {
+        if (i == n->n || n->key[i] != key)
+            return false;
+        *valuep = n->u.l.value[i];
+        memmove(&n->key[i], &n->key[i+1],
+                (n->n-i-1) * sizeof(aatreeb_key_t));
+        memmove(&n->u.l.value[i], &n->u.l.value[i+1],
+                (n->n-i-1) * sizeof(void *));
+        n->n -= 1;
+        return true;
+    }
+    for ( ; i <= n->n ; i++)
+    {
+        if (remove_key(n->u.child[i], key, valuep))
+        {
+            if (n->u.child[i]->n < MIN_SLOTS)
+                fix_underflow(n, i);
+            return true;
+        }
+        if (i == n->n || n->key[i] != key)
+            break;
+    }
+    return false;
+}
+
+bool
+aatreeb_remove(aatreeb_t *t, aatreeb_key_t key, void **valuep)
+{
+    void *value;
+
+    if (t->root == NULL || ! remove_key(t->root, key, &value))
+        return false;
+    if (t->root->n == 0)
+    {                           /* Shrink the root */
+        aatreeb_node_t *r = t->root;
+
+        t->root = (r->leaf ? NULL : r->u.child[0]);
+        t->height -= 1;
+        free(r);
+    }
+    t->count -= 1;
+    if (valuep != NULL)
+        *valuep = value;
+    return true;
+}
+
+size_t
+aatreeb_count(aatreeb_t *t)
+{
+    return t->count;
+}
+
+uint64_t
+aatreeb_height(aatreeb_t *t)
+{
+    return t->height;
+}
+
+void
+aatreeb_iter_init(aatreeb_t *t, aatreeb_iter_t *iter)
+{
+    aatreeb_node_t *n = t->root;
+
+    if (n != NULL)
+        while (! n->leaf)
+            n = n->u.child[0];
+    iter->leaf = n;
+    iter->i = 0;
+    iter->bounded = false;
+}
+
+void
+aatreeb_iter_range_init(aatreeb_t *t, aatreeb_key_t lo, aatreeb_key_t hi,
+                        aatreeb_iter_t *iter)
+{
+    iter->leaf = seek(t, lo, &iter->i);
+    iter->bounded = true;
+    iter->hi = hi;
+}
+
+bool
+aatreeb_iter_next(aatreeb_iter_t *iter, aatreeb_key_t *keyp, void **valuep)
+{
+    aatreeb_node_t *n = iter->leaf;
+
+    while (n != NULL && iter->i >= n->n)
+    {
+        n = iter->leaf = n->u.l.next;
+        iter->i = 0;
+    }
+    if (n == NULL)
+        return false;
+    if (iter->bounded && n->key[iter->i] >= iter->hi)
+    {
+        iter->leaf = NULL;
+        return false;
+    }
+    if (keyp != NULL)
+        *keyp = n->key[iter->i];
+    if (valuep != NULL)
+        *valuep = n->u.l.value[iter->i];
+    iter->i += 1;
+    return true;
+}
@@ -0,0 +1,94 @@
+/*
+** pem 2026-10-19
+**
+** A wide-node tree: a B+tree with 64 bit keys and void* values, where
+** each node holds up to AATREEB_SLOTS keys in two cache lines: the key
+** count and the keys in the first, and the children, or the values and
+** the next leaf, in the second. This makes the height about log8(n)
+** instead of log2(n), and a lookup reads two lines per level, which is
+** about 2/3 of the cache misses of a binary tree.
+**
+** Keys need not be unique; equal keys are kept in insertion order, as
+** in the binary tree. Keys that are not integers must be mapped to an
+** order preserving 64 bit key by the caller.
+**
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* 7 keys and the key count fill one cache line, and 8 children (or 7
+   values and a pointer) the next */
+#define AATREEB_SLOTS 7
+#define AATREEB_ALIGN 64
+
+typedef uint64_t aatreeb_key_t;
+
+typedef struct aatreeb_node_s aatreeb_node_t;
+
+typedef struct aatreeb_s
+{
+    aatreeb_node_t *root;       /* NULL when empty */
+    size_t count;
+    uint32_t height;
+    /* Nodes allocated before an insertion, so that it can't fail half
+       way through splitting */
+    aatreeb_node_t *spare;
+    uint32_t nspare;
+} aatreeb_t;
+
+typedef struct aatreeb_iter_s
+{
+    aatreeb_node_t *leaf;       /* NULL when there is no more */
+    uint32_t i;
+    bool bounded;
+    aatreeb_key_t hi;
+} aatreeb_iter_t;
+
+/* Initialize an empty tree. */
+void aatreeb_init(aatreeb_t *t);
+
+/* Free all the nodes. If 'freefun' is not NULL, it is called on each
+   value. The tree is empty afterwards. */
+void aatreeb_destroy(aatreeb_t *t, void (*freefun)(void *));
+
+/* Insert the key-value pair, after any equal keys.
+   Returns false if memory could not be allocated. */
+bool aatreeb_insert(aatreeb_t *t, aatreeb_key_t key, void *value);
+
+/* Insert the key-value pair if the key is not in the tree. Otherwise,
+   no insertion is done and *xistsp is set to the existing value.
+   Returns false if not inserted. */
+bool aatreeb_insert_unique(aatreeb_t *t, aatreeb_key_t key, void *value,
+                           void **xistsp);
+
+/* Find the first pair with the key. If found, *valuep is set to the
+   value, unless valuep is NULL.
+   Returns true if found. */
+bool aatreeb_find(aatreeb_t *t, aatreeb_key_t key, void **valuep);
+
+/* Remove the first pair with the key. If found, *valuep is set to the
+   value, unless valuep is NULL.
+   Returns true if found and removed. */
+bool aatreeb_remove(aatreeb_t *t, aatreeb_key_t key, void **valuep);
+
+/* Returns the number of pairs in the tree. */
+size_t aatreeb_count(aatreeb_t *t);
+
+/* Returns the height of the tree, 0 when empty. */
+uint64_t aatreeb_height(aatreeb_t *t);
+
+/* Initialize an iterator over all pairs in key order. The tree must
+   not be modified while an iterator is in use. */
+void aatreeb_iter_init(aatreeb_t *t, aatreeb_iter_t *iter);
+/* Initialize an iterator over the pairs with keys in [lo, hi). */
+void aatreeb_iter_range_init(aatreeb_t *t, aatreeb_key_t lo, aatreeb_key_t hi,
+                             aatreeb_iter_t *iter);
+/* Get the next pair from the iterator. Either of keyp and valuep can
+   be NULL.
+   Returns false when there is no more. */
+bool aatreeb_iter_next(aatreeb_iter_t *iter,
+                       aatreeb_key_t *keyp, void **valuep);
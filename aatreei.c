@@ -0,0 +1,131 @@
+/*
+** pem 2026-10-19
+**
+** Interval trees.
+**
+*/
+
+#include <string.h>
+
+#include "aatreei.h"
+
+#define UNUSED(x) ((void)(x))
+
+static int
+aatreei_compare(aatree_t *t, void *keyp, aatree_node_t *b)
+{
+    UNUSED(t);
+    aatreei_interval_t *a = keyp;
+    aatreei_interval_t *biv = &((aatreei_node_t *)b)->iv;
+
+    if (a->start != biv->start)
+        return (a->start < biv->start ? -1 : 1);
+    if (a->end != biv->end)
+        return (a->end < biv->end ? -1 : 1);
+    return 0;
+}
+
+static void
+aatreei_swap(aatree_t *t, aatree_node_t *a, aatree_node_t *b)
+{
+    aatreei_t *it = (aatreei_t *)t;
+    aatreei_interval_t tmp = ((aatreei_node_t *)a)->iv;
+
+    ((aatreei_node_t *)a)->iv = ((aatreei_node_t *)b)->iv;
+    ((aatreei_node_t *)b)->iv = tmp;
+    if (it->swap != NULL)
+        it->swap(t, a, b);
+}
+
+static void *
+aatreei_key(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    return &((aatreei_node_t *)n)->iv;
+}
+
+static void
+aatreei_update(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    aatreei_node_t *in = (aatreei_node_t *)n;
+
+    aatreei_node_t *l = (aatreei_node_t *)aatree_get_left(n);
+    aatreei_node_t *r = (aatreei_node_t *)aatree_get_right(n);
+
+    in->maxend = in->iv.end;
+    if (l != NULL && l->maxend > in->maxend)
+        in->maxend = l->maxend;
+    if (r != NULL && r->maxend > in->maxend)
+        in->maxend = r->maxend;
+}
+
+void
+aatreei_init(aatreei_t *t, aatree_swap_fun_t *swap)
+{
+    memset(t, 0, sizeof(aatreei_t));
+    t->base.compare = aatreei_compare;
+    t->base.swap = aatreei_swap;
+    t->base.key = aatreei_key;
+    t->base.update = aatreei_update;
+    t->swap = swap;
+}
+
+void
+aatreei_insert(aatreei_t *t, aatreei_node_t *n,
+               aatreei_point_t start, aatreei_point_t end)
+{
+    aatree_init_node(&n->n);
+    n->iv.start = start;
+    n->iv.end = end;
+    aatree_insert_node(&t->base, &n->iv, &n->n);
+}
+
+aatreei_node_t *
+aatreei_remove(aatreei_t *t, aatreei_point_t start, aatreei_point_t end)
+{
+    aatreei_interval_t iv = { start, end };
+
+    return (aatreei_node_t *)aatree_remove_node(&t->base, &iv, NULL);
+}
+
+/* Subtrees where nothing ends after a, and right subtrees of nodes that
+   start at or after b, are skipped. */
+static bool
+overlap(aatree_t *t, aatree_node_t *n, aatreei_point_t a, aatreei_point_t b,
+        bool (*f)(aatree_t *, aatree_node_t *))
+{
+    while (n != NULL)
+    {
+        aatreei_node_t *in = (aatreei_node_t *)n;
+
+        if (in->maxend <= a)
+            break;
+        if (! overlap(t, aatree_get_left(n), a, b, f))
+            return false;
+        if (in->iv.start >= b)
+            break;
+        if (a < in->iv.end && in->iv.start < in->iv.end && ! f(t, n))
+            return false;
+        n = aatree_get_right(n);
+    }
+    return true;
+}
+
+bool
+aatreei_overlap(aatreei_t *t, aatreei_point_t a, aatreei_point_t b,
+                bool (*f)(aatree_t *, aatree_node_t *))
+{
+    if (a >= b)
+        return true;
+    return overlap(&t->base, t->base.root, a, b, f);
+}
+
+bool
+aatreei_stab(aatreei_t *t, aatreei_point_t p,
+             bool (*f)(aatree_t *, aatree_node_t *))
+{
+    if (p == INT64_MAX)
+        return true;            /* Nothing can contain it */
+    return overlap(&t->base, t->base.root, p, p+1, f);
+}
@@ -0,0 +1,59 @@
+/*
+** pem 2026-10-19
+**
+** Interval trees. Each node holds a half-open interval [start, end),
+** and the maximum end in its subtree, which is kept through the
+** rotations with the tree's update function. The nodes are ordered by
+** start, then end.
+**
+*/
+
+#pragma once
+
+#include "aatree.h"
+
+typedef int64_t aatreei_point_t;
+
+typedef struct aatreei_interval_s
+{
+    aatreei_point_t start, end;
+} aatreei_interval_t;
+
+typedef struct aatreei_node_s
+{
+    aatree_node_t n;            /* Must be first */
+    aatreei_interval_t iv;
+    aatreei_point_t maxend;     /* The maximum end in the subtree */
+} aatreei_node_t;
+
+typedef struct aatreei_s
+{
+    aatree_t base;              /* Must be first */
+    aatree_swap_fun_t *swap;
+} aatreei_t;
+
+/* Initialize an empty interval tree. 'swap' should swap any user data
+   in the nodes (which embed aatreei_node_t first), the intervals are
+   swapped before it's called. It may be NULL. */
+void aatreei_init(aatreei_t *t, aatree_swap_fun_t *swap);
+
+/* Insert the node with the interval [start, end). */
+void aatreei_insert(aatreei_t *t, aatreei_node_t *n,
+                    aatreei_point_t start, aatreei_point_t end);
+
+/* Remove a node with the interval [start, end).
+   Returns the removed node, or NULL if there was none. */
+aatreei_node_t *aatreei_remove(aatreei_t *t,
+                               aatreei_point_t start, aatreei_point_t end);
+
+/* Call f for each node with an interval overlapping [a, b), in order.
+   Empty intervals overlap nothing.
+   If f returns false for any node, it will abort and return false,
+   otherwise true is returned. */
+bool aatreei_overlap(aatreei_t *t, aatreei_point_t a, aatreei_point_t b,
+                     bool (*f)(aatree_t *, aatree_node_t *));
+
+/* Call f for each node with an interval containing p. As aatreei_overlap()
+   otherwise. */
+bool aatreei_stab(aatreei_t *t, aatreei_point_t p,
+                  bool (*f)(aatree_t *, aatree_node_t *));
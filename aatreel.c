@@ -0,0 +1,610 @@
+/*
+** pem 2026-10-19
+**
+** A write-ahead log for trees made with aatreem_create().
+**
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "aatreel.h"
+
+#define UNUSED(x) ((void)(x))
+
+#define LOG_NAME "log"
+#define SNAPSHOT_NAME "snapshot"
+#define SNAPSHOT_TMP_NAME "snapshot.tmp"
+#define SNAPSHOT_MAGIC "AATREEL1"
+#define GROUP_BYTES (64 * 1024)
+#define PATH_SIZE 4096
+
+/* A record in the log, followed by the key and new key, each with its
+   '\0', and the value. 'len' is the size of it all, and 'crc' is of
+   what follows it. Not aligned in the log, so copied in and out. */
+typedef struct lrec_s
+{
+    uint32_t len;
+    uint32_t crc;
+    uint64_t lsn;
+    uint32_t op;                /* An aatreem_change_op_t */
+    uint32_t keylen, newkeylen; /* Including the '\0', 0 for none */
+    uint32_t valuelen;
+} lrec_t;
+
+#define LREC_CRC_OFFSET offsetof(lrec_t, lsn)
+
+/* The snapshot starts with this, followed by a key length (with the
+   '\0') and value length, the key, and the value, for each node in key
+   order, and ends with the crc of all before it. */
+typedef struct shead_s
+{
+    char magic[8];
+    uint64_t lsn;               /* Of the latest change in it */
+    uint64_t count;
+} shead_t;
+
+struct aatreel_s
+{
+    aatree_t *t;
+    aatreel_options_t opts;
+    char *dir;
+    int fd;                     /* The log, opened for appending */
+    uint64_t lsn;               /* Of the latest change */
+    size_t log_size;            /* What's been written to the log */
+    char *buf;                  /* Changes not yet written */
+    size_t len, size;
+    bool lost;                  /* A change could not be buffered */
+    struct timespec synced;     /* When the log was last synced */
+};
+
+/*
+** CRC-32, as in zlib
+*/
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_init(void)
+{
+    for (uint32_t i = 0 ; i < 256 ; i++)
+    {
+        uint32_t c = i;
+
+        for (int k = 0 ; k < 8 ; k++)
+            c = (c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1);
+        crc_table[i] = c;
+    }
+}
+
+/* Start with 0 */
+static uint32_t
+crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+    while (len-- > 0)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*
+** Files
+*/
+
+static bool
+path(char *buf, const char *dir, const char *name)
+{
+    if (snprintf(buf, PATH_SIZE, "%s/%s", dir, name) >= PATH_SIZE)
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+/* Read the whole file into a new buffer.
+   Returns NULL on failure; with errno ENOENT if it doesn't exist. */
+static char *
+read_all(int fd, size_t *lenp)
+{
+    struct stat st;
+    char *buf;
+    size_t len = 0;
+
+    if (fstat(fd, &st) < 0)
+        return NULL;
+    if ((buf = malloc((size_t)st.st_size + 1)) == NULL)
+        return NULL;
+    while (len < (size_t)st.st_size)
+    {
+        ssize_t r = read(fd, buf + len, (size_t)st.st_size - len);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        len += (size_t)r;
+    }
+    *lenp = len;
+    return buf;
+}
+
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t w = write(fd, buf, len);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return false;
+        buf += w;
+        len -= (size_t)w;
+    }
+    return true;
+}
+
+/* Make a rename in the directory durable */
+static bool
+sync_dir(const char *dir)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    bool ok;
+
+    if (fd < 0)
+        return false;
+    ok = (fsync(fd) == 0);
+    close(fd);
+    return ok;
+}
+
+static uint64_t
+elapsed_ms(const struct timespec *since, const struct timespec *now)
+{
+    return ((uint64_t)(now->tv_sec - since->tv_sec) * 1000 +
+            (uint64_t)((now->tv_nsec - since->tv_nsec) / 1000000));
+}
+
+/*
+** Logging
+*/
+
+/* Write what's buffered, and sync as the policy says. If the write
+   fails half way, the log is cut back to where it was, and the buffer
+   is kept for the next try. */
+static bool
+flush(aatreel_t *l)
+{
+    struct timespec now;
+
+    if (l->len > 0)
+    {
+        if (! write_all(l->fd, l->buf, l->len))
+        {
+            int err = errno;
+
+            (void)ftruncate(l->fd, (off_t)l->log_size);
+            errno = err;
+            return false;
+        }
+        l->log_size += l->len;
+        l->len = 0;
+    }
+    switch (l->opts.sync)
+    {
+    case aatreel_sync_none:
+        break;
+    case aatreel_sync_interval:
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_ms(&l->synced, &now) < l->opts.sync_ms)
+            break;
+        /* Fall through */
+    case aatreel_sync_commit:
+        if (fdatasync(l->fd) < 0)
+            return false;
+        clock_gettime(CLOCK_MONOTONIC, &l->synced);
+        break;
+    }
+    return true;
+}
+
+/* The change hook */
+static void
+log_change(aatree_t *t, const aatreem_change_t *c, void *arg)
+{
+    UNUSED(t);
+    aatreel_t *l = arg;
+    const void *value = NULL;
+    lrec_t r;
+    size_t len;
+
+    r.lsn = ++l->lsn;
+    /* Nothing after a lost change is any use, until a snapshot */
+    if (l->lost)
+        return;
+    r.op = c->op;
+    r.keylen = c->keylen + 1;
+    r.newkeylen = (c->newkey == NULL ? 0 : c->newkeylen + 1);
+    r.valuelen = 0;
+    if (l->opts.encode != NULL &&
+        (c->op == aatreem_change_insert || c->op == aatreem_change_replace))
+        r.valuelen = l->opts.encode(c->value, &value);
+    len = sizeof(lrec_t) + r.keylen + r.newkeylen + r.valuelen;
+    r.len = len;
+    if (l->len + len > l->size)
+    {
+        size_t size = (l->size == 0 ? 4096 : 2 * l->size);
+        char *buf;
+
+        while (size < l->len + len)
+            size *= 2;
+        if ((buf = realloc(l->buf, size)) == NULL)
+        {
+            l->lost = true;
+            return;
+        }
+        l->buf = buf;
+        l->size = size;
+    }
+
+    char *p = l->buf + l->len;
+
+    memcpy(p + sizeof(lrec_t), c->key, r.keylen);
+    if (r.newkeylen > 0)
+        memcpy(p + sizeof(lrec_t) + r.keylen, c->newkey, r.newkeylen);
+    if (r.valuelen > 0)
+        memcpy(p + sizeof(lrec_t) + r.keylen + r.newkeylen, value,
+               r.valuelen);
+    r.crc = 0;
+    memcpy(p, &r, sizeof(lrec_t));
+    r.crc = crc32(0, p + LREC_CRC_OFFSET, len - LREC_CRC_OFFSET);
+    memcpy(p, &r, sizeof(lrec_t));
+    l->len += len;
+    /* A failure here is tried again by the next commit */
+    if (l->len >= l->opts.group_bytes)
+        (void)flush(l);
+}
+
+/*
+** Snapshots
+*/
+
+static bool
+swrite(FILE *f, uint32_t *crcp, const void *p, size_t len)
+{
+    *crcp = crc32(*crcp, p, len);
+    return (len == 0 || fwrite(p, len, 1, f) == 1);
+}
+
+static bool
+write_snapshot(aatreel_t *l, FILE *f)
+{
+    aatree_iter_t iter;
+    aatree_node_t *n;
+    shead_t sh;
+    uint32_t crc = 0;
+    uint64_t count = 0;
+
+    if (! aatree_iter_init(l->t, &iter))
+    {
+        errno = EINVAL;
+        return false;
+    }
+    while (aatree_iter_next(&iter) != NULL)
+        count += 1;
+    memset(&sh, 0, sizeof(sh));
+    memcpy(sh.magic, SNAPSHOT_MAGIC, sizeof(sh.magic));
+    sh.lsn = l->lsn;
+    sh.count = count;
+    if (! swrite(f, &crc, &sh, sizeof(sh)))
+        return false;
+    (void)aatree_iter_init(l->t, &iter);
+    while ((n = aatree_iter_next(&iter)) != NULL)
+    {
+        const char *key = aatree_key(n);
+        const void *value = NULL;
+        uint32_t len[2];
+
+        len[0] = strlen(key) + 1;
+        len[1] = (l->opts.encode == NULL ? 0 :
+                  l->opts.encode(aatree_value(n), &value));
+        if (! swrite(f, &crc, len, sizeof(len)) ||
+            ! swrite(f, &crc, key, len[0]) ||
+            ! swrite(f, &crc, value, len[1]))
+            return false;
+    }
+    return (fwrite(&crc, sizeof(crc), 1, f) == 1);
+}
+
+/* Load the snapshot into the empty tree, if there is one, and set
+   *lsnp to its latest change */
+static bool
+load_snapshot(aatreel_t *l, uint64_t *lsnp)
+{
+    char file[PATH_SIZE];
+    int fd;
+    char *buf, *p, *end;
+    size_t len;
+    shead_t sh;
+    uint32_t crc;
+    const char **keys = NULL;
+    void **values = NULL;
+    size_t n = 0;
+    bool ok = false;
+
+    *lsnp = 0;
+    if (! path(file, l->dir, SNAPSHOT_NAME))
+        return false;
+    if ((fd = open(file, O_RDONLY)) < 0)
+        return (errno == ENOENT);
+    buf = read_all(fd, &len);
+    close(fd);
+    if (buf == NULL)
+        return false;
+    errno = EINVAL;
+    if (len < sizeof(sh) + sizeof(crc))
+        goto done;
+    memcpy(&sh, buf, sizeof(sh));
+    memcpy(&crc, buf + len - sizeof(crc), sizeof(crc));
+    if (memcmp(sh.magic, SNAPSHOT_MAGIC, sizeof(sh.magic)) != 0 ||
+        crc32(0, buf, len - sizeof(crc)) != crc ||
+        sh.count > len / (2 * sizeof(uint32_t)))
+        goto done;
+    keys = malloc(sh.count * sizeof(char *) + 1);
+    values = malloc(sh.count * sizeof(void *) + 1);
+    if (keys == NULL || values == NULL)
+        goto done;
+    p = buf + sizeof(sh);
+    end = buf + len - sizeof(crc);
+    for (n = 0 ; n < sh.count ; n++)
+    {
+        uint32_t klen[2];
+
+        if ((size_t)(end - p) < sizeof(klen))
+            goto done;
+        memcpy(klen, p, sizeof(klen));
+        p += sizeof(klen);
+        if (klen[0] == 0 || (size_t)(end - p) < (size_t)klen[0] + klen[1] ||
+            p[klen[0]-1] != '\0')
+            goto done;
+        keys[n] = p;
+        values[n] = (l->opts.decode == NULL ? NULL :
+                     l->opts.decode(p + klen[0], klen[1]));
+        p += klen[0] + klen[1];
+    }
+    if (! aatreem_load_sorted(l->t, n, keys, values))
+    {
+        errno = ENOMEM;
+        goto done;
+    }
+    *lsnp = sh.lsn;
+    ok = true;
+  done:
+    if (! ok && l->opts.freefun != NULL)
+        for (size_t i = 0 ; i < n ; i++)
+            l->opts.freefun(values[i]);
+    free(values);
+    free(keys);
+    free(buf);
+    return ok;
+}
+
+/*
+** Recovery
+*/
+
+static bool
+replay(aatreel_t *l, const lrec_t *r, const char *p)
+{
+    const char *key = p;
+    const char *newkey = p + r->keylen;
+    const char *bytes = p + r->keylen + r->newkeylen;
+    void *value = NULL, *old = NULL;
+    bool ok = true;
+
+    if ((r->op == aatreem_change_insert || r->op == aatreem_change_replace)
+        && l->opts.decode != NULL)
+        value = l->opts.decode(bytes, r->valuelen);
+    switch (r->op)
+    {
+    case aatreem_change_insert:
+        ok = aatreem_insert(l->t, key, value);
+        break;
+    case aatreem_change_replace:
+        ok = aatreem_replace(l->t, key, value, &old);
+        break;
+    case aatreem_change_delete:
+        (void)aatreem_delete(l->t, key, NULL, &old);
+        break;
+    case aatreem_change_rename:
+        ok = aatreem_rename(l->t, key, newkey);
+        break;
+    }
+    /* The old value, or the new one if it couldn't be added */
+    if (! ok)
+        old = value;
+    if (old != NULL && l->opts.freefun != NULL)
+        l->opts.freefun(old);
+    return ok;
+}
+
+/* Replay the changes in the log after the snapshot's, and cut it after
+   the last complete record */
+static bool
+replay_log(aatreel_t *l, uint64_t snapshot_lsn)
+{
+    size_t len, off = 0;
+    char *buf = read_all(l->fd, &len);
+    bool ok = true;
+
+    if (buf == NULL)
+        return false;
+    while (len - off >= sizeof(lrec_t))
+    {
+        lrec_t r;
+        char *p = buf + off;
+
+        memcpy(&r, p, sizeof(lrec_t));
+        if (r.len < sizeof(lrec_t) || r.len > len - off ||
+            (size_t)r.keylen + r.newkeylen + r.valuelen !=
+            r.len - sizeof(lrec_t) ||
+            r.keylen == 0 || r.op > aatreem_change_rename ||
+            crc32(0, p + LREC_CRC_OFFSET, r.len - LREC_CRC_OFFSET) != r.crc)
+            break;
+        p += sizeof(lrec_t);
+        if (p[r.keylen-1] != '\0' ||
+            (r.newkeylen > 0 && p[r.keylen+r.newkeylen-1] != '\0') ||
+            (r.op == aatreem_change_rename && r.newkeylen == 0))
+            break;
+        if (r.lsn > snapshot_lsn && ! (ok = replay(l, &r, p)))
+            break;
+        if (r.lsn > l->lsn)
+            l->lsn = r.lsn;
+        off += r.len;
+    }
+    free(buf);
+    if (! ok)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+    l->log_size = off;
+    if (off < len && (ftruncate(l->fd, (off_t)off) < 0 || fsync(l->fd) < 0))
+        return false;
+    return true;
+}
+
+/*
+** The API
+*/
+
+static void
+free_log(aatreel_t *l)
+{
+    if (l->fd >= 0)
+        close(l->fd);
+    free(l->buf);
+    free(l->dir);
+    free(l);
+}
+
+aatreel_t *
+aatreel_open(aatree_t *t, const char *dir, const aatreel_options_t *opts)
+{
+    aatreel_t *l = calloc(1, sizeof(aatreel_t));
+    char file[PATH_SIZE];
+    uint64_t lsn;
+
+    if (l == NULL)
+        return NULL;
+    if (aatreem_is_binary(t))
+    {
+        free(l);
+        errno = EINVAL;
+        return NULL;
+    }
+    l->t = t;
+    l->fd = -1;
+    if (opts != NULL)
+        l->opts = *opts;
+    if (l->opts.group_bytes == 0)
+        l->opts.group_bytes = GROUP_BYTES;
+    if ((l->dir = strdup(dir)) == NULL ||
+        (mkdir(dir, 0777) < 0 && errno != EEXIST) ||
+        ! load_snapshot(l, &lsn) ||
+        ! path(file, dir, LOG_NAME) ||
+        (l->fd = open(file, O_RDWR | O_CREAT | O_APPEND, 0666)) < 0)
+    {
+        int err = errno;
+
+        free_log(l);
+        errno = err;
+        return NULL;
+    }
+    l->lsn = lsn;
+    if (! replay_log(l, lsn))
+    {
+        int err = errno;
+
+        free_log(l);
+        errno = err;
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &l->synced);
+    aatreem_change_hook(t, log_change, l);
+    return l;
+}
+
+bool
+aatreel_snapshot(aatreel_t *l)
+{
+    char tmp[PATH_SIZE], file[PATH_SIZE];
+    FILE *f;
+    bool ok;
+
+    if (! flush(l) ||
+        ! path(tmp, l->dir, SNAPSHOT_TMP_NAME) ||
+        ! path(file, l->dir, SNAPSHOT_NAME) ||
+        (f = fopen(tmp, "w")) == NULL)
+        return false;
+    ok = (write_snapshot(l, f) && fflush(f) == 0 && fsync(fileno(f)) == 0);
+    if (fclose(f) != 0)
+        ok = false;
+    /* Once renamed, the log before it is no longer needed. The cut is
+       synced before any more changes are written, or a crash could
+       leave them on top of the old records, where replay would stop at
+       the first one that doesn't line up. */
+    if (! ok || rename(tmp, file) < 0 || ! sync_dir(l->dir) ||
+        ftruncate(l->fd, 0) < 0 || fsync(l->fd) < 0)
+    {
+        int err = errno;
+
+        (void)unlink(tmp);
+        errno = err;
+        return false;
+    }
+    l->log_size = 0;
+    l->lost = false;
+    return true;
+}
+
+bool
+aatreel_commit(aatreel_t *l)
+{
+    if (l->lost)
+        return aatreel_snapshot(l);
+    if (! flush(l))
+        return false;
+    if (l->opts.snapshot_bytes > 0 && l->log_size >= l->opts.snapshot_bytes)
+        return aatreel_snapshot(l);
+    return true;
+}
+
+bool
+aatreel_close(aatreel_t *l)
+{
+    bool ok = aatreel_commit(l);
+    int err;
+
+    if (ok && l->opts.sync != aatreel_sync_none && fdatasync(l->fd) < 0)
+        ok = false;
+    err = errno;
+    aatreem_change_hook(l->t, NULL, NULL);
+    free_log(l);
+    errno = err;
+    return ok;
+}
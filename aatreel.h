@@ -0,0 +1,79 @@
+/*
+** pem 2026-10-19
+**
+** A write-ahead log for trees made with aatreem_create(), so they can
+** be recovered after a restart.
+**
+** The changes are appended to a log file in the directory, buffered and
+** written in groups by aatreel_commit(), which syncs the file as often
+** as the policy says. A snapshot of the whole tree, in key order, now
+** and then replaces the log. Recovery loads the snapshot in linear time,
+** and replays the log after it, up to the first record that was not
+** completely written.
+**
+** The values are written as bytes given by an encoding function, and
+** made into values again by a decoding function when recovering.
+** Expiry times are not logged, but evictions and expiry are, as deletes.
+**
+*/
+
+#pragma once
+
+#include "aatreem.h"
+
+typedef struct aatreel_s aatreel_t;
+
+typedef enum aatreel_sync_e
+{
+    aatreel_sync_none,          /* Leave it to the system */
+    aatreel_sync_commit,        /* On each commit */
+    aatreel_sync_interval       /* On a commit, if 'sync_ms' have passed */
+} aatreel_sync_t;
+
+/* Sets *bytesp to the bytes to log for the value.
+   Returns the number of bytes. */
+typedef size_t aatreel_encode_fun_t(const void *value, const void **bytesp);
+/* Returns a new value made from the logged bytes. */
+typedef void *aatreel_decode_fun_t(const void *bytes, size_t len);
+
+typedef struct aatreel_options_s
+{
+    aatreel_sync_t sync;
+    uint32_t sync_ms;           /* For aatreel_sync_interval */
+    /* Commit when this much is buffered; 0 for 64 kbytes */
+    size_t group_bytes;
+    /* Snapshot on a commit when the log is this large; 0 for never */
+    size_t snapshot_bytes;
+    /* If NULL, the values are not logged, and recovered as NULL */
+    aatreel_encode_fun_t *encode;
+    aatreel_decode_fun_t *decode;
+    /* If not NULL, called on the values replaced or deleted when
+       replaying the log */
+    void (*freefun)(void *);
+} aatreel_options_t;
+
+/* Recover the tree 't', which must be empty, from the snapshot and log
+   in the directory 'dir', creating it if needed, and then log all the
+   changes to it. A log that ends with an incomplete record is cut
+   there. 'opts' is copied; NULL means all defaults.
+   Returns NULL, with errno set, on failure, in which case the tree
+   might be partially recovered. Trees with binary keys are not
+   supported (EINVAL). */
+aatreel_t *aatreel_open(aatree_t *t, const char *dir,
+                        const aatreel_options_t *opts);
+
+/* Write the changes made since the last commit, and sync the file if
+   the policy says so. This might also write a snapshot, and always does
+   if a change could not be buffered, for lack of memory. If a write
+   fails, the changes are kept for the next commit.
+   Returns false, with errno set, on failure. */
+bool aatreel_commit(aatreel_t *l);
+
+/* Commit, and write a snapshot of the tree, which replaces the log.
+   The snapshot and the emptied log are synced whatever the policy.
+   Returns false, with errno set, on failure. */
+bool aatreel_snapshot(aatreel_t *l);
+
+/* Commit, and stop logging.
+   Returns false, with errno set, if the commit failed. */
+bool aatreel_close(aatreel_t *l);
@@ -5,20 +5,604 @@
 **
 */
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "aatreem.h"
 
 #define UNUSED(x) ((void)(x))
 
+typedef struct ttl_node_s ttl_node_t;
+
 typedef struct aatreem_node_s
 {
     aatree_node_t n;
     char *key;
     void *value;
+    ttl_node_t *ttl;            /* The expiry time, NULL for never */
+    /* The CLOCK list, when there's a capacity */
+    struct aatreem_node_s *prev, *next;
+    bool ref;                   /* Found since the hand last passed */
 } aatreem_node_t;
 
+/* The expiry times are in a tree of their own, in time order, with the
+   sequence number making each unique. */
+typedef struct ttl_key_s
+{
+    uint64_t expires;
+    uint64_t seq;
+} ttl_key_t;
+
+struct ttl_node_s
+{
+    aatree_node_t n;
+    ttl_key_t key;
+    aatreem_node_t *node;       /* Which points back to this */
+};
+
+/* A slot in the hash index, empty when node is NULL */
+typedef struct index_slot_s
+{
+    uint64_t hash;
+    aatreem_node_t *node;
+} index_slot_t;
+
+/* A change in the feed, followed by the key and the new key, each with
+   its '\0'. A record never wraps around the end of the ring; if there
+   isn't room for one there, it's skipped, marked by a padding record
+   if there's room for the header. */
+typedef struct feed_rec_s
+{
+    uint64_t seq;
+    void *value;
+    uint32_t op;                /* An aatreem_change_op_t, or FEED_PAD */
+    uint32_t keylen, newkeylen;
+} feed_rec_t;
+
+#define FEED_PAD 0xffffffff
+#define FEED_MIN 256
+#define FEED_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* Single producer, the tree, and single consumer. 'head' and 'tail'
+   count the bytes written and consumed, and are apart to not share a
+   cache line. */
+struct aatreem_feed_s
+{
+    char *ring;
+    size_t mask;                /* Size of the ring - 1 */
+    _Atomic uint64_t lost;
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+};
+
+/* Allocated in front of the tree by aatreem_create(). After compaction,
+   the nodes and keys are in the arena, and it's freed when the last of
+   them is released. Any older arena is emptied by the compaction, so
+   there is only one. */
+typedef union aatreem_head_u
+{
+    struct
+    {
+        char *arena;
+        char *arena_end;
+        size_t arena_live;      /* Nodes and keys left in the arena */
+        void (*freefun)(void *); /* For the values, when destroying */
+        /* The hash index, with linear probing and at most half full */
+        index_slot_t *index;
+        size_t index_mask;      /* Number of slots - 1 */
+        size_t index_count;
+        bool replacing;         /* Don't follow the swap in the index */
+        /* The expiry times, and the time of the latest aatreem_expire() */
+        aatree_t ttl;
+        uint64_t ttl_seq;
+        uint64_t now;
+        aatreem_node_t *target; /* For remove_exact() */
+        /* All the nodes in a circular list, when there's a capacity */
+        bool capacity;
+        aatreem_node_t *hand;   /* The next to consider evicting */
+        size_t max_entries, max_bytes;
+        aatreem_evict_fun_t *evict;
+        aatreem_capacity_stats_t stats;
+        uint64_t seq;           /* Of the latest change */
+        aatreem_feed_t *feed;   /* The change feed, if any */
+        aatreem_change_fun_t *hook;
+        void *hook_arg;
+        /* The keys are aatreem_bkey_t followed by the bytes */
+        bool binary;
+    } h;
+    max_align_t align;
+} aatreem_head_t;
+
+static inline aatreem_head_t *
+head(aatree_t *t)
+{
+    return (aatreem_head_t *)t - 1;
+}
+
+static inline aatree_t *
+tree(aatreem_head_t *h)
+{
+    return (aatree_t *)(h + 1);
+}
+
+/* The bytes of a key, in a node or to look up, and their number */
+static inline const char *
+key_bytes(aatreem_head_t *h, const void *key, size_t *lenp)
+{
+    if (h->h.binary)
+    {
+        const aatreem_bkey_t *b = key;
+
+        *lenp = b->len;
+        return b->data;
+    }
+    *lenp = strlen(key);
+    return key;
+}
+
+/* Whether the key to look up is the one in the node */
+static inline bool
+key_equal(aatreem_head_t *h, const void *keyp, const char *key)
+{
+    if (h->h.binary)
+    {
+        const aatreem_bkey_t *a = keyp;
+        const aatreem_bkey_t *b = (const aatreem_bkey_t *)key;
+
+        return (a->len == b->len &&
+                (a->len == 0 || memcmp(a->data, b->data, a->len) == 0));
+    }
+    return (strcmp(keyp, key) == 0);
+}
+
+/* The memory taken by a key in a node; binary keys are kept aligned */
+static inline size_t
+key_size(aatreem_head_t *h, const char *key)
+{
+    size_t len;
+
+    (void)key_bytes(h, key, &len);
+    if (! h->h.binary)
+        return len + 1;
+    len += sizeof(aatreem_bkey_t) + 1;
+    return (len + _Alignof(aatreem_bkey_t) - 1) &
+        ~(_Alignof(aatreem_bkey_t) - 1);
+}
+
+/* Make a key for a node at 'p', with room for key_size() bytes. The
+   bytes are followed by a '\0' in either case. */
+static char *
+key_copy_to(aatreem_head_t *h, char *p, const char *bytes, size_t len)
+{
+    char *s = p;
+
+    if (h->h.binary)
+    {
+        aatreem_bkey_t *b = (aatreem_bkey_t *)p;
+
+        s = p + sizeof(aatreem_bkey_t);
+        b->len = len;
+        b->data = s;
+    }
+    memcpy(s, bytes, len);
+    s[len] = '\0';
+    return p;
+}
+
+static char *
+key_copy(aatreem_head_t *h, const char *bytes, size_t len)
+{
+    size_t size = (h->h.binary ? sizeof(aatreem_bkey_t) : 0) + len + 1;
+    char *p = malloc(size);
+
+    return (p == NULL ? NULL : key_copy_to(h, p, bytes, len));
+}
+
+/* A new node with a copy of the key, not yet in the tree */
+static aatreem_node_t *
+node_new(aatreem_head_t *h, const void *keyp, void *value)
+{
+    aatreem_node_t *n;
+    const char *bytes;
+    size_t len;
+
+    if ((n = malloc(sizeof(aatreem_node_t))) == NULL)
+        return NULL;
+    bytes = key_bytes(h, keyp, &len);
+    if ((n->key = key_copy(h, bytes, len)) == NULL)
+    {
+        free(n);
+        return NULL;
+    }
+    aatree_init_node(&n->n);
+    n->value = value;
+    n->ttl = NULL;
+    return n;
+}
+
+/* Free a node or key, which might be in the arena */
+static void
+release(aatree_t *t, void *p)
+{
+    aatreem_head_t *h = head(t);
+
+    if (h->h.arena == NULL ||
+        (char *)p < h->h.arena || (char *)p >= h->h.arena_end)
+        free(p);
+    else if (--h->h.arena_live == 0)
+    {
+        free(h->h.arena);
+        h->h.arena = h->h.arena_end = NULL;
+    }
+}
+
+/* FNV-1a */
+static uint64_t
+aatreem_hash(aatree_t *t, void *keyp)
+{
+    uint64_t h = 0xcbf29ce484222325;
+
+    if (head(t)->h.binary)
+    {
+        const aatreem_bkey_t *b = keyp;
+        const unsigned char *p = b->data;
+
+        for (size_t i = 0 ; i < b->len ; i++)
+            h = (h ^ p[i]) * 0x100000001b3;
+        return h;
+    }
+    for (const unsigned char *p = keyp ; *p != '\0' ; p++)
+        h = (h ^ *p) * 0x100000001b3;
+    return h;
+}
+
+static void
+index_add(aatreem_head_t *h, uint64_t hash, aatreem_node_t *n)
+{
+    size_t i = hash & h->h.index_mask;
+
+    while (h->h.index[i].node != NULL)
+        i = (i + 1) & h->h.index_mask;
+    h->h.index[i].hash = hash;
+    h->h.index[i].node = n;
+    h->h.index_count += 1;
+}
+
+/* Make room for one more node.
+   Returns false if memory could not be allocated. */
+static bool
+index_reserve(aatreem_head_t *h)
+{
+    index_slot_t *old = h->h.index;
+    size_t size = h->h.index_mask + 1;
+
+    if (old == NULL || 2 * (h->h.index_count + 1) <= size)
+        return true;
+    if ((h->h.index = calloc(2 * size, sizeof(index_slot_t))) == NULL)
+    {
+        h->h.index = old;
+        return false;
+    }
+    h->h.index_mask = 2 * size - 1;
+    h->h.index_count = 0;
+    for (size_t i = 0 ; i < size ; i++)
+        if (old[i].node != NULL)
+            index_add(h, old[i].hash, old[i].node);
+    free(old);
+    return true;
+}
+
+/* Returns the slot of the node, which must be in the index */
+static size_t
+index_slot(aatreem_head_t *h, aatreem_node_t *n)
+{
+    size_t i = aatreem_hash(tree(h), n->key) & h->h.index_mask;
+
+    while (h->h.index[i].node != n)
+        i = (i + 1) & h->h.index_mask;
+    return i;
+}
+
+/* Shift back any later slots in the run that would no longer be found,
+   instead of leaving a tombstone */
+static void
+index_remove(aatreem_head_t *h, aatreem_node_t *n)
+{
+    size_t mask = h->h.index_mask;
+    size_t i = index_slot(h, n);
+
+    for (size_t j = (i + 1) & mask ;
+         h->h.index[j].node != NULL ;
+         j = (j + 1) & mask)
+    {
+        size_t home = h->h.index[j].hash & mask;
+
+        /* Stays if home is cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        h->h.index[i] = h->h.index[j];
+        i = j;
+    }
+    h->h.index[i].node = NULL;
+    h->h.index_count -= 1;
+}
+
+static int
+ttl_compare(aatree_t *t, void *keyp, aatree_node_t *n)
+{
+    UNUSED(t);
+    ttl_key_t *a = keyp;
+    ttl_key_t *b = &((ttl_node_t *)n)->key;
+
+    if (a->expires != b->expires)
+        return (a->expires < b->expires ? -1 : 1);
+    return (a->seq < b->seq ? -1 : a->seq > b->seq);
+}
+
+/* The nodes in the tree follow their times */
+static void
+ttl_swap(aatree_t *t, aatree_node_t *a, aatree_node_t *b)
+{
+    UNUSED(t);
+    ttl_node_t *at = (ttl_node_t *)a;
+    ttl_node_t *bt = (ttl_node_t *)b;
+    ttl_key_t tmpkey = at->key;
+    aatreem_node_t *tmpnode = at->node;
+
+    at->key = bt->key;
+    at->node = bt->node;
+    bt->key = tmpkey;
+    bt->node = tmpnode;
+    at->node->ttl = at;
+    bt->node->ttl = bt;
+}
+
+static void *
+ttl_key(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    return &((ttl_node_t *)n)->key;
+}
+
+static void
+ttl_release(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    free(n);
+}
+
+/* Drop the node's expiry time, if any */
+static void
+ttl_forget(aatreem_head_t *h, aatreem_node_t *n)
+{
+    if (n->ttl != NULL)
+    {
+        ttl_key_t key = n->ttl->key;
+
+        /* Which may move n's time to another node before it's removed */
+        free(aatree_remove_node(&h->h.ttl, &key, NULL));
+        n->ttl = NULL;
+    }
+}
+
+/* The memory taken by a node and its key */
+static inline size_t
+clock_bytes(aatreem_head_t *h, aatreem_node_t *n)
+{
+    return sizeof(aatreem_node_t) + key_size(h, n->key);
+}
+
+/* Link the node in just behind the hand, so that it's the last one
+   considered */
+static void
+clock_link(aatreem_head_t *h, aatreem_node_t *n)
+{
+    aatreem_node_t *hand = h->h.hand;
+
+    if (hand == NULL)
+        h->h.hand = n->prev = n->next = n;
+    else
+    {
+        n->next = hand;
+        n->prev = hand->prev;
+        hand->prev->next = n;
+        hand->prev = n;
+    }
+    n->ref = false;
+    h->h.stats.entries += 1;
+    h->h.stats.bytes += clock_bytes(h, n);
+}
+
+static void
+clock_unlink(aatreem_head_t *h, aatreem_node_t *n)
+{
+    if (n->next == n)
+        h->h.hand = NULL;
+    else
+    {
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+        if (h->h.hand == n)
+            h->h.hand = n->next;
+    }
+    h->h.stats.entries -= 1;
+    h->h.stats.bytes -= clock_bytes(h, n);
+}
+
+/* Put 'to' where 'from' is in the list, taking its place */
+static void
+clock_move(aatreem_head_t *h, aatreem_node_t *from, aatreem_node_t *to)
+{
+    if (from->next == from)
+        to->prev = to->next = to;
+    else
+    {
+        to->prev = from->prev;
+        to->next = from->next;
+        to->prev->next = to;
+        to->next->prev = to;
+    }
+    to->ref = from->ref;
+    if (h->h.hand == from)
+        h->h.hand = to;
+}
+
+/* Exchange the places of two nodes, adjacent or not, through a
+   temporary one */
+static void
+clock_swap(aatreem_head_t *h, aatreem_node_t *a, aatreem_node_t *b)
+{
+    aatreem_node_t tmp;
+
+    clock_move(h, a, &tmp);
+    clock_move(h, b, a);
+    clock_move(h, &tmp, b);
+}
+
+static inline size_t
+feed_rec_size(size_t keylen, size_t newkeylen)
+{
+    return FEED_ALIGN(sizeof(feed_rec_t) + keylen + 1 + newkeylen + 1);
+}
+
+/* Add the change to the feed, unless it's full */
+static void
+feed_put(aatreem_feed_t *f, const aatreem_change_t *c)
+{
+    size_t size = f->mask + 1;
+    size_t keylen = c->keylen;
+    size_t newkeylen = c->newkeylen;
+    size_t need = feed_rec_size(keylen, newkeylen);
+    uint64_t head = atomic_load_explicit(&f->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&f->tail, memory_order_acquire);
+    size_t pos = head & f->mask;
+    size_t skip = (size - pos < need ? size - pos : 0);
+    feed_rec_t *r;
+
+    if (skip + need > size - (head - tail))
+    {
+        atomic_fetch_add_explicit(&f->lost, 1, memory_order_relaxed);
+        return;
+    }
+    if (skip > 0)
+    {
+        if (skip >= sizeof(feed_rec_t))
+            ((feed_rec_t *)(f->ring + pos))->op = FEED_PAD;
+        head += skip;
+        pos = 0;
+    }
+    r = (feed_rec_t *)(f->ring + pos);
+    r->seq = c->seq;
+    r->value = c->value;
+    r->op = c->op;
+    r->keylen = keylen;
+    r->newkeylen = newkeylen;
+    memcpy((char *)(r + 1), c->key, keylen);
+    ((char *)(r + 1))[keylen] = '\0';
+    if (c->newkey != NULL)
+    {
+        memcpy((char *)(r + 1) + keylen + 1, c->newkey, newkeylen);
+        ((char *)(r + 1))[keylen + 1 + newkeylen] = '\0';
+    }
+    atomic_store_explicit(&f->head, head + need, memory_order_release);
+}
+
+/* Number the change, and pass it on to the feed and the hook, if any.
+   The keys are as in the nodes, or to look up. */
+static void
+changed(aatreem_head_t *h, aatreem_change_op_t op, const void *key,
+        const void *newkey, void *value)
+{
+    aatreem_change_t c;
+
+    h->h.seq += 1;
+    if (h->h.feed == NULL && h->h.hook == NULL)
+        return;
+    c.seq = h->h.seq;
+    c.op = op;
+    c.key = key_bytes(h, key, &c.keylen);
+    c.newkey = NULL;
+    c.newkeylen = 0;
+    if (newkey != NULL)
+        c.newkey = key_bytes(h, newkey, &c.newkeylen);
+    c.value = value;
+    if (h->h.feed != NULL)
+        feed_put(h->h.feed, &c);
+    if (h->h.hook != NULL)
+        h->h.hook(tree(h), &c, h->h.hook_arg);
+}
+
+/* Take the node out of the index, the expiry times and the list */
+static void
+forget(aatreem_head_t *h, aatreem_node_t *n)
+{
+    changed(h, aatreem_change_delete, n->key, NULL, NULL);
+    if (h->h.index != NULL)
+        index_remove(h, n);
+    ttl_forget(h, n);
+    if (h->h.capacity)
+        clock_unlink(h, n);
+}
+
+static bool
+is_target(aatree_t *t, aatree_node_t *n)
+{
+    return (n == &head(t)->h.target->n);
+}
+
+/* Remove the node itself, not just one with the same key */
+static void
+remove_exact(aatree_t *t, aatreem_node_t *n, void (*freefun)(void *))
+{
+    aatreem_head_t *h = head(t);
+    aatreem_node_t *node;
+
+    h->h.target = n;
+    node = (aatreem_node_t *)aatree_remove_node(t, n->key, is_target);
+    h->h.target = NULL;
+    if (freefun != NULL)
+        freefun(node->value);
+    forget(h, node);
+    release(t, node->key);
+    release(t, node);
+}
+
+static bool
+over_capacity(aatreem_head_t *h)
+{
+    return ((h->h.max_entries > 0 &&
+             h->h.stats.entries > h->h.max_entries) ||
+            (h->h.max_bytes > 0 && h->h.stats.bytes > h->h.max_bytes));
+}
+
+/* Evict nodes until within the capacity, but never the last one, nor
+   'keep', the node just inserted. The hand clears the referenced nodes
+   it passes, and stops at the first that isn't. */
+static void
+clock_evict(aatree_t *t, aatreem_node_t *keep)
+{
+    aatreem_head_t *h = head(t);
+
+    while (h->h.capacity && over_capacity(h) && h->h.stats.entries > 1)
+    {
+        aatreem_node_t *n = h->h.hand;
+
+        while (n->ref || n == keep)
+        {
+            n->ref = false;
+            n = n->next;
+        }
+        h->h.hand = n;
+        if (h->h.evict != NULL)
+            h->h.evict(t, n->key, n->value);
+        remove_exact(t, n, NULL);
+        h->h.stats.evictions += 1;
+    }
+}
+
 char *
 aatree_key(aatree_node_t *t)
 {
@@ -36,138 +620,231 @@ aatree_value(aatree_node_t *t)
 aatree_node_t *
 aatree_left(aatree_node_t *t)
 {
-    aatreem_node_t *n = (aatreem_node_t *)t;
-    return n->n.left;
+    return aatree_get_left(t);
 }
 
 aatree_node_t *
 aatree_right(aatree_node_t *t)
 {
-    aatreem_node_t *n = (aatreem_node_t *)t;
-    return n->n.right;
+    return aatree_get_right(t);
 }
 
 aatree_level_t
 aatree_level(aatree_node_t *t)
 {
-    aatreem_node_t *n = (aatreem_node_t *)t;
-    return n->n.level;
+    return aatree_get_level(t);
 }
 
 
-bool
-aatreem_insert(aatree_t *t, const char *key, void *value)
+static bool
+insert(aatree_t *t, const void *keyp, void *value)
 {
-    aatreem_node_t *n = malloc(sizeof(aatreem_node_t));
-    char *keycopy;
+    aatreem_node_t *n;
 
-    if (n == NULL)
+    if (! index_reserve(head(t)))
         return false;
-    if ((keycopy = strdup(key)) == NULL)
-    {
-        free(n);
+    if ((n = node_new(head(t), keyp, value)) == NULL)
         return false;
-    }
-    aatree_init_node(&n->n);
-    n->key = keycopy;
-    n->value = value;
     aatree_insert_node(t, n->key, &n->n);
+    if (head(t)->h.index != NULL)
+        index_add(head(t), aatreem_hash(t, n->key), n);
+    changed(head(t), aatreem_change_insert, n->key, NULL, value);
+    if (head(t)->h.capacity)
+    {
+        clock_link(head(t), n);
+        clock_evict(t, n);
+    }
     return true;
 }
 
+bool
+aatreem_insert(aatree_t *t, const char *key, void *value)
+{
+    return insert(t, key, value);
+}
+
+bool
+aatreem_binsert(aatree_t *t, const void *key, size_t len, void *value)
+{
+    aatreem_bkey_t k = { len, key };
+
+    return insert(t, &k, value);
+}
+
 bool
 aatreem_insert_unique(aatree_t *t, const char *key, void *value,
                       void **xistsp)
 {
-    aatreem_node_t *n = malloc(sizeof(aatreem_node_t));
-    char *keycopy;
+    aatreem_node_t *n;
 
-    if (n == NULL)
+    if (! index_reserve(head(t)))
         return false;
-    if ((keycopy = strdup(key)) == NULL)
-    {
-        free(n);
+    if ((n = node_new(head(t), key, value)) == NULL)
         return false;
-    }
-    aatree_init_node(&n->n);
-    n->key = keycopy;
-    n->value = value;
     aatreem_node_t *xists =
         (aatreem_node_t *)aatree_insert_unique_node(t, n->key, &n->n);
     if (xistsp != NULL)
         *xistsp = (xists != NULL ? xists->value : NULL);
     if (xists != NULL)
     {
-        free(keycopy);
+        free(n->key);
         free(n);
         return false;
     }
+    if (head(t)->h.index != NULL)
+        index_add(head(t), aatreem_hash(t, n->key), n);
+    changed(head(t), aatreem_change_insert, n->key, NULL, value);
+    if (head(t)->h.capacity)
+    {
+        clock_link(head(t), n);
+        clock_evict(t, n);
+    }
     return true;
 }
 
-bool
-aatreem_replace(aatree_t *t, const char *key, void *value,
-                void **replacedp)
+static bool
+replace(aatree_t *t, const void *keyp, void *value, void **replacedp)
 {
-    aatreem_node_t *n = malloc(sizeof(aatreem_node_t));
-    char *keycopy;
+    aatreem_head_t *h = head(t);
+    aatreem_node_t *n;
 
-    if (n == NULL)
+    if (! index_reserve(h))
         return false;
-    if ((keycopy = strdup(key)) == NULL)
-    {
-        free(n);
+    if ((n = node_new(h, keyp, value)) == NULL)
         return false;
-    }
-    aatree_init_node(&n->n);
-    n->key = keycopy;
-    n->value = value;
+    /* The node in the tree keeps its key, so its slot stays valid */
+    h->h.replacing = true;
     aatreem_node_t *replaced =
         (aatreem_node_t *)aatree_replace_node(t, n->key, &n->n);
+    h->h.replacing = false;
     if (replacedp != NULL)
         *replacedp = (replaced != NULL ? replaced->value : NULL);
+    changed(h, aatreem_change_replace, keyp, NULL, value);
     if (replaced != NULL)
     {
-        free(replaced->key);
+        release(t, replaced->key);
         free(n);
+        return true;
+    }
+    if (h->h.index != NULL)
+        index_add(h, aatreem_hash(t, n->key), n);
+    if (h->h.capacity)
+    {
+        clock_link(h, n);
+        clock_evict(t, n);
     }
     return true;
 }
 
 bool
-aatreem_delete(aatree_t *t, const char *key, aatree_condition_fun_t *cond,
-               void **deletedp)
+aatreem_replace(aatree_t *t, const char *key, void *value,
+                void **replacedp)
+{
+    return replace(t, key, value, replacedp);
+}
+
+bool
+aatreem_breplace(aatree_t *t, const void *key, size_t len, void *value,
+                 void **replacedp)
+{
+    aatreem_bkey_t k = { len, key };
+
+    return replace(t, &k, value, replacedp);
+}
+
+static bool
+delete(aatree_t *t, const void *keyp, aatree_condition_fun_t *cond,
+       void **deletedp)
 {
-    aatreem_node_t *node = (aatreem_node_t *)aatree_remove_node(t, (void *)key, cond);
+    aatreem_node_t *node =
+        (aatreem_node_t *)aatree_remove_node(t, (void *)keyp, cond);
 
     if (deletedp != NULL)
         *deletedp = (node != NULL ? node->value : NULL);
     if (node == NULL)
         return false;
-    free(node->key);
-    free(node);
+    forget(head(t), node);
+    release(t, node->key);
+    release(t, node);
     return true;
 }
 
-static int
-aatreem_compare(aatree_t *t, void *keyp, aatree_node_t *b)
+bool
+aatreem_delete(aatree_t *t, const char *key, aatree_condition_fun_t *cond,
+               void **deletedp)
 {
-    UNUSED(t);
-    char *key = keyp;
-    aatreem_node_t *bm = (aatreem_node_t *)b;
+    return delete(t, key, cond, deletedp);
+}
+
+bool
+aatreem_bdelete(aatree_t *t, const void *key, size_t len,
+                aatree_condition_fun_t *cond, void **deletedp)
+{
+    aatreem_bkey_t k = { len, key };
+
+    return delete(t, &k, cond, deletedp);
+}
+
+static int
+aatreem_compare(aatree_t *t, void *keyp, aatree_node_t *b)
+{
+    UNUSED(t);
+    char *key = keyp;
+    aatreem_node_t *bm = (aatreem_node_t *)b;
 
     return strcmp(key, bm->key);
 }
 
+/* The common bytes with memcmp(), which compares a word or a vector at
+   a time, then the shorter key first; the lengths are kept, so there's
+   no scan for the end. */
+static int
+aatreem_bcompare(aatree_t *t, void *keyp, aatree_node_t *b)
+{
+    UNUSED(t);
+    const aatreem_bkey_t *ak = keyp;
+    const aatreem_bkey_t *bk = (const aatreem_bkey_t *)
+        ((aatreem_node_t *)b)->key;
+    size_t len = (ak->len < bk->len ? ak->len : bk->len);
+    int c = (len == 0 ? 0 : memcmp(ak->data, bk->data, len));
+
+    if (c != 0)
+        return c;
+    return (ak->len > bk->len) - (ak->len < bk->len);
+}
+
+/* When removing, the key moves to the other node, and so do its slot
+   in the index, its expiry time and its place in the list. When
+   replacing, the node in the tree keeps them. */
 static void
 aatreem_swap(aatree_t *t, aatree_node_t *a, aatree_node_t *b)
 {
-    UNUSED(t);
+    aatreem_head_t *h = head(t);
     aatreem_node_t *am = (aatreem_node_t *)a;
     aatreem_node_t *bm = (aatreem_node_t *)b;
     char *tmpkey;
     void *tmpval;
 
+    if (h->h.index != NULL && ! h->h.replacing)
+    {
+        size_t ai = index_slot(h, am), bi = index_slot(h, bm);
+
+        h->h.index[ai].node = bm;
+        h->h.index[bi].node = am;
+    }
+    if (! h->h.replacing && h->h.capacity)
+        clock_swap(h, am, bm);
+    if (! h->h.replacing)
+    {
+        ttl_node_t *tmpttl = am->ttl;
+
+        am->ttl = bm->ttl;
+        bm->ttl = tmpttl;
+        if (am->ttl != NULL)
+            am->ttl->node = am;
+        if (bm->ttl != NULL)
+            bm->ttl->node = bm;
+    }
     tmpkey = am->key;
     am->key = bm->key;
     bm->key = tmpkey;
@@ -176,65 +853,750 @@ aatreem_swap(aatree_t *t, aatree_node_t *a, aatree_node_t *b)
     bm->value = tmpval;
 }
 
+static void *
+aatreem_key(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    return ((aatreem_node_t *)n)->key;
+}
+
 aatree_t *
 aatreem_create(size_t size)
 {
+    aatreem_head_t *h;
     aatree_t *t;
 
     if (size < sizeof(aatree_t))
         size = sizeof(aatree_t);
-    t = malloc(size);
-    memset(t, 0, size);
+    h = malloc(sizeof(aatreem_head_t) + size);
+    memset(h, 0, sizeof(aatreem_head_t) + size);
+    t = (aatree_t *)(h + 1);
     t->compare = aatreem_compare;
     t->swap = aatreem_swap;
+    t->key = aatreem_key;
+    h->h.ttl.compare = ttl_compare;
+    h->h.ttl.swap = ttl_swap;
+    h->h.ttl.key = ttl_key;
     return t;
 }
 
-static void
-aatreem_destroy_rec(aatree_node_t *t, void (*freefun)(void *))
+aatree_t *
+aatreem_create_binary(size_t size)
 {
-    while (t != NULL)
-    {
-        aatree_node_t *left = t->left;
-        aatree_node_t *right = t->right;
-        aatreem_node_t *n = (aatreem_node_t *)t;
+    aatree_t *t = aatreem_create(size);
 
-        free(n->key);
-        if (freefun != NULL)
-            freefun(n->value);
-        free(n);
-        aatreem_destroy_rec(left, freefun);
-        t = right;
+    if (t != NULL)
+    {
+        head(t)->h.binary = true;
+        t->compare = aatreem_bcompare;
     }
+    return t;
+}
+
+bool
+aatreem_is_binary(aatree_t *t)
+{
+    return head(t)->h.binary;
+}
+
+const aatreem_bkey_t *
+aatreem_bkey(aatree_node_t *n)
+{
+    return (const aatreem_bkey_t *)((aatreem_node_t *)n)->key;
+}
+
+static void
+aatreem_release(aatree_t *t, aatree_node_t *x)
+{
+    aatreem_node_t *n = (aatreem_node_t *)x;
+
+    release(t, n->key);
+    if (head(t)->h.freefun != NULL)
+        head(t)->h.freefun(n->value);
+    release(t, n);
 }
 
 void
 aatreem_destroy(aatree_t *t, void (*freefun)(void *))
 {
-    aatreem_destroy_rec(t->root, freefun);
-    free(t);
+    head(t)->h.freefun = freefun;
+    aatree_clear(t, aatreem_release);
+    aatree_clear(&head(t)->h.ttl, ttl_release);
+    aatree_cache_detach(t);
+    aatree_bloom_detach(t);
+    free(head(t)->h.index);
+    aatreem_feed_detach(t);
+    free(head(t));
+}
+
+typedef struct destroy_task_s
+{
+    aatree_t *t;
+    void (*freefun)(void *);
+} destroy_task_t;
+
+static void *
+destroy_task(void *arg)
+{
+    destroy_task_t *dt = arg;
+
+    aatreem_destroy(dt->t, dt->freefun);
+    free(dt);
+    return NULL;
 }
 
 bool
-aatreem_rename(aatree_t *t, const char *oldkey, const char *newkey)
+aatreem_destroy_background(aatree_t *t, void (*freefun)(void *))
 {
-    aatreem_node_t *n = (aatreem_node_t *)t->root;
+    destroy_task_t *dt = malloc(sizeof(destroy_task_t));
+    pthread_attr_t attr;
+    pthread_t tid;
+    bool started = false;
 
-    while (n != NULL)
+    if (dt == NULL)
+    {
+        aatreem_destroy(t, freefun);
+        return false;
+    }
+    dt->t = t;
+    dt->freefun = freefun;
+    if (pthread_attr_init(&attr) == 0)
+    {
+        if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0)
+            started = (pthread_create(&tid, &attr, destroy_task, dt) == 0);
+        pthread_attr_destroy(&attr);
+    }
+    if (! started)
+        (void)destroy_task(dt);
+    return started;
+}
+
+bool
+aatreem_cache_attach(aatree_t *t, size_t entries)
+{
+    return aatree_cache_attach(t, entries, aatreem_hash);
+}
+
+bool
+aatreem_bloom_attach(aatree_t *t, size_t keys)
+{
+    return aatree_bloom_attach(t, keys, aatreem_hash);
+}
+
+/* All or nothing: the new keys are copied before any node is renamed,
+   since the single change record renames every node with the key. */
+static bool
+rename_key(aatree_t *t, const void *oldkey, const void *newkey)
+{
+    aatreem_head_t *h = head(t);
+    aatree_iter_t iter;
+    char **keycopy;
+    size_t n = 0, i;
+    const char *bytes;
+    size_t len;
+
+    if (! aatree_iter_key_init(t, (void *)oldkey, &iter))
+        return false;
+    while (aatree_iter_key_next(&iter) != NULL)
+        n += 1;
+    if (n == 0)
+        return true;
+    if ((keycopy = malloc(n * sizeof(char *))) == NULL)
+        return false;
+    bytes = key_bytes(h, newkey, &len);
+    for (i = 0 ; i < n ; i++)
+        if ((keycopy[i] = key_copy(h, bytes, len)) == NULL)
+        {
+            while (i > 0)
+                free(keycopy[--i]);
+            free(keycopy);
+            return false;
+        }
+    for (i = 0 ; i < n ; i++)
     {
-        char *keycopy;
         aatreem_node_t *deleted =
             (aatreem_node_t *)aatree_remove_node(t, (void *)oldkey, NULL);
 
-        if (deleted == NULL)
-            break;              /* Done */
-        deleted->n.left = deleted->n.right = NULL;
-        keycopy = strdup(newkey);
-        if (keycopy == NULL)
+        if (h->h.index != NULL)
+            index_remove(h, deleted);
+        aatree_init_node(&deleted->n);
+        if (h->h.capacity)
+            h->h.stats.bytes +=
+                key_size(h, keycopy[i]) - key_size(h, deleted->key);
+        release(t, deleted->key);
+        deleted->key = keycopy[i];
+        aatree_insert_node(t, keycopy[i], (aatree_node_t *)deleted);
+        if (h->h.index != NULL)
+            index_add(h, aatreem_hash(t, keycopy[i]), deleted);
+    }
+    free(keycopy);
+    changed(h, aatreem_change_rename, oldkey, newkey, NULL);
+    clock_evict(t, NULL);
+    return true;
+}
+
+bool
+aatreem_rename(aatree_t *t, const char *oldkey, const char *newkey)
+{
+    return rename_key(t, oldkey, newkey);
+}
+
+bool
+aatreem_brename(aatree_t *t, const void *oldkey, size_t oldlen,
+                const void *newkey, size_t newlen)
+{
+    aatreem_bkey_t ok = { oldlen, oldkey };
+    aatreem_bkey_t nk = { newlen, newkey };
+
+    return rename_key(t, &ok, &nk);
+}
+
+/* Count the nodes, and sum up the key sizes */
+static size_t
+count(aatreem_head_t *h, aatree_node_t *t, size_t *keysizep)
+{
+    size_t n = 0;
+
+    while (t != NULL)
+    {
+        n += 1 + count(h, aatree_get_left(t), keysizep);
+        *keysizep += key_size(h, ((aatreem_node_t *)t)->key);
+        t = aatree_get_right(t);
+    }
+    return n;
+}
+
+static size_t
+collect(aatree_node_t *t, aatree_node_t **nodes, size_t i)
+{
+    while (t != NULL)
+    {
+        i = collect(aatree_get_left(t), nodes, i);
+        nodes[i++] = t;
+        t = aatree_get_right(t);
+    }
+    return i;
+}
+
+typedef struct relocate_s
+{
+    aatree_t *t;
+    aatree_node_t **nodes;      /* In key order */
+    aatreem_node_t *next;       /* The next free node in the arena */
+    char *keys;                 /* The next free key in the arena */
+} relocate_t;
+
+/* Move the nodes at 'depth' in the tree that aatree_build_sorted() will
+   make of nodes[lo..lo+n-1] to the arena, left to right. */
+static void
+relocate_depth(relocate_t *r, size_t lo, size_t n, uint32_t depth)
+{
+    if (n == 0)
+        return;
+
+    size_t mid = (n-1) / 2;
+
+    if (depth > 0)
+    {
+        relocate_depth(r, lo, mid, depth-1);
+        relocate_depth(r, lo+mid+1, n-mid-1, depth-1);
+        return;
+    }
+
+    aatreem_head_t *h = head(r->t);
+    aatreem_node_t *old = (aatreem_node_t *)r->nodes[lo+mid];
+    aatreem_node_t *new = r->next++;
+    size_t size = key_size(h, old->key);
+    const char *bytes;
+    size_t len;
+
+    bytes = key_bytes(h, old->key, &len);
+    aatree_init_node(&new->n);
+    new->key = key_copy_to(h, r->keys, bytes, len);
+    new->value = old->value;
+    if ((new->ttl = old->ttl) != NULL)
+        new->ttl->node = new;
+    if (h->h.capacity)
+        clock_move(h, old, new);
+    r->keys += size;
+    release(r->t, old->key);
+    release(r->t, old);
+    r->nodes[lo+mid] = &new->n;
+}
+
+bool
+aatreem_compact(aatree_t *t)
+{
+    aatreem_head_t *h = head(t);
+    size_t keysize = 0;
+    size_t n = count(h, t->root, &keysize);
+    aatree_node_t **nodes;
+    char *arena;
+    relocate_t r;
+
+    if (n == 0)
+        return true;
+    if ((nodes = malloc(n * sizeof(aatree_node_t *))) == NULL)
+        return false;
+    if ((arena = malloc(n * sizeof(aatreem_node_t) + keysize)) == NULL)
+    {
+        free(nodes);
+        return false;
+    }
+    (void)collect(t->root, nodes, 0);
+
+    r.t = t;
+    r.nodes = nodes;
+    r.next = (aatreem_node_t *)arena;
+    r.keys = arena + n * sizeof(aatreem_node_t);
+    /* Breadth first, so the top of the tree is in a few cache lines */
+    for (uint32_t depth = 0 ; r.next < (aatreem_node_t *)arena + n ; depth++)
+        relocate_depth(&r, 0, n, depth);
+    aatree_cache_clear(t);
+    t->root = NULL;
+    aatree_build_sorted(t, nodes, n);
+    if (h->h.index != NULL)
+    {
+        memset(h->h.index, 0, (h->h.index_mask + 1) * sizeof(index_slot_t));
+        h->h.index_count = 0;
+        for (size_t i = 0 ; i < n ; i++)
+            index_add(h, aatreem_hash(t, aatree_key(nodes[i])),
+                      (aatreem_node_t *)nodes[i]);
+    }
+    free(nodes);
+    h->h.arena = arena;
+    h->h.arena_end = r.keys;
+    h->h.arena_live = 2 * n;
+    return true;
+}
+
+bool
+aatreem_load_sorted(aatree_t *t, size_t n, const char *const keys[],
+                    void *const values[])
+{
+    aatreem_head_t *h = head(t);
+    size_t keysize = 0;
+    aatree_node_t **nodes;
+    aatreem_node_t *next;
+    char *arena, *k;
+
+    if (t->root != NULL || h->h.binary)
+        return false;
+    if (n == 0)
+        return true;
+    for (size_t i = 0 ; i < n ; i++)
+        keysize += strlen(keys[i]) + 1;
+    if ((nodes = malloc(n * sizeof(aatree_node_t *))) == NULL)
+        return false;
+    if ((arena = malloc(n * sizeof(aatreem_node_t) + keysize)) == NULL)
+    {
+        free(nodes);
+        return false;
+    }
+    /* The tree is empty, so the index can just be replaced */
+    if (h->h.index != NULL)
+    {
+        size_t size = 16;
+        index_slot_t *index;
+
+        while (size < 2 * n)
+            size *= 2;
+        if ((index = calloc(size, sizeof(index_slot_t))) == NULL)
+        {
+            free(arena);
+            free(nodes);
             return false;
-        free(deleted->key);
-        deleted->key = keycopy;
-        aatree_insert_node(t, keycopy, (aatree_node_t *)deleted);
+        }
+        free(h->h.index);
+        h->h.index = index;
+        h->h.index_mask = size - 1;
+        h->h.index_count = 0;
+    }
+    next = (aatreem_node_t *)arena;
+    k = arena + n * sizeof(aatreem_node_t);
+    for (size_t i = 0 ; i < n ; i++)
+    {
+        size_t len = strlen(keys[i]) + 1;
+
+        aatree_init_node(&next->n);
+        next->key = memcpy(k, keys[i], len);
+        next->value = values[i];
+        next->ttl = NULL;
+        nodes[i] = &next->n;
+        k += len;
+        next += 1;
+    }
+    aatree_cache_clear(t);
+    aatree_build_sorted(t, nodes, n);
+    for (size_t i = 0 ; i < n ; i++)
+    {
+        aatreem_node_t *node = (aatreem_node_t *)nodes[i];
+
+        if (h->h.index != NULL)
+            index_add(h, aatreem_hash(t, node->key), node);
+        if (h->h.capacity)
+            clock_link(h, node);
+    }
+    free(nodes);
+    h->h.arena = arena;
+    h->h.arena_end = k;
+    h->h.arena_live = 2 * n;
+    clock_evict(t, NULL);
+    return true;
+}
+
+static void
+add_all(aatreem_head_t *h, aatree_node_t *n)
+{
+    while (n != NULL)
+    {
+        add_all(h, aatree_get_left(n));
+        index_add(h, aatreem_hash(tree(h), aatree_key(n)),
+                  (aatreem_node_t *)n);
+        n = aatree_get_right(n);
+    }
+}
+
+bool
+aatreem_index_attach(aatree_t *t)
+{
+    aatreem_head_t *h = head(t);
+    size_t keysize = 0, size = 16, n;
+
+    if (h->h.index != NULL)
+        return true;
+    n = count(h, t->root, &keysize);
+    while (size < 2 * n)
+        size *= 2;
+    if ((h->h.index = calloc(size, sizeof(index_slot_t))) == NULL)
+        return false;
+    h->h.index_mask = size - 1;
+    h->h.index_count = 0;
+    add_all(h, t->root);
+    return true;
+}
+
+void
+aatreem_index_detach(aatree_t *t)
+{
+    free(head(t)->h.index);
+    head(t)->h.index = NULL;
+}
+
+/* Not expired as of the latest aatreem_expire() */
+static bool
+live(aatree_t *t, aatree_node_t *n)
+{
+    aatreem_node_t *m = (aatreem_node_t *)n;
+
+    return (m->ttl == NULL || m->ttl->key.expires > head(t)->h.now);
+}
+
+static aatree_node_t *
+find(aatree_t *t, const void *keyp)
+{
+    aatreem_head_t *h = head(t);
+
+    if (h->h.index == NULL)
+        return aatree_find_key(t, (void *)keyp,
+                               (h->h.ttl.root == NULL ? NULL : live));
+
+    uint64_t hash = aatreem_hash(t, (void *)keyp);
+
+    for (size_t i = hash & h->h.index_mask ;
+         h->h.index[i].node != NULL ;
+         i = (i + 1) & h->h.index_mask)
+        if (h->h.index[i].hash == hash &&
+            key_equal(h, keyp, h->h.index[i].node->key) &&
+            live(t, &h->h.index[i].node->n))
+            return &h->h.index[i].node->n;
+    return NULL;
+}
+
+/* Find, and count the hit or miss */
+static aatree_node_t *
+lookup(aatree_t *t, const void *keyp)
+{
+    aatreem_head_t *h = head(t);
+    aatree_node_t *n = find(t, keyp);
+
+    if (h->h.capacity)
+    {
+        if (n == NULL)
+            h->h.stats.misses += 1;
+        else
+        {
+            h->h.stats.hits += 1;
+            ((aatreem_node_t *)n)->ref = true;
+        }
+    }
+    return n;
+}
+
+aatree_node_t *
+aatreem_find(aatree_t *t, const char *key)
+{
+    return lookup(t, key);
+}
+
+aatree_node_t *
+aatreem_bfind(aatree_t *t, const void *key, size_t len)
+{
+    aatreem_bkey_t k = { len, key };
+
+    return lookup(t, &k);
+}
+
+bool
+aatreem_prefix_iter_init(aatree_t *t, const char *prefix,
+                         aatreem_prefix_iter_t *iter)
+{
+    iter->prefix = prefix;
+    iter->len = strlen(prefix);
+    if (head(t)->h.binary)
+        return false;
+    return aatree_iter_from_init(t, (void *)prefix, &iter->iter);
+}
+
+/* The keys with the prefix are all together, so the first one without
+   it ends the iteration */
+aatree_node_t *
+aatreem_prefix_iter_next(aatreem_prefix_iter_t *iter)
+{
+    aatree_t *t = iter->iter.base;
+    aatree_node_t *n;
+
+    while ((n = aatree_iter_next(&iter->iter)) != NULL &&
+           strncmp(iter->prefix, aatree_key(n), iter->len) == 0)
+        if (head(t)->h.ttl.root == NULL || live(t, n))
+            return n;
+    return NULL;
+}
+
+size_t
+aatreem_prefix_count(aatree_t *t, const char *prefix)
+{
+    aatreem_prefix_iter_t iter;
+    size_t n = 0;
+
+    if (! aatreem_prefix_iter_init(t, prefix, &iter))
+        return 0;
+    while (aatreem_prefix_iter_next(&iter) != NULL)
+        n += 1;
+    return n;
+}
+
+bool
+aatreem_set_expiry(aatree_t *t, aatree_node_t *x, uint64_t expires)
+{
+    aatreem_head_t *h = head(t);
+    aatreem_node_t *n = (aatreem_node_t *)x;
+    ttl_node_t *e = NULL;
+
+    if (expires != 0 && (e = malloc(sizeof(ttl_node_t))) == NULL)
+        return false;
+    ttl_forget(h, n);
+    if (e != NULL)
+    {
+        aatree_init_node(&e->n);
+        e->key.expires = expires;
+        e->key.seq = h->h.ttl_seq++;
+        e->node = n;
+        n->ttl = e;
+        aatree_insert_node(&h->h.ttl, &e->key, &e->n);
+    }
+    return true;
+}
+
+uint64_t
+aatreem_expiry(aatree_node_t *x)
+{
+    aatreem_node_t *n = (aatreem_node_t *)x;
+
+    return (n->ttl == NULL ? 0 : n->ttl->key.expires);
+}
+
+size_t
+aatreem_expire(aatree_t *t, uint64_t now, size_t budget,
+               void (*freefun)(void *))
+{
+    aatreem_head_t *h = head(t);
+    aatree_node_t *min;
+    size_t n = 0;
+
+    h->h.now = now;
+    while (n < budget && (min = aatree_min(&h->h.ttl)) != NULL &&
+           ((ttl_node_t *)min)->key.expires <= now)
+    {
+        ttl_node_t *e = (ttl_node_t *)aatree_pop_min(&h->h.ttl);
+        aatreem_node_t *node = e->node;
+
+        node->ttl = NULL;
+        free(e);
+        remove_exact(t, node, freefun);
+        n += 1;
+    }
+    return n;
+}
+
+static void
+link_all(aatreem_head_t *h, aatree_node_t *n)
+{
+    while (n != NULL)
+    {
+        link_all(h, aatree_get_left(n));
+        clock_link(h, (aatreem_node_t *)n);
+        n = aatree_get_right(n);
+    }
+}
+
+void
+aatreem_change_hook(aatree_t *t, aatreem_change_fun_t *fun, void *arg)
+{
+    head(t)->h.hook = fun;
+    head(t)->h.hook_arg = arg;
+}
+
+void
+aatreem_capacity_attach(aatree_t *t, size_t max_entries, size_t max_bytes,
+                        aatreem_evict_fun_t *evict)
+{
+    aatreem_head_t *h = head(t);
+
+    if (! h->h.capacity)
+    {
+        memset(&h->h.stats, 0, sizeof(h->h.stats));
+        h->h.hand = NULL;
+        link_all(h, t->root);
+        h->h.capacity = true;
+    }
+    h->h.max_entries = max_entries;
+    h->h.max_bytes = max_bytes;
+    h->h.evict = evict;
+    clock_evict(t, NULL);
+}
+
+void
+aatreem_capacity_detach(aatree_t *t)
+{
+    head(t)->h.capacity = false;
+    head(t)->h.hand = NULL;
+}
+
+void
+aatreem_capacity_stats(aatree_t *t, aatreem_capacity_stats_t *s)
+{
+    *s = head(t)->h.stats;
+}
+
+aatreem_feed_t *
+aatreem_feed_attach(aatree_t *t, size_t bytes)
+{
+    aatreem_head_t *h = head(t);
+    aatreem_feed_t *f;
+    size_t size = FEED_MIN;
+
+    if (h->h.feed != NULL)
+        return h->h.feed;
+    while (size < bytes)
+        size *= 2;
+    if ((f = aligned_alloc(_Alignof(aatreem_feed_t),
+                           sizeof(aatreem_feed_t))) == NULL)
+        return NULL;
+    if ((f->ring = malloc(size)) == NULL)
+    {
+        free(f);
+        return NULL;
+    }
+    f->mask = size - 1;
+    atomic_init(&f->lost, 0);
+    atomic_init(&f->head, 0);
+    atomic_init(&f->tail, 0);
+    h->h.feed = f;
+    return f;
+}
+
+void
+aatreem_feed_detach(aatree_t *t)
+{
+    aatreem_feed_t *f = head(t)->h.feed;
+
+    if (f != NULL)
+    {
+        free(f->ring);
+        free(f);
+        head(t)->h.feed = NULL;
+    }
+}
+
+size_t
+aatreem_feed_drain(aatreem_feed_t *f, size_t max,
+                   aatreem_feed_fun_t *fun, void *arg)
+{
+    size_t size = f->mask + 1;
+    uint64_t tail = atomic_load_explicit(&f->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&f->head, memory_order_acquire);
+    size_t n = 0;
+
+    while (n < max && tail != head)
+    {
+        size_t pos = tail & f->mask;
+        feed_rec_t *r = (feed_rec_t *)(f->ring + pos);
+        aatreem_change_t c;
+
+        if (size - pos < sizeof(feed_rec_t) || r->op == FEED_PAD)
+        {
+            tail += size - pos;
+            continue;
+        }
+        c.seq = r->seq;
+        c.op = (aatreem_change_op_t)r->op;
+        c.key = (const char *)(r + 1);
+        c.keylen = r->keylen;
+        c.newkey = (r->op == aatreem_change_rename ?
+                    c.key + r->keylen + 1 : NULL);
+        c.newkeylen = r->newkeylen;
+        c.value = r->value;
+        if (! fun(&c, arg))
+            break;
+        tail += feed_rec_size(r->keylen, r->newkeylen);
+        n += 1;
+        /* Give the room back right away */
+        atomic_store_explicit(&f->tail, tail, memory_order_release);
+    }
+    atomic_store_explicit(&f->tail, tail, memory_order_release);
+    return n;
+}
+
+uint64_t
+aatreem_feed_lost(aatreem_feed_t *f)
+{
+    return atomic_load_explicit(&f->lost, memory_order_relaxed);
+}
+
+bool
+aatreem_feed_apply(aatree_t *t, const aatreem_change_t *c)
+{
+    aatreem_bkey_t k = { c->keylen, c->key };
+    aatreem_bkey_t nk = { c->newkeylen, c->newkey };
+    const void *key = c->key, *newkey = c->newkey;
+
+    if (head(t)->h.binary)
+    {
+        key = &k;
+        newkey = &nk;
+    }
+    switch (c->op)
+    {
+    case aatreem_change_insert:
+        return insert(t, key, c->value);
+    case aatreem_change_replace:
+        return replace(t, key, c->value, NULL);
+    case aatreem_change_delete:
+        (void)delete(t, key, NULL, NULL);
+        return true;
+    case aatreem_change_rename:
+        return rename_key(t, key, newkey);
     }
     return true;
 }
@@ -9,10 +9,77 @@
 
 #include "aatree.h"
 
+/* A binary key, of 'len' bytes at 'data', which can be any bytes */
+typedef struct aatreem_bkey_s
+{
+    size_t len;
+    const void *data;
+} aatreem_bkey_t;
+
+/* Called with the key and value of a node about to be evicted. The key
+   is freed after the call, but the value is left to the callee. With
+   binary keys, 'key' points to the aatreem_bkey_t. */
+typedef void aatreem_evict_fun_t(aatree_t *t, const char *key, void *value);
+
+typedef struct aatreem_capacity_stats_s
+{
+    size_t entries;             /* In the tree now */
+    size_t bytes;               /* Of the nodes and keys, not the values */
+    uint64_t hits, misses;      /* Of aatreem_find() */
+    uint64_t evictions;
+} aatreem_capacity_stats_t;
+
+/* A change to a tree, as recorded in its feed */
+typedef enum aatreem_change_op_e
+{
+    aatreem_change_insert,
+    aatreem_change_replace,     /* Or inserted, if the key wasn't there */
+    aatreem_change_delete,      /* Including evictions and expiry */
+    aatreem_change_rename
+} aatreem_change_op_t;
+
+typedef struct aatreem_change_s
+{
+    uint64_t seq;               /* Of all the changes to the tree, from 1 */
+    aatreem_change_op_t op;
+    const char *key;
+    const char *newkey;         /* For rename, NULL otherwise */
+    size_t keylen, newkeylen;   /* The bytes in the keys, without a '\0' */
+    void *value;                /* For insert and replace */
+} aatreem_change_t;
+
+typedef struct aatreem_feed_s aatreem_feed_t;
+
+/* Called on each change, after it's made, by the function making it */
+typedef void aatreem_change_fun_t(aatree_t *t, const aatreem_change_t *c,
+                                  void *arg);
+
+/* Called by aatreem_feed_drain() on each change in turn. The keys are
+   only valid during the call.
+   Returns false to stop, leaving the change in the feed. */
+typedef bool aatreem_feed_fun_t(const aatreem_change_t *c, void *arg);
+
 /* Size is necessary in case we have expanded the struct; at
-   least sizeof(aatree_t) will be allocated regardless of 'size'. */
+   least sizeof(aatree_t) will be allocated regardless of 'size'.
+   The other aatreem functions must only be used on trees created
+   with this. */
 aatree_t *aatreem_create(size_t);
 
+/* As aatreem_create(), for a tree with binary keys, of any bytes, with
+   their length kept in the node. They are ordered with memcmp(), and the
+   shorter first if one is a prefix of the other. Such trees must be used
+   with the aatreem_b* functions below instead of the ones taking
+   strings; aatreem_load_sorted(), the prefix iterator and aatreel only
+   take strings. */
+aatree_t *aatreem_create_binary(size_t size);
+
+/* Returns true if the tree was made with aatreem_create_binary(). */
+bool aatreem_is_binary(aatree_t *t);
+
+/* Returns the key of a node in a tree with binary keys. The bytes are
+   followed by a '\0', not counted in the length. */
+const aatreem_bkey_t *aatreem_bkey(aatree_node_t *n);
+
 char *aatree_key(aatree_node_t *t);
 
 void *aatree_value(aatree_node_t *t);
@@ -50,11 +117,162 @@ bool aatreem_replace(aatree_t *t, const char *key, void *value,
 bool aatreem_delete(aatree_t *t, const char *key, aatree_condition_fun_t *cond,
                     void **deletedp);
 
+/* As aatreem_insert(), aatreem_replace() and aatreem_delete(), with the
+   binary key of 'len' bytes at 'key'. */
+bool aatreem_binsert(aatree_t *t, const void *key, size_t len, void *value);
+bool aatreem_breplace(aatree_t *t, const void *key, size_t len, void *value,
+                      void **replacedp);
+bool aatreem_bdelete(aatree_t *t, const void *key, size_t len,
+                     aatree_condition_fun_t *cond, void **deletedp);
+
 /* Destroy the tree by freeing all the nodes. If 'freefun' not NULL,
    it is called on each value pointer. */
 void aatreem_destroy(aatree_t *t, void (*freefun)(void *));
 
+/* As aatreem_destroy(), but done in a new thread. The tree must not be
+   used by the caller after this.
+   Returns false if no thread could be started, in which case the tree
+   is destroyed before returning. */
+bool aatreem_destroy_background(aatree_t *t, void (*freefun)(void *));
+
+/* Rebuild the tree to minimal height, with the nodes and keys moved
+   into one block of memory in breadth first order, in linear time.
+   Returns false if memory could not be allocated, in which case the
+   tree is unchanged. */
+bool aatreem_compact(aatree_t *t);
+
+/* Load an empty tree with 'n' keys and values, with the keys sorted,
+   in linear time, with the nodes and keys in one block of memory as
+   by aatreem_compact(). This is not recorded as changes.
+   Returns false if memory could not be allocated, or the tree is not
+   empty or has binary keys. */
+bool aatreem_load_sorted(aatree_t *t, size_t n, const char *const keys[],
+                         void *const values[]);
+
+/* Attach a lookup cache with a string hash; see aatree_cache_attach().
+   It's freed by aatreem_destroy().
+   Returns false if memory could not be allocated. */
+bool aatreem_cache_attach(aatree_t *t, size_t entries);
+
+/* Attach a Bloom filter with a string hash; see aatree_bloom_attach().
+   It's freed by aatreem_destroy().
+   Returns false if memory could not be allocated. */
+bool aatreem_bloom_attach(aatree_t *t, size_t keys);
+
+/* Attach a hash index of the nodes, so that aatreem_find() takes the
+   same time regardless of the size of the tree. It's kept up to date by
+   the other aatreem functions, but nodes must not be removed by other
+   means while it's attached.
+   Returns false if memory could not be allocated. */
+bool aatreem_index_attach(aatree_t *t);
+/* Free the hash index, if any. */
+void aatreem_index_detach(aatree_t *t);
+
+/* Find a node with the key, through the hash index if there is one,
+   or else with aatree_find_key(). Nodes that have expired as of the
+   latest aatreem_expire() are skipped.
+   Returns NULL if not found. */
+aatree_node_t *aatreem_find(aatree_t *t, const char *key);
+/* As aatreem_find(), with the binary key of 'len' bytes at 'key'. */
+aatree_node_t *aatreem_bfind(aatree_t *t, const void *key, size_t len);
+
+/* Set the time when the node expires, in any unit as long as it's the
+   same as for aatreem_expire(), or 0 for never, which is the default.
+   The times are kept in a second tree, in time order, linked to the
+   nodes. The node keeps its time when renamed or compacted, and when
+   its value is replaced.
+   Returns false if memory could not be allocated, in which case the
+   time is unchanged. */
+bool aatreem_set_expiry(aatree_t *t, aatree_node_t *n, uint64_t expires);
+/* Returns the time when the node expires, or 0 for never. */
+uint64_t aatreem_expiry(aatree_node_t *n);
+
+/* Delete at most 'budget' nodes that have expired at 'now', earliest
+   first, calling 'freefun' (if not NULL) on each value. The time taken
+   is proportional to the number deleted, not the size of the tree.
+   'now' is also the time used by aatreem_find() until the next call;
+   a 'budget' of 0 only sets that.
+   Returns the number of nodes deleted. */
+size_t aatreem_expire(aatree_t *t, uint64_t now, size_t budget,
+                      void (*freefun)(void *));
+
+/* Bound the tree to 'max_entries' nodes and 'max_bytes' bytes of nodes
+   and keys, 0 meaning no limit, evicting nodes with the CLOCK algorithm
+   when an insertion or rename takes it over either. All the nodes are
+   in a circular list in the nodes themselves, and aatreem_find() marks
+   the node found as referenced, which spares it the next time the hand
+   passes. 'evict' (if not NULL) is called on each node evicted. An
+   insertion never evicts the node inserted, and the last node is never
+   evicted. The nodes already in the tree are linked in, and evicted if
+   there are too many. If already attached, the limits and the callback
+   are changed. */
+void aatreem_capacity_attach(aatree_t *t, size_t max_entries,
+                             size_t max_bytes, aatreem_evict_fun_t *evict);
+/* Remove the bound. */
+void aatreem_capacity_detach(aatree_t *t);
+/* Get the current size, and the counters since attached. */
+void aatreem_capacity_stats(aatree_t *t, aatreem_capacity_stats_t *s);
+
+/* Record the changes made by the other aatreem functions in a ring
+   buffer of about 'bytes' bytes, for one other thread to drain with
+   aatreem_feed_drain() while the tree is being changed, without locks.
+   Each change takes a small header and the key. If the buffer is full
+   the change is lost, which leaves a gap in the sequence numbers, and
+   the consumer must then copy the whole tree.
+   If already attached, returns the same feed.
+   Returns NULL if memory could not be allocated. */
+aatreem_feed_t *aatreem_feed_attach(aatree_t *t, size_t bytes);
+/* Free the feed, if any. The consumer must be done with it. */
+void aatreem_feed_detach(aatree_t *t);
+
+/* Call 'fun' on at most 'max' changes, oldest first, removing each from
+   the feed when it returns true.
+   Returns the number of changes removed. */
+size_t aatreem_feed_drain(aatreem_feed_t *f, size_t max,
+                          aatreem_feed_fun_t *fun, void *arg);
+/* Returns the number of changes lost so far, since the buffer was full. */
+uint64_t aatreem_feed_lost(aatreem_feed_t *f);
+
+/* Call 'fun' with 'arg' on each change made by the other aatreem
+   functions, or stop if 'fun' is NULL. There is one hook per tree. */
+void aatreem_change_hook(aatree_t *t, aatreem_change_fun_t *fun, void *arg);
+
+/* Make the change to another tree made with aatreem_create(), such as
+   a replica. The values are passed on as they are. With duplicate
+   keys, the node replaced or deleted might not be the same one as in
+   the original.
+   Returns false if memory could not be allocated. */
+bool aatreem_feed_apply(aatree_t *t, const aatreem_change_t *c);
+
+typedef struct aatreem_prefix_iter_s
+{
+    aatree_iter_t iter;
+    const char *prefix;
+    size_t len;
+} aatreem_prefix_iter_t;
+
+/* Initialize an iterator for the nodes with keys starting with
+   'prefix', which must stay unchanged while it's used. It starts at the
+   first key greater than or equal to the prefix, found in O(log n).
+   Returns false if the tree is too deep, or has binary keys, true
+   otherwise. */
+bool aatreem_prefix_iter_init(aatree_t *t, const char *prefix,
+                              aatreem_prefix_iter_t *iter);
+/* Get the next node with the prefix, in key order. Nodes that have
+   expired as of the latest aatreem_expire() are skipped.
+   Returns NULL when there are no more. */
+aatree_node_t *aatreem_prefix_iter_next(aatreem_prefix_iter_t *iter);
+
+/* Returns the number of nodes with keys starting with 'prefix', in
+   O(log n + the number), without keeping the nodes. */
+size_t aatreem_prefix_count(aatree_t *t, const char *prefix);
+
 /* Rename all occurences of 'oldkey' to 'newkey'. The tree is assumed to
    allow non-unique keys.
-   QQQ Returns the new tree root. */
+   Returns false if memory could not be allocated, in which case no node
+   is renamed. */
 bool aatreem_rename(aatree_t *t, const char *oldkey, const char *newkey);
+/* As aatreem_rename(), with the binary keys of 'oldlen' bytes at
+   'oldkey' and 'newlen' bytes at 'newkey'. */
+bool aatreem_brename(aatree_t *t, const void *oldkey, size_t oldlen,
+                     const void *newkey, size_t newlen);
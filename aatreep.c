@@ -0,0 +1,904 @@
+/*
+** pem 2026-10-19
+**
+** Parallel operations on whole trees.
+**
+** Sorting is a merge sort where each thread first sorts a chunk of the
+** array, and then runs are merged pairwise, with each merge split over
+** several threads by finding the split points with binary search.
+**
+** All of it runs on a pool of threads that are started when first
+** needed, and then wait for more work instead of exiting.
+**
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "aatreep.h"
+
+/* Don't bother to start threads for less than this */
+#define AATREEP_MIN_TASK 4096
+/* Never more threads in the pool than this */
+#define AATREEP_MAX_THREADS 256
+/* The ordered aatree_each_parallel() walks subtrees of at most this
+   level, and keeps at most this many per thread walked ahead */
+#define AATREEP_ORDERED_LEVEL 10
+#define AATREEP_ORDERED_AHEAD 2
+
+/* A call to aatree_run_tasks(), in the list while it has tasks that no
+   thread has taken yet */
+typedef struct job_s
+{
+    struct job_s *next;
+    void *(*fun)(void *);
+    char *tasks;
+    size_t size, n;
+    size_t taken, done;
+    pthread_cond_t finished;    /* Signalled when 'done' gets to 'n' */
+} job_t;
+
+typedef struct thread_pool_s
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* Signalled when a job is added */
+    job_t *jobs, **last;
+    unsigned threads;
+} thread_pool_t;
+
+static thread_pool_t thread_pool =
+{
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, &thread_pool.jobs, 0
+};
+
+/* Take the next task of the job, which must be in the list, and remove
+   it from the list if it was the last. The lock must be held. */
+static size_t
+job_take(job_t *j)
+{
+    size_t i = j->taken++;
+
+    if (j->taken == j->n)
+    {
+        job_t **jp = &thread_pool.jobs;
+
+        while (*jp != j)
+            jp = &(*jp)->next;
+        if ((*jp = j->next) == NULL)
+            thread_pool.last = jp;
+    }
+    return i;
+}
+
+/* Run the task, and count it as done. The lock must not be held. */
+static void
+job_run(job_t *j, size_t i)
+{
+    (void)j->fun(j->tasks + i * j->size);
+    pthread_mutex_lock(&thread_pool.lock);
+    if (++j->done == j->n)
+        pthread_cond_signal(&j->finished);
+    pthread_mutex_unlock(&thread_pool.lock);
+}
+
+static void *
+pool_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&thread_pool.lock);
+    for (;;)
+    {
+        while (thread_pool.jobs == NULL)
+            pthread_cond_wait(&thread_pool.work, &thread_pool.lock);
+
+        job_t *j = thread_pool.jobs;
+        size_t i = job_take(j);
+
+        pthread_mutex_unlock(&thread_pool.lock);
+        job_run(j, i);
+        pthread_mutex_lock(&thread_pool.lock);
+    }
+    return NULL;
+}
+
+/* Start threads until there are 'n', if possible. The lock must be
+   held. */
+static void
+pool_grow(size_t n)
+{
+    pthread_attr_t attr;
+
+    if (n > AATREEP_MAX_THREADS)
+        n = AATREEP_MAX_THREADS;
+    if (thread_pool.threads >= n || pthread_attr_init(&attr) != 0)
+        return;
+    if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0)
+        while (thread_pool.threads < n)
+        {
+            pthread_t tid;
+
+            if (pthread_create(&tid, &attr, pool_thread, NULL) != 0)
+                break;
+            thread_pool.threads += 1;
+        }
+    pthread_attr_destroy(&attr);
+}
+
+/* The caller runs the first task, and then any that no thread has
+   taken, so all get done even if no thread could be started. A task
+   that runs tasks of its own does the same, so it doesn't wait for
+   threads that are waiting for it. */
+void
+aatree_run_tasks(void *(*fun)(void *), void *tasks, size_t size, size_t n)
+{
+    job_t job = { .fun = fun, .tasks = tasks, .size = size, .n = n,
+                  .taken = 1 };
+    size_t i = 0;
+
+    if (n <= 1)
+    {
+        if (n == 1)
+            (void)fun(tasks);
+        return;
+    }
+    pthread_cond_init(&job.finished, NULL);
+    pthread_mutex_lock(&thread_pool.lock);
+    pool_grow(n - 1);
+    *thread_pool.last = &job;
+    thread_pool.last = &job.next;
+    pthread_cond_broadcast(&thread_pool.work);
+    pthread_mutex_unlock(&thread_pool.lock);
+    for (;;)
+    {
+        job_run(&job, i);
+        pthread_mutex_lock(&thread_pool.lock);
+        if (job.taken == job.n)
+            break;
+        i = job_take(&job);
+        pthread_mutex_unlock(&thread_pool.lock);
+    }
+    while (job.done < job.n)
+        pthread_cond_wait(&job.finished, &thread_pool.lock);
+    pthread_mutex_unlock(&thread_pool.lock);
+    pthread_cond_destroy(&job.finished);
+}
+
+static bool
+before(aatree_t *t, aatree_node_t *a, aatree_node_t *b)
+{
+    return (t->compare(t, t->key(t, a), b) < 0);
+}
+
+/* Stable merge of a[0..m) and b[0..n) into out */
+static void
+merge(aatree_t *t, aatree_node_t **a, size_t m, aatree_node_t **b, size_t n,
+      aatree_node_t **out)
+{
+    size_t i = 0, j = 0;
+
+    while (i < m && j < n)
+        if (before(t, b[j], a[i]))
+            *out++ = b[j++];
+        else
+            *out++ = a[i++];
+    while (i < m)
+        *out++ = a[i++];
+    while (j < n)
+        *out++ = b[j++];
+}
+
+/* Returns how many of the first k nodes of the merge of a[0..m) and
+   b[0..n) are from a[]. */
+static size_t
+corank(aatree_t *t, size_t k,
+       aatree_node_t **a, size_t m, aatree_node_t **b, size_t n)
+{
+    size_t lo = (k > n ? k - n : 0), hi = (k < m ? k : m);
+
+    while (lo < hi)
+    {
+        size_t i = lo + (hi - lo) / 2;
+
+        if (! before(t, b[k-i-1], a[i]))
+            lo = i + 1;         /* a[i] is in the first k */
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+/* Stable merge sort of a[0..n), using tmp[0..n) */
+static void
+msort(aatree_t *t, aatree_node_t **a, aatree_node_t **tmp, size_t n)
+{
+    if (n <= 16)
+    {
+        for (size_t i = 1 ; i < n ; i++)
+        {
+            aatree_node_t *x = a[i];
+            size_t j = i;
+
+            for ( ; j > 0 && before(t, x, a[j-1]) ; j--)
+                a[j] = a[j-1];
+            a[j] = x;
+        }
+        return;
+    }
+
+    size_t h = n / 2;
+
+    msort(t, a, tmp, h);
+    msort(t, a+h, tmp+h, n-h);
+    if (! before(t, a[h], a[h-1]))
+        return;                 /* Already in order */
+    merge(t, a, h, a+h, n-h, tmp);
+    memcpy(a, tmp, n * sizeof(aatree_node_t *));
+}
+
+void
+aatree_sort_nodes(aatree_t *t, aatree_node_t *nodes[], aatree_node_t *tmp[],
+                  size_t n)
+{
+    msort(t, nodes, tmp, n);
+}
+
+typedef struct sort_task_s
+{
+    aatree_t *t;
+    aatree_node_t **src, **dst;
+    size_t lo, mid, hi;         /* The runs [lo, mid) and [mid, hi) */
+    size_t klo, khi;            /* This task's part of the output */
+} sort_task_t;
+
+static void *
+sort_chunk(void *arg)
+{
+    sort_task_t *st = arg;
+
+    msort(st->t, st->src + st->lo, st->dst + st->lo, st->hi - st->lo);
+    return NULL;
+}
+
+static void *
+merge_part(void *arg)
+{
+    sort_task_t *st = arg;
+    aatree_node_t **a = st->src + st->lo, **b = st->src + st->mid;
+    size_t m = st->mid - st->lo, n = st->hi - st->mid;
+    size_t ilo = corank(st->t, st->klo, a, m, b, n);
+    size_t ihi = corank(st->t, st->khi, a, m, b, n);
+
+    merge(st->t, a + ilo, ihi - ilo,
+          b + (st->klo - ilo), (st->khi - ihi) - (st->klo - ilo),
+          st->dst + st->lo + st->klo);
+    return NULL;
+}
+
+static bool
+sort_parallel(aatree_t *t, aatree_node_t **nodes, size_t n, unsigned threads)
+{
+    aatree_node_t **tmp = malloc(n * sizeof(aatree_node_t *));
+    size_t *bound = malloc((threads + 1) * sizeof(size_t));
+    sort_task_t *task = calloc(2 * threads, sizeof(sort_task_t));
+    aatree_node_t **src = nodes, **dst = tmp;
+    size_t runs = threads;
+
+    if (tmp == NULL || bound == NULL || task == NULL)
+    {
+        free(task);
+        free(bound);
+        free(tmp);
+        return false;
+    }
+    for (size_t i = 0 ; i <= runs ; i++)
+        bound[i] = n * i / runs;
+    for (size_t i = 0 ; i < runs ; i++)
+    {
+        task[i].t = t;
+        task[i].src = nodes;
+        task[i].dst = tmp;
+        task[i].lo = bound[i];
+        task[i].hi = bound[i+1];
+    }
+    aatree_run_tasks(sort_chunk, task, sizeof(sort_task_t), runs);
+
+    while (runs > 1)
+    {
+        size_t ntasks = 0;
+
+        for (size_t r = 0 ; r < runs ; r += 2)
+        {
+            size_t lo = bound[r], hi = bound[(r+2 <= runs ? r+2 : runs)];
+            size_t mid = (r+1 <= runs ? bound[r+1] : hi);
+            size_t len = hi - lo;
+            size_t parts = (n == 0 ? 1 : threads * len / n);
+
+            if (parts == 0)
+                parts = 1;
+            for (size_t p = 0 ; p < parts ; p++)
+            {
+                sort_task_t *st = &task[ntasks++];
+
+                st->t = t;
+                st->src = src;
+                st->dst = dst;
+                st->lo = lo;
+                st->mid = mid;
+                st->hi = hi;
+                st->klo = len * p / parts;
+                st->khi = len * (p+1) / parts;
+            }
+        }
+        aatree_run_tasks(merge_part, task, sizeof(sort_task_t), ntasks);
+        for (size_t r = 0 ; 2*r < runs ; r++)
+            bound[r] = bound[2*r];
+        runs = (runs + 1) / 2;
+        bound[runs] = n;
+
+        aatree_node_t **swap = src;
+
+        src = dst;
+        dst = swap;
+    }
+    if (src != nodes)
+        memcpy(nodes, src, n * sizeof(aatree_node_t *));
+    free(task);
+    free(bound);
+    free(tmp);
+    return true;
+}
+
+typedef struct build_task_s
+{
+    aatree_t *t;
+    aatree_node_t **nodes;
+    size_t n;
+    unsigned threads;
+    aatree_node_t *root;
+} build_task_t;
+
+/* Same shape as aatree_build_sorted(), with the two subtrees built in
+   parallel near the top. */
+static void *
+build_task(void *arg)
+{
+    build_task_t *bt = arg;
+
+    if (bt->threads <= 1 || bt->n < AATREEP_MIN_TASK)
+    {
+        aatree_t sub = *bt->t;
+
+        sub.cache = NULL;
+        sub.bloom = NULL;
+        aatree_build_sorted(&sub, bt->nodes, bt->n);
+        bt->root = sub.root;
+        return NULL;
+    }
+
+    size_t mid = (bt->n-1) / 2;
+    build_task_t sub[2] =
+    {
+        { bt->t, bt->nodes, mid, bt->threads / 2, NULL },
+        { bt->t, bt->nodes+mid+1, bt->n-mid-1,
+          bt->threads - bt->threads / 2, NULL }
+    };
+
+    aatree_run_tasks(build_task, sub, sizeof(build_task_t), 2);
+
+    aatree_node_t *t = bt->nodes[mid];
+
+    aatree_set_left(t, sub[0].root);
+    aatree_set_right(t, sub[1].root);
+    aatree_set_level(t, aatree_get_level(sub[0].root) + 1);
+    if (bt->t->update != NULL)
+        bt->t->update(bt->t, t);
+    bt->root = t;
+    return NULL;
+}
+
+bool
+aatree_build_parallel(aatree_t *t, aatree_node_t *nodes[], size_t n,
+                      unsigned threads)
+{
+    if (n == 0)
+    {
+        t->root = t->min = t->max = NULL;
+        return true;
+    }
+    if (threads == 0)
+        threads = 1;
+    if (threads > 1 && n < (size_t)threads * AATREEP_MIN_TASK)
+        threads = (unsigned)(n / AATREEP_MIN_TASK + 1);
+    if (threads == 1)
+    {
+        aatree_node_t **tmp = malloc(n * sizeof(aatree_node_t *));
+
+        if (tmp == NULL)
+            return false;
+        msort(t, nodes, tmp, n);
+        free(tmp);
+    }
+    else if (! sort_parallel(t, nodes, n, threads))
+        return false;
+
+    build_task_t bt = { t, nodes, n, threads, NULL };
+
+    (void)build_task(&bt);
+    aatree_set_root(t, bt.root);
+    t->min = nodes[0];
+    t->max = nodes[n-1];
+    if (t->bloom != NULL)
+    {
+        aatree_bloom_clear(t);
+        for (size_t i = 0 ; i < n ; i++)
+            aatree_bloom_add(t, t->key(t, nodes[i]));
+    }
+    return true;
+}
+
+/* A part of the tree for one task: either a single node, or a whole
+   subtree. The spans are kept in key order. */
+typedef struct span_s
+{
+    aatree_node_t *node;
+    bool subtree;
+    /* For the ordered aatree_each_parallel(): the nodes, once walked,
+       or NULL if there wasn't memory for them */
+    bool walked;
+    aatree_node_t **nodes;
+    size_t n;
+} span_t;
+
+typedef struct pool_s pool_t;
+
+typedef struct worker_s
+{
+    pool_t *pool;
+    unsigned id;
+    pthread_mutex_t lock;
+    size_t lo, hi;              /* The spans not yet taken */
+    void *acc;                  /* For unordered reductions */
+} worker_t;
+
+struct pool_s
+{
+    aatree_t *t;
+    span_t *span;
+    size_t nspans, size;
+    worker_t *worker;
+    unsigned nworkers;
+    atomic_bool stop;
+    void (*work)(worker_t *, span_t *);
+    bool (*f)(aatree_t *, aatree_node_t *);
+    aatree_reduce_init_fun_t *init;
+    aatree_reduce_fold_fun_t *fold;
+    void *arg;
+    void **acc;                 /* Per span, for ordered reductions */
+    /* For the ordered aatree_each_parallel() */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Broadcast when any of these change */
+    size_t next;                /* The next span to walk */
+    size_t used;                /* The spans done with */
+    size_t ahead;               /* How many may be walked past 'used' */
+};
+
+static bool
+add_span(pool_t *p, aatree_node_t *n, bool subtree)
+{
+    if (p->nspans == p->size)
+    {
+        size_t size = (p->size == 0 ? 64 : 2 * p->size);
+        span_t *span = realloc(p->span, size * sizeof(span_t));
+
+        if (span == NULL)
+            return false;
+        p->span = span;
+        p->size = size;
+    }
+    memset(&p->span[p->nspans], 0, sizeof(span_t));
+    p->span[p->nspans].node = n;
+    p->span[p->nspans].subtree = subtree;
+    p->nspans += 1;
+    return true;
+}
+
+/* Subtrees with levels above 'cutoff' are split in their left subtree,
+   the node itself, and the right subtree */
+static bool
+split_spans(pool_t *p, aatree_node_t *n, aatree_level_t cutoff)
+{
+    if (n == NULL)
+        return true;
+    if (aatree_get_level(n) <= cutoff)
+        return add_span(p, n, true);
+    return (split_spans(p, aatree_get_left(n), cutoff) &&
+            add_span(p, n, false) &&
+            split_spans(p, aatree_get_right(n), cutoff));
+}
+
+/* Take a span of our own from the front, or steal one from the back of
+   someone else's. Returns false when all are taken. */
+static bool
+take_span(worker_t *w, size_t *ip)
+{
+    pool_t *p = w->pool;
+
+    for (unsigned k = 0 ; k < p->nworkers ; k++)
+    {
+        worker_t *v = &p->worker[(w->id + k) % p->nworkers];
+        bool found = false;
+
+        pthread_mutex_lock(&v->lock);
+        if (v->lo < v->hi)
+        {
+            *ip = (v == w ? v->lo++ : --v->hi);
+            found = true;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+static void *
+worker_run(void *arg)
+{
+    worker_t *w = arg;
+    size_t i;
+
+    while (! atomic_load_explicit(&w->pool->stop, memory_order_relaxed) &&
+           take_span(w, &i))
+        w->pool->work(w, &w->pool->span[i]);
+    return NULL;
+}
+
+/* Split the tree in spans for the threads, with none above level
+   'limit' */
+static bool
+pool_split(pool_t *p, unsigned threads, aatree_level_t limit)
+{
+    aatree_node_t *root = p->t->root;
+    aatree_level_t cutoff = (root == NULL ? 0 : aatree_get_level(root));
+
+    if (threads > 1)
+    {                           /* Aim for some 8 subtrees per thread */
+        aatree_level_t depth = 3;
+
+        for (unsigned n = threads - 1 ; n > 0 ; n >>= 1)
+            depth += 1;
+        cutoff = (cutoff > depth ? cutoff - depth : 1);
+    }
+    if (cutoff > limit)
+        cutoff = limit;
+    return split_spans(p, root, cutoff);
+}
+
+static bool
+pool_run(pool_t *p, unsigned threads, void *(*run)(void *))
+{
+    if ((p->worker = calloc(threads, sizeof(worker_t))) == NULL)
+        return false;
+    p->nworkers = threads;
+    atomic_init(&p->stop, false);
+    for (unsigned i = 0 ; i < threads ; i++)
+    {
+        worker_t *w = &p->worker[i];
+
+        w->pool = p;
+        w->id = i;
+        pthread_mutex_init(&w->lock, NULL);
+        w->lo = p->nspans * i / threads;
+        w->hi = p->nspans * (i+1) / threads;
+    }
+    aatree_run_tasks(run, p->worker, sizeof(worker_t), threads);
+    for (unsigned i = 0 ; i < threads ; i++)
+        pthread_mutex_destroy(&p->worker[i].lock);
+    return true;
+}
+
+static bool
+each_subtree(pool_t *p, aatree_node_t *n)
+{
+    while (n != NULL)
+    {
+        if (! each_subtree(p, aatree_get_left(n)))
+            return false;
+        if (atomic_load_explicit(&p->stop, memory_order_relaxed) ||
+            ! p->f(p->t, n))
+            return false;
+        n = aatree_get_right(n);
+    }
+    return true;
+}
+
+static void
+each_work(worker_t *w, span_t *s)
+{
+    pool_t *p = w->pool;
+    bool ok;
+
+    if (s->subtree)
+        ok = each_subtree(p, s->node);
+    else
+        ok = p->f(p->t, s->node);
+    if (! ok)
+        atomic_store(&p->stop, true);
+}
+
+static bool
+collect(aatree_node_t *n, aatree_node_t ***nodesp, size_t *np, size_t *sizep)
+{
+    while (n != NULL)
+    {
+        if (! collect(aatree_get_left(n), nodesp, np, sizep))
+            return false;
+        if (*np == *sizep)
+        {
+            size_t size = (*sizep == 0 ? 64 : 2 * *sizep);
+            aatree_node_t **nodes = realloc(*nodesp, size * sizeof(*nodes));
+
+            if (nodes == NULL)
+                return false;
+            *nodesp = nodes;
+            *sizep = size;
+        }
+        (*nodesp)[(*np)++] = n;
+        n = aatree_get_right(n);
+    }
+    return true;
+}
+
+/* Walk the span, which the caller has taken, and mark it walked */
+static void
+walk_span(pool_t *p, span_t *s)
+{
+    size_t size = 0;
+
+    pthread_mutex_unlock(&p->lock);
+    if (! s->subtree)
+    {
+        if ((s->nodes = malloc(sizeof(aatree_node_t *))) != NULL)
+            s->nodes[s->n++] = s->node;
+    }
+    else if (! collect(s->node, &s->nodes, &s->n, &size))
+    {
+        free(s->nodes);
+        s->nodes = NULL;
+    }
+    pthread_mutex_lock(&p->lock);
+    s->walked = true;
+    pthread_cond_broadcast(&p->cond);
+}
+
+/* Walk the spans in order, at most 'ahead' spans ahead of the first
+   thread, which calls f */
+static void *
+ordered_walk(void *arg)
+{
+    worker_t *w = arg;
+    pool_t *p = w->pool;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        while (p->next < p->nspans && p->next >= p->used + p->ahead &&
+               ! atomic_load(&p->stop))
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->next == p->nspans || atomic_load(&p->stop))
+            break;
+        walk_span(p, &p->span[p->next++]);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Call f on the nodes of each span in turn, walking it itself if no one
+   else has started to */
+static void *
+ordered_each(void *arg)
+{
+    worker_t *w = arg;
+    pool_t *p = w->pool;
+
+    if (w->id > 0)
+        return ordered_walk(arg);
+    pthread_mutex_lock(&p->lock);
+    for (size_t i = 0 ; i < p->nspans && ! atomic_load(&p->stop) ; i++)
+    {
+        span_t *s = &p->span[i];
+        bool ok = true;
+
+        while (! s->walked)
+            if (p->next == i)
+                walk_span(p, &p->span[p->next++]);
+            else
+                pthread_cond_wait(&p->cond, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+        if (s->nodes == NULL)
+            each_work(w, s);
+        else
+            for (size_t j = 0 ; j < s->n && ok ; j++)
+                ok = p->f(p->t, s->nodes[j]);
+        free(s->nodes);
+        s->nodes = NULL;
+        pthread_mutex_lock(&p->lock);
+        if (! ok)
+            atomic_store(&p->stop, true);
+        p->used = i+1;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+bool
+aatree_each_parallel(aatree_t *t, bool (*f)(aatree_t *, aatree_node_t *),
+                     unsigned threads, bool ordered)
+{
+    pool_t p;
+    bool ok;
+
+    if (threads == 0)
+        threads = 1;
+    if (ordered && threads == 1)
+        return aatree_each(t, f);
+    memset(&p, 0, sizeof(p));
+    p.t = t;
+    p.f = f;
+    p.work = each_work;
+    if (! ordered)
+        ok = (pool_split(&p, threads, AATREE_MAX_DEPTH) &&
+              pool_run(&p, threads, worker_run));
+    else
+    {
+        pthread_mutex_init(&p.lock, NULL);
+        pthread_cond_init(&p.cond, NULL);
+        p.ahead = AATREEP_ORDERED_AHEAD * threads;
+        ok = (pool_split(&p, threads, AATREEP_ORDERED_LEVEL) &&
+              pool_run(&p, threads, ordered_each));
+        for (size_t i = 0 ; i < p.nspans ; i++)
+            free(p.span[i].nodes);
+        pthread_cond_destroy(&p.cond);
+        pthread_mutex_destroy(&p.lock);
+    }
+    free(p.worker);
+    free(p.span);
+    if (! ok)                   /* Out of memory, do it the slow way */
+        return aatree_each(t, f);
+    return ! atomic_load(&p.stop);
+}
+
+static void
+fold_subtree(pool_t *p, void *acc, aatree_node_t *n)
+{
+    while (n != NULL)
+    {
+        fold_subtree(p, acc, aatree_get_left(n));
+        p->fold(p->t, acc, n);
+        n = aatree_get_right(n);
+    }
+}
+
+static void
+reduce_work(worker_t *w, span_t *s)
+{
+    pool_t *p = w->pool;
+    void *acc;
+
+    if (p->acc != NULL)
+        acc = p->acc[s - p->span] = p->init(p->t, p->arg);
+    else
+    {
+        if (w->acc == NULL)
+            w->acc = p->init(p->t, p->arg);
+        acc = w->acc;
+    }
+    if (s->subtree)
+        fold_subtree(p, acc, s->node);
+    else
+        p->fold(p->t, acc, s->node);
+}
+
+void *
+aatree_reduce_parallel(aatree_t *t,
+                       aatree_reduce_init_fun_t *init,
+                       aatree_reduce_fold_fun_t *fold,
+                       aatree_reduce_combine_fun_t *combine,
+                       void *arg, unsigned threads, bool ordered)
+{
+    pool_t p;
+    void *acc = NULL;
+    bool ok;
+
+    if (threads == 0)
+        threads = 1;
+    memset(&p, 0, sizeof(p));
+    p.t = t;
+    p.init = init;
+    p.fold = fold;
+    p.arg = arg;
+    p.work = reduce_work;
+    ok = pool_split(&p, threads, AATREE_MAX_DEPTH);
+    if (ok && ordered)
+        ok = ((p.acc = calloc(p.nspans + 1, sizeof(void *))) != NULL);
+    if (ok)
+        ok = pool_run(&p, threads, worker_run);
+    if (ok)
+    {
+        if (ordered)
+            for (size_t i = 0 ; i < p.nspans ; i++)
+            {
+                if (acc == NULL)
+                    acc = p.acc[i];
+                else
+                    combine(t, acc, p.acc[i]);
+            }
+        else
+            for (unsigned i = 0 ; i < p.nworkers ; i++)
+            {
+                if (p.worker[i].acc == NULL)
+                    continue;
+                if (acc == NULL)
+                    acc = p.worker[i].acc;
+                else
+                    combine(t, acc, p.worker[i].acc);
+            }
+        if (acc == NULL)
+            acc = init(t, arg); /* Empty tree */
+    }
+    free(p.acc);
+    free(p.worker);
+    free(p.span);
+    return acc;
+}
+
+typedef struct clear_task_s
+{
+    aatree_t t;
+    aatree_release_fun_t *release;
+} clear_task_t;
+
+static void *
+clear_task(void *arg)
+{
+    clear_task_t *ct = arg;
+
+    aatree_clear(&ct->t, ct->release);
+    free(ct);
+    return NULL;
+}
+
+bool
+aatree_clear_background(aatree_t *t, aatree_release_fun_t *release)
+{
+    clear_task_t *ct = malloc(sizeof(clear_task_t));
+    pthread_attr_t attr;
+    pthread_t tid;
+    bool started = false;
+
+    if (ct == NULL)
+    {
+        aatree_clear(t, release);
+        return false;
+    }
+    ct->t = *t;
+    ct->t.cache = NULL;
+    ct->t.bloom = NULL;
+    ct->release = release;
+    t->root = t->min = t->max = NULL;
+    aatree_cache_clear(t);
+    aatree_bloom_clear(t);
+    if (pthread_attr_init(&attr) == 0)
+    {
+        if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0)
+            started = (pthread_create(&tid, &attr, clear_task, ct) == 0);
+        pthread_attr_destroy(&attr);
+    }
+    if (! started)
+        (void)clear_task(ct);
+    return started;
+}
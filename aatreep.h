@@ -0,0 +1,72 @@
+/*
+** pem 2026-10-19
+**
+** Parallel operations on whole trees.
+**
+*/
+
+#pragma once
+
+#include "aatree.h"
+
+/* Call fun() on each of the 'n' tasks, 'size' bytes apart in 'tasks',
+   in parallel, and return when all are done. The calling thread runs
+   tasks too, and the others run on a pool of threads that is grown to
+   'n' - 1 as needed, and kept for later calls. Tasks can call this
+   themselves. */
+void aatree_run_tasks(void *(*fun)(void *), void *tasks, size_t size,
+                      size_t n);
+
+/* Build the tree from 'n' nodes in any order, using 'threads' threads
+   to sort the array (in place) and link the tree. Nodes with equal keys
+   keep their order in the array, as if inserted one by one.
+   The tree must be empty and have a key function.
+   Returns false if memory could not be allocated. */
+bool aatree_build_parallel(aatree_t *t, aatree_node_t *nodes[], size_t n,
+                           unsigned threads);
+
+/* Sort the nodes by key, keeping equal keys in order, with tmp[] as
+   scratch space of the same size. Single threaded.
+   The tree must have a key function. */
+void aatree_sort_nodes(aatree_t *t, aatree_node_t *nodes[],
+                       aatree_node_t *tmp[], size_t n);
+
+/* Call f for each node in the tree from 'threads' threads, in no
+   particular order. The tree is split into subtrees which are handed
+   out to the threads, with idle threads stealing work from busy ones.
+   If 'ordered' is true, f is instead called by one thread at a time, in
+   key order, while the other threads walk the subtrees ahead of it.
+   If f returns false for any node, the iteration stops as soon as
+   possible and false is returned, otherwise true.
+   The tree must not be modified during the call. */
+bool aatree_each_parallel(aatree_t *t, bool (*f)(aatree_t *, aatree_node_t *),
+                          unsigned threads, bool ordered);
+
+/* Creates a new accumulator for aatree_reduce_parallel() */
+typedef void *aatree_reduce_init_fun_t(aatree_t *, void *arg);
+/* Adds a node to an accumulator */
+typedef void aatree_reduce_fold_fun_t(aatree_t *, void *acc, aatree_node_t *);
+/* Adds 'other' to 'acc', and frees 'other' */
+typedef void aatree_reduce_combine_fun_t(aatree_t *, void *acc, void *other);
+
+/* Reduce the tree to a single accumulator, using 'threads' threads.
+   Each thread folds the nodes of the subtrees it gets into accumulators
+   of its own, which are then combined.
+   If 'ordered' is true, every subtree gets its own accumulator, in which
+   the nodes are folded in key order, and these are combined in key order,
+   i.e. 'acc' always precedes 'other'. Otherwise, the order is undefined,
+   and fewer accumulators are created.
+   Returns the final accumulator, or NULL if memory could not be
+   allocated. */
+void *aatree_reduce_parallel(aatree_t *t,
+                             aatree_reduce_init_fun_t *init,
+                             aatree_reduce_fold_fun_t *fold,
+                             aatree_reduce_combine_fun_t *combine,
+                             void *arg, unsigned threads, bool ordered);
+
+/* Detach all nodes from the tree, which is empty on return, and release
+   them with aatree_clear() in a new thread. 'release' is called with a
+   copy of the aatree_t, not t, since t may be gone by then.
+   Returns false if no thread could be started, in which case the nodes
+   are released before returning. */
+bool aatree_clear_background(aatree_t *t, aatree_release_fun_t *release);
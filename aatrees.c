@@ -0,0 +1,582 @@
+/*
+** pem 2026-10-19
+**
+** Sharded trees. Lock order: the route lock, then the shard locks in
+** increasing order.
+**
+** Nothing is written to memory shared by all threads when inserting or
+** looking up, neither the route lock nor a total count, so the threads
+** only meet on the shards.
+**
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "aatrees.h"
+#include "aatreep.h"
+
+/* Don't rebalance unless a shard has at least this many more nodes than
+   twice the average. This is also how often (in insertions) a shard is
+   checked. */
+#define AATREES_SKEW_MIN 1024
+
+/* The slot of this thread in the readers of route locks */
+static atomic_uint reader_next;
+static _Thread_local unsigned reader_slot;
+static _Thread_local bool reader_slotted;
+
+static aatrees_readers_t *
+readers(aatrees_t *s)
+{
+    if (! reader_slotted)
+    {
+        reader_slot = atomic_fetch_add(&reader_next, 1) %
+            AATREES_READER_SLOTS;
+        reader_slotted = true;
+    }
+    return &s->readers[reader_slot];
+}
+
+/* Take the route lock for reading, if range routed. If a writer is
+   changing the ranges, wait for it on its mutex. */
+static void
+route_rdlock(aatrees_t *s)
+{
+    if (s->keycmp == NULL)
+        return;
+
+    aatrees_readers_t *r = readers(s);
+
+    for (;;)
+    {
+        atomic_fetch_add(&r->n, 1);
+        if (! atomic_load(&s->changing))
+            return;
+        atomic_fetch_sub(&r->n, 1);
+        pthread_mutex_lock(&s->changelock);
+        pthread_mutex_unlock(&s->changelock);
+    }
+}
+
+static void
+route_rdunlock(aatrees_t *s)
+{
+    if (s->keycmp != NULL)
+        atomic_fetch_sub_explicit(&readers(s)->n, 1, memory_order_release);
+}
+
+/* Only for range routing */
+static void
+route_wrlock(aatrees_t *s)
+{
+    pthread_mutex_lock(&s->changelock);
+    atomic_store(&s->changing, true);
+    for (unsigned i = 0 ; i < AATREES_READER_SLOTS ; i++)
+        while (atomic_load(&s->readers[i].n) > 0)
+            sched_yield();
+}
+
+static void
+route_wrunlock(aatrees_t *s)
+{
+    atomic_store(&s->changing, false);
+    pthread_mutex_unlock(&s->changelock);
+}
+
+aatrees_t *
+aatrees_create(uint32_t nshards,
+               aatree_compare_fun_t *compare,
+               aatree_swap_fun_t *swap,
+               aatree_key_fun_t *key,
+               aatrees_hash_fun_t *hash,
+               aatrees_keycmp_fun_t *keycmp,
+               aatrees_keydup_fun_t *keydup)
+{
+    aatrees_t *s;
+
+    if (nshards == 0 || key == NULL || (hash == NULL) == (keycmp == NULL) ||
+        (keycmp != NULL && keydup == NULL))
+        return NULL;
+    if ((s = aligned_alloc(_Alignof(aatrees_t), sizeof(aatrees_t))) == NULL)
+        return NULL;
+    memset(s, 0, sizeof(aatrees_t));
+    s->shard = aligned_alloc(_Alignof(aatrees_shard_t),
+                             nshards * sizeof(aatrees_shard_t));
+    s->range = calloc(nshards, sizeof(aatrees_range_t));
+    if (s->shard == NULL || s->range == NULL)
+    {
+        free(s->shard);
+        free(s->range);
+        free(s);
+        return NULL;
+    }
+    memset(s->shard, 0, nshards * sizeof(aatrees_shard_t));
+    s->nshards = nshards;
+    s->hash = hash;
+    s->keycmp = keycmp;
+    s->keydup = keydup;
+    for (unsigned i = 0 ; i < AATREES_READER_SLOTS ; i++)
+        atomic_init(&s->readers[i].n, 0);
+    atomic_init(&s->changing, false);
+    pthread_mutex_init(&s->changelock, NULL);
+    s->nranges = 1;             /* Everything goes to shard 0 at first */
+    for (uint32_t i = 0 ; i < nshards ; i++)
+    {
+        aatrees_shard_t *sh = &s->shard[i];
+
+        sh->tree.compare = compare;
+        sh->tree.swap = swap;
+        sh->tree.key = key;
+        pthread_rwlock_init(&sh->lock, NULL);
+        atomic_init(&sh->count, 0);
+    }
+    return s;
+}
+
+void
+aatrees_destroy(aatrees_t *s)
+{
+    for (uint32_t i = 0 ; i < s->nshards ; i++)
+        pthread_rwlock_destroy(&s->shard[i].lock);
+    pthread_mutex_destroy(&s->changelock);
+    for (uint32_t i = 1 ; i < s->nranges ; i++)
+        free(s->range[i].low);
+    free(s->range);
+    free(s->shard);
+    free(s);
+}
+
+/* The route lock must be held */
+static uint32_t
+route(aatrees_t *s, void *keyp)
+{
+    if (s->hash != NULL)
+        return (uint32_t)(s->hash(s, keyp) % s->nshards);
+
+    /* Find the last range with low <= key; range[0] has no low */
+    uint32_t lo = 1, hi = s->nranges;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (s->keycmp(s, keyp, s->range[mid].low) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return s->range[lo-1].shard;
+}
+
+/* Move a node removed from one shard to another.
+   Returns the key of the moved node. */
+static void *
+move_node(aatrees_shard_t *from, aatrees_shard_t *to, aatree_node_t *n)
+{
+    void *keyp = to->tree.key(&to->tree, n);
+
+    atomic_fetch_sub_explicit(&from->count, 1, memory_order_relaxed);
+    aatree_init_node(n);
+    aatree_insert_node(&to->tree, keyp, n);
+    atomic_fetch_add_explicit(&to->count, 1, memory_order_relaxed);
+    return keyp;
+}
+
+static void *
+move_last(aatrees_shard_t *from, aatrees_shard_t *to)
+{
+    return move_node(from, to, aatree_pop_max(&from->tree));
+}
+
+static void *
+move_first(aatrees_shard_t *from, aatrees_shard_t *to)
+{
+    return move_node(from, to, aatree_pop_min(&from->tree));
+}
+
+static size_t
+shard_count(aatrees_shard_t *sh)
+{
+    return atomic_load_explicit(&sh->count, memory_order_relaxed);
+}
+
+/* Recompute the ranges from copies of the shards' lowest keys. A shard
+   whose key can't be copied is emptied into the one before it, which
+   then covers its range.
+   The route lock must be held for writing. */
+static void
+set_ranges(aatrees_t *s)
+{
+    for (uint32_t i = 1 ; i < s->nranges ; i++)
+        free(s->range[i].low);
+    s->nranges = 1;
+    for (uint32_t i = 1 ; i < s->nshards ; i++)
+    {
+        aatrees_shard_t *sh = &s->shard[i];
+        aatree_node_t *n = aatree_min(&sh->tree);
+        void *low;
+
+        if (n == NULL)
+            continue;
+        if ((low = s->keydup(s, sh->tree.key(&sh->tree, n))) == NULL)
+        {
+            aatrees_shard_t *prev = &s->shard[s->range[s->nranges-1].shard];
+
+            while (sh->tree.root != NULL)
+                (void)move_first(sh, prev);
+            continue;
+        }
+        s->range[s->nranges].low = low;
+        s->range[s->nranges].shard = i;
+        s->nranges += 1;
+    }
+}
+
+/* The route lock must be held for writing, which means no one else
+   is using any shard. */
+static void
+rebalance(aatrees_t *s)
+{
+    size_t target = (aatrees_count(s) + s->nshards - 1) / s->nshards;
+
+    for (uint32_t i = 0 ; i+1 < s->nshards ; i++)
+    {
+        aatrees_shard_t *sh = &s->shard[i];
+
+        if (shard_count(sh) > target)
+            while (shard_count(sh) > target)
+            {
+                void *keyp = move_last(sh, sh+1);
+
+                /* Duplicates must stay in the same shard */
+                while (sh->tree.root != NULL &&
+                       sh->tree.compare(&sh->tree, keyp,
+                                        aatree_max(&sh->tree)) == 0)
+                    (void)move_last(sh, sh+1);
+            }
+        else
+        {
+            uint32_t j = i+1;
+
+            while (shard_count(sh) < target)
+            {
+                while (j < s->nshards && shard_count(&s->shard[j]) == 0)
+                    j += 1;
+                if (j == s->nshards)
+                    break;
+
+                aatrees_shard_t *next = &s->shard[j];
+                void *keyp = move_first(next, sh);
+
+                while (next->tree.root != NULL &&
+                       next->tree.compare(&next->tree, keyp,
+                                          aatree_min(&next->tree)) == 0)
+                    (void)move_first(next, sh);
+            }
+        }
+    }
+    set_ranges(s);
+}
+
+void
+aatrees_rebalance(aatrees_t *s)
+{
+    if (s->keycmp == NULL)
+        return;
+    route_wrlock(s);
+    rebalance(s);
+    route_wrunlock(s);
+}
+
+static bool
+skewed(aatrees_t *s, size_t count)
+{
+    size_t avg = aatrees_count(s) / s->nshards;
+
+    return (count > 2*avg + AATREES_SKEW_MIN);
+}
+
+/* Rebalance if still skewed once we have the route lock */
+static void
+rebalance_skewed(aatrees_t *s)
+{
+    route_wrlock(s);
+    for (uint32_t i = 0 ; i < s->nshards ; i++)
+        if (skewed(s, shard_count(&s->shard[i])))
+        {
+            rebalance(s);
+            break;
+        }
+    route_wrunlock(s);
+}
+
+void
+aatrees_insert_node(aatrees_t *s, void *keyp, aatree_node_t *n)
+{
+    route_rdlock(s);
+
+    aatrees_shard_t *sh = &s->shard[route(s, keyp)];
+    size_t count;
+
+    pthread_rwlock_wrlock(&sh->lock);
+    aatree_insert_node(&sh->tree, keyp, n);
+    count = shard_count(sh) + 1;
+    atomic_store_explicit(&sh->count, count, memory_order_relaxed);
+    pthread_rwlock_unlock(&sh->lock);
+    route_rdunlock(s);
+    if (s->keycmp != NULL && count % AATREES_SKEW_MIN == 0 &&
+        skewed(s, count))
+        rebalance_skewed(s);
+}
+
+aatree_node_t *
+aatrees_remove_node(aatrees_t *s, void *keyp, aatree_condition_fun_t *cond)
+{
+    route_rdlock(s);
+
+    aatrees_shard_t *sh = &s->shard[route(s, keyp)];
+    aatree_node_t *n;
+
+    pthread_rwlock_wrlock(&sh->lock);
+    if ((n = aatree_remove_node(&sh->tree, keyp, cond)) != NULL)
+        atomic_store_explicit(&sh->count, shard_count(sh) - 1,
+                              memory_order_relaxed);
+    pthread_rwlock_unlock(&sh->lock);
+    route_rdunlock(s);
+    return n;
+}
+
+aatree_node_t *
+aatrees_find_key(aatrees_t *s, void *keyp, aatree_condition_fun_t *cond)
+{
+    route_rdlock(s);
+
+    aatrees_shard_t *sh = &s->shard[route(s, keyp)];
+    aatree_node_t *n;
+
+    pthread_rwlock_rdlock(&sh->lock);
+    n = aatree_find_key(&sh->tree, keyp, cond);
+    pthread_rwlock_unlock(&sh->lock);
+    route_rdunlock(s);
+    return n;
+}
+
+size_t
+aatrees_count(aatrees_t *s)
+{
+    size_t n = 0;
+
+    for (uint32_t i = 0 ; i < s->nshards ; i++)
+        n += shard_count(&s->shard[i]);
+    return n;
+}
+
+typedef struct batch_s
+{
+    aatrees_t *s;
+    aatree_node_t **nodes;
+    uint32_t *dest;             /* Shard per node */
+    size_t n;
+    size_t *start;              /* Per shard, into nodes, after sorting */
+    unsigned id, threads;
+} batch_t;
+
+static void *
+batch_route(void *arg)
+{
+    batch_t *b = arg;
+    aatree_t *t = &b->s->shard[0].tree;
+    size_t end = b->n * (b->id + 1) / b->threads;
+
+    for (size_t i = b->n * b->id / b->threads ; i < end ; i++)
+        b->dest[i] = route(b->s, t->key(t, b->nodes[i]));
+    return NULL;
+}
+
+static void *
+batch_insert(void *arg)
+{
+    batch_t *b = arg;
+
+    for (uint32_t i = b->id ; i < b->s->nshards ; i += b->threads)
+    {
+        aatrees_shard_t *sh = &b->s->shard[i];
+
+        pthread_rwlock_wrlock(&sh->lock);
+        for (size_t j = b->start[i] ; j < b->start[i+1] ; j++)
+        {
+            aatree_node_t *n = b->nodes[j];
+
+            aatree_insert_node(&sh->tree, sh->tree.key(&sh->tree, n), n);
+        }
+        atomic_store_explicit(&sh->count, shard_count(sh) +
+                              (b->start[i+1] - b->start[i]),
+                              memory_order_relaxed);
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    return NULL;
+}
+
+bool
+aatrees_insert_batch(aatrees_t *s, aatree_node_t *nodes[], size_t n,
+                     unsigned threads)
+{
+    uint32_t *dest = malloc(n * sizeof(uint32_t));
+    aatree_node_t **sorted = malloc(n * sizeof(aatree_node_t *));
+    size_t *start = calloc(s->nshards + 1, sizeof(size_t));
+    batch_t *args;
+
+    if (threads == 0)
+        threads = 1;
+    args = calloc(threads, sizeof(batch_t));
+    if (dest == NULL || sorted == NULL || start == NULL || args == NULL)
+    {
+        free(args);
+        free(start);
+        free(sorted);
+        free(dest);
+        return false;
+    }
+    route_rdlock(s);
+    for (unsigned i = 0 ; i < threads ; i++)
+    {
+        args[i].s = s;
+        args[i].nodes = nodes;
+        args[i].dest = dest;
+        args[i].n = n;
+        args[i].start = start;
+        args[i].id = i;
+        args[i].threads = threads;
+    }
+    aatree_run_tasks(batch_route, args, sizeof(batch_t), threads);
+
+    /* Counting sort by shard */
+    for (size_t i = 0 ; i < n ; i++)
+        start[dest[i]+1] += 1;
+    for (uint32_t i = 0 ; i < s->nshards ; i++)
+        start[i+1] += start[i];
+    for (size_t i = 0 ; i < n ; i++)
+        sorted[start[dest[i]]++] = nodes[i];
+    memmove(start+1, start, s->nshards * sizeof(size_t));
+    start[0] = 0;
+
+    for (unsigned i = 0 ; i < threads ; i++)
+        args[i].nodes = sorted;
+    aatree_run_tasks(batch_insert, args, sizeof(batch_t), threads);
+    route_rdunlock(s);
+
+    bool skew = false;
+
+    for (uint32_t i = 0 ; i < s->nshards && !skew && s->keycmp != NULL ; i++)
+        skew = skewed(s, shard_count(&s->shard[i]));
+    if (skew)
+        rebalance_skewed(s);
+    free(args);
+    free(start);
+    free(sorted);
+    free(dest);
+    return true;
+}
+
+/* True if the head of shard a comes before the head of shard b */
+static bool
+iter_before(aatrees_iter_t *iter, uint32_t a, uint32_t b)
+{
+    aatree_t *ta = &iter->s->shard[a].tree;
+    aatree_t *tb = &iter->s->shard[b].tree;
+    int cmp = tb->compare(tb, ta->key(ta, iter->head[a]), iter->head[b]);
+
+    return (cmp < 0 || (cmp == 0 && a < b));
+}
+
+static void
+iter_sift_down(aatrees_iter_t *iter, uint32_t i)
+{
+    for (;;)
+    {
+        uint32_t least = i, l = 2*i + 1, r = 2*i + 2;
+
+        if (l < iter->n && iter_before(iter, iter->heap[l], iter->heap[least]))
+            least = l;
+        if (r < iter->n && iter_before(iter, iter->heap[r], iter->heap[least]))
+            least = r;
+        if (least == i)
+            break;
+
+        uint32_t tmp = iter->heap[i];
+
+        iter->heap[i] = iter->heap[least];
+        iter->heap[least] = tmp;
+        i = least;
+    }
+}
+
+static void
+unlock_all(aatrees_t *s)
+{
+    for (uint32_t i = 0 ; i < s->nshards ; i++)
+        pthread_rwlock_unlock(&s->shard[i].lock);
+    route_rdunlock(s);
+}
+
+bool
+aatrees_iter_init(aatrees_t *s, aatrees_iter_t *iter)
+{
+    memset(iter, 0, sizeof(aatrees_iter_t));
+    iter->s = s;
+    iter->heap = malloc(s->nshards * sizeof(uint32_t));
+    iter->head = malloc(s->nshards * sizeof(aatree_node_t *));
+    iter->iter = malloc(s->nshards * sizeof(aatree_iter_t));
+    if (iter->heap == NULL || iter->head == NULL || iter->iter == NULL)
+    {
+        free(iter->iter);
+        free(iter->head);
+        free(iter->heap);
+        return false;
+    }
+    route_rdlock(s);
+    for (uint32_t i = 0 ; i < s->nshards ; i++)
+        pthread_rwlock_rdlock(&s->shard[i].lock);
+    for (uint32_t i = 0 ; i < s->nshards ; i++)
+    {
+        if (! aatree_iter_init(&s->shard[i].tree, &iter->iter[i]))
+        {
+            unlock_all(s);
+            free(iter->iter);
+            free(iter->head);
+            free(iter->heap);
+            return false;
+        }
+        if ((iter->head[i] = aatree_iter_next(&iter->iter[i])) != NULL)
+            iter->heap[iter->n++] = i;
+    }
+    for (uint32_t i = iter->n / 2 ; i > 0 ; i--)
+        iter_sift_down(iter, i-1);
+    return true;
+}
+
+aatree_node_t *
+aatrees_iter_next(aatrees_iter_t *iter)
+{
+    if (iter->n == 0)
+        return NULL;
+
+    uint32_t i = iter->heap[0];
+    aatree_node_t *n = iter->head[i];
+
+    if ((iter->head[i] = aatree_iter_next(&iter->iter[i])) == NULL)
+        iter->heap[0] = iter->heap[--iter->n];
+    iter_sift_down(iter, 0);
+    return n;
+}
+
+void
+aatrees_iter_fini(aatrees_iter_t *iter)
+{
+    unlock_all(iter->s);
+    free(iter->iter);
+    free(iter->head);
+    free(iter->heap);
+}
@@ -0,0 +1,142 @@
+/*
+** pem 2026-10-19
+**
+** A sharded tree: the key space is partitioned over a number of
+** sub-trees, each with its own lock, so that several threads can insert
+** and look up concurrently.
+**
+** Keys are routed either by hash, or by range. In the latter case the
+** shard boundaries are moved by aatrees_rebalance() (which is also done
+** automatically when the shards get too skewed), and each shard holds
+** a contiguous range of keys. The boundaries are copies of keys, kept
+** by the tree, and behind a route lock that readers take without
+** writing to any shared cache line. Hash routing needs no route lock.
+**
+** The compare, swap and key functions are called with the shard's tree
+** as the first argument, and the key function is mandatory.
+**
+*/
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "aatree.h"
+
+typedef struct aatrees_s aatrees_t;
+
+/* Hash routing: return a hash value for the key. */
+typedef uint64_t aatrees_hash_fun_t(aatrees_t *, void *keyp);
+/* Range routing: compare two keys, with the same sign convention as
+   the tree's compare function. */
+typedef int aatrees_keycmp_fun_t(aatrees_t *, void *akeyp, void *bkeyp);
+/* Range routing: return a copy of the key, allocated with malloc(), to
+   keep as a shard boundary, or NULL if out of memory. */
+typedef void *aatrees_keydup_fun_t(aatrees_t *, void *keyp);
+
+/* In cache lines of their own, not to be shared between shards */
+typedef struct aatrees_shard_s
+{
+    _Alignas(64) aatree_t tree;
+    pthread_rwlock_t lock;
+    atomic_size_t count;        /* Changed with the lock held */
+} aatrees_shard_t;
+
+/* A shard's key range, ordered by 'low' */
+typedef struct aatrees_range_s
+{
+    void *low;                  /* A copy, NULL for the first range */
+    uint32_t shard;
+} aatrees_range_t;
+
+/* A part of the route lock's reader count, in a cache line of its own */
+typedef struct aatrees_readers_s
+{
+    _Alignas(64) atomic_uint n;
+} aatrees_readers_t;
+
+#define AATREES_READER_SLOTS 64
+
+struct aatrees_s
+{
+    uint32_t nshards;
+    aatrees_hash_fun_t *hash;
+    aatrees_keycmp_fun_t *keycmp;
+    aatrees_keydup_fun_t *keydup;
+    /* The route lock, for range routing: held for reading during all
+       operations, and for writing when the ranges are changed. Always
+       taken before any shard lock. Each thread counts itself as a
+       reader in one of the slots, and a writer holds 'changelock' and
+       sets 'changing', then waits for all the slots to be 0. */
+    aatrees_readers_t readers[AATREES_READER_SLOTS];
+    atomic_bool changing;
+    pthread_mutex_t changelock;
+    uint32_t nranges;
+    aatrees_range_t *range;
+    aatrees_shard_t *shard;
+};
+
+typedef struct aatrees_iter_s
+{
+    aatrees_t *s;
+    uint32_t n;                 /* Number of shards in the heap */
+    uint32_t *heap;             /* Shard numbers, ordered by head */
+    aatree_node_t **head;       /* The next node in each shard */
+    aatree_iter_t *iter;        /* One per shard */
+} aatrees_iter_t;
+
+/* Create a sharded tree. Exactly one of 'hash' and 'keycmp' must be
+   given, and selects hash or range routing, which also needs 'keydup'.
+   'key' must not be NULL.
+   Returns NULL on failure. */
+aatrees_t *aatrees_create(uint32_t nshards,
+                          aatree_compare_fun_t *compare,
+                          aatree_swap_fun_t *swap,
+                          aatree_key_fun_t *key,
+                          aatrees_hash_fun_t *hash,
+                          aatrees_keycmp_fun_t *keycmp,
+                          aatrees_keydup_fun_t *keydup);
+
+/* Free the shards. The nodes are not touched, they must have been
+   removed or be otherwise taken care of by the caller. */
+void aatrees_destroy(aatrees_t *s);
+
+/* Insert the node into the tree. */
+void aatrees_insert_node(aatrees_t *s, void *keyp, aatree_node_t *n);
+
+/* Insert 'n' nodes, in any order, using 'threads' threads. The nodes'
+   keys are taken with the key function.
+   Returns false if memory could not be allocated, in which case none of
+   the nodes are inserted. */
+bool aatrees_insert_batch(aatrees_t *s, aatree_node_t *nodes[], size_t n,
+                          unsigned threads);
+
+/* As aatree_remove_node() */
+aatree_node_t *aatrees_remove_node(aatrees_t *s, void *keyp,
+                                   aatree_condition_fun_t *cond);
+
+/* As aatree_find_key(). Note that the node is no longer protected by
+   the shard lock once this returns. */
+aatree_node_t *aatrees_find_key(aatrees_t *s, void *keyp,
+                                aatree_condition_fun_t *cond);
+
+/* Move nodes between the shards so they get roughly the same number
+   of nodes. Only has an effect for range routed trees. If a boundary
+   can't be copied, for lack of memory, the shard's nodes are left in
+   the shard before it. */
+void aatrees_rebalance(aatrees_t *s);
+
+/* Returns the total number of nodes. */
+size_t aatrees_count(aatrees_t *s);
+
+/* Initialize an iterator over all nodes in global key order.
+   All shards are read locked until aatrees_iter_fini() is called,
+   so the same thread must not modify the tree in between.
+   Returns false if memory could not be allocated, or a shard is too
+   deep for an iterator. */
+bool aatrees_iter_init(aatrees_t *s, aatrees_iter_t *iter);
+/* Get the next node from the iterator, or NULL when there is no more. */
+aatree_node_t *aatrees_iter_next(aatrees_iter_t *iter);
+/* Release the iterator and the shard locks. */
+void aatrees_iter_fini(aatrees_iter_t *iter);
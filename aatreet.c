@@ -0,0 +1,387 @@
+/*
+** pem 2026-10-19
+**
+** The tsearch(3) family on an AA tree, with pooled nodes.
+**
+*/
+
+#ifdef AATREE_TSEARCH
+#define _GNU_SOURCE             /* For twalk_r() and tdestroy() */
+#include <search.h>
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "aatree.h"
+#include "aatreet.h"
+
+#define UNUSED(x) ((void)(x))
+
+/* The first slab has room for SLAB_MIN nodes, and each new one for
+   twice as many as the last, up to SLAB_MAX. */
+#define SLAB_MIN 16
+#define SLAB_MAX 4096
+
+typedef struct tnode_s
+{
+    /* First, since the callers get the key by dereferencing the node */
+    union
+    {
+        const void *key;
+        struct tnode_s *next;   /* When on the free list */
+    };
+    aatree_node_t n;
+} tnode_t;
+
+typedef struct slab_s
+{
+    struct slab_s *next;
+    size_t size;                /* Number of nodes */
+    tnode_t node[];
+} slab_t;
+
+typedef struct ttree_s
+{
+    aatree_t base;              /* Must be first */
+    aatreet_compare_fun_t *compar; /* From the latest call */
+    void (*freefun)(void *);    /* For aatreet_destroy() */
+    tnode_t *free;              /* Deleted nodes, for reuse */
+    slab_t *slab;               /* The newest first */
+    size_t used;                /* Nodes handed out from the newest slab */
+} ttree_t;
+
+typedef void walk_fun_t(const void *nodep, aatreet_visit_t which, int depth,
+                        void *closure);
+
+static inline tnode_t *
+tnode(const aatree_node_t *n)
+{
+    return (tnode_t *)((char *)n - offsetof(tnode_t, n));
+}
+
+static int
+tcompare(aatree_t *t, void *keyp, aatree_node_t *n)
+{
+    return ((ttree_t *)t)->compar(keyp, tnode(n)->key);
+}
+
+static void *
+tkey(aatree_t *t, aatree_node_t *n)
+{
+    UNUSED(t);
+    return (void *)tnode(n)->key;
+}
+
+static ttree_t *
+tree_create(void)
+{
+    ttree_t *tree = calloc(1, sizeof(ttree_t));
+
+    if (tree == NULL)
+        return NULL;
+    /* No swap function: deletions relink the nodes, so that the node
+       pointers handed out stay valid */
+    tree->base.compare = tcompare;
+    tree->base.key = tkey;
+    return tree;
+}
+
+static void
+tree_free(ttree_t *tree)
+{
+    slab_t *slab = tree->slab;
+
+    while (slab != NULL)
+    {
+        slab_t *next = slab->next;
+
+        free(slab);
+        slab = next;
+    }
+    free(tree);
+}
+
+static tnode_t *
+node_alloc(ttree_t *tree)
+{
+    tnode_t *n = tree->free;
+
+    if (n != NULL)
+        tree->free = n->next;
+    else
+    {
+        if (tree->slab == NULL || tree->used == tree->slab->size)
+        {
+            size_t size = (tree->slab == NULL ? SLAB_MIN :
+                           tree->slab->size < SLAB_MAX ?
+                           2 * tree->slab->size : SLAB_MAX);
+            slab_t *slab = malloc(sizeof(slab_t) + size * sizeof(tnode_t));
+
+            if (slab == NULL)
+                return NULL;
+            slab->next = tree->slab;
+            slab->size = size;
+            tree->slab = slab;
+            tree->used = 0;
+        }
+        n = &tree->slab->node[tree->used++];
+    }
+    aatree_init_node(&n->n);
+    return n;
+}
+
+static inline void
+node_free(ttree_t *tree, tnode_t *n)
+{
+    n->next = tree->free;
+    tree->free = n;
+}
+
+void *
+aatreet_search(const void *key, void **rootp, aatreet_compare_fun_t *compar)
+{
+    ttree_t *tree;
+    tnode_t *n;
+    aatree_node_t *x;
+
+    if (rootp == NULL)
+        return NULL;
+    if ((tree = *rootp) == NULL)
+    {
+        if ((tree = tree_create()) == NULL)
+            return NULL;
+        *rootp = tree;
+    }
+    tree->compar = compar;
+    if ((n = node_alloc(tree)) == NULL)
+    {
+        if (tree->base.root == NULL)
+        {
+            tree_free(tree);
+            *rootp = NULL;
+        }
+        return NULL;
+    }
+    n->key = key;
+    /* Allocating first saves a descent, and is cheap to undo */
+    x = aatree_insert_unique_node(&tree->base, (void *)key, &n->n);
+    if (x != NULL)
+    {
+        node_free(tree, n);
+        return tnode(x);
+    }
+    return n;
+}
+
+void *
+aatreet_find(const void *key, void *const *rootp,
+             aatreet_compare_fun_t *compar)
+{
+    ttree_t *tree;
+    aatree_node_t *x;
+
+    if (rootp == NULL || (tree = *rootp) == NULL)
+        return NULL;
+    tree->compar = compar;
+    if ((x = aatree_find_key(&tree->base, (void *)key, NULL)) == NULL)
+        return NULL;
+    return tnode(x);
+}
+
+void *
+aatreet_delete(const void *key, void **rootp, aatreet_compare_fun_t *compar)
+{
+    ttree_t *tree;
+    aatree_node_t *x, *parent;
+
+    if (rootp == NULL || (tree = *rootp) == NULL)
+        return NULL;
+    tree->compar = compar;
+    x = aatree_unlink_node(&tree->base, (void *)key, NULL, &parent);
+    if (x == NULL)
+        return NULL;
+    if (tree->base.root == NULL)
+    {
+        tree_free(tree);
+        *rootp = NULL;
+        return rootp;
+    }
+    node_free(tree, tnode(x));
+    /* Like glibc, a pointer that mustn't be dereferenced for the root */
+    return (parent == NULL ? (void *)rootp : tnode(parent));
+}
+
+static void
+walk(const aatree_node_t *n, walk_fun_t *fun, void *closure, int depth)
+{
+    const aatree_node_t *left = aatree_get_left(n);
+    const aatree_node_t *right = aatree_get_right(n);
+    const void *nodep = tnode(n);
+
+    if (left == NULL && right == NULL)
+    {
+        fun(nodep, aatreet_leaf, depth, closure);
+        return;
+    }
+    fun(nodep, aatreet_preorder, depth, closure);
+    if (left != NULL)
+        walk(left, fun, closure, depth + 1);
+    fun(nodep, aatreet_postorder, depth, closure);
+    if (right != NULL)
+        walk(right, fun, closure, depth + 1);
+    fun(nodep, aatreet_endorder, depth, closure);
+}
+
+static void
+walk_root(const void *root, walk_fun_t *fun, void *closure)
+{
+    const ttree_t *tree = root;
+
+    if (tree != NULL && tree->base.root != NULL)
+        walk(tree->base.root, fun, closure, 0);
+}
+
+/* Function pointers can't be passed as void pointers, so they are
+   passed in these */
+typedef struct
+{
+    aatreet_action_fun_t *action;
+} walk_closure_t;
+
+typedef struct
+{
+    aatreet_action_r_fun_t *action;
+    void *closure;
+} walk_r_closure_t;
+
+static void
+walk_action(const void *nodep, aatreet_visit_t which, int depth,
+            void *closure)
+{
+    ((walk_closure_t *)closure)->action(nodep, which, depth);
+}
+
+static void
+walk_r_action(const void *nodep, aatreet_visit_t which, int depth,
+              void *closure)
+{
+    walk_r_closure_t *c = closure;
+
+    UNUSED(depth);
+    c->action(nodep, which, c->closure);
+}
+
+void
+aatreet_walk(const void *root, aatreet_action_fun_t *action)
+{
+    walk_closure_t c = { .action = action };
+
+    walk_root(root, walk_action, &c);
+}
+
+void
+aatreet_walk_r(const void *root, aatreet_action_r_fun_t *action,
+               void *closure)
+{
+    walk_r_closure_t c = { .action = action, .closure = closure };
+
+    walk_root(root, walk_r_action, &c);
+}
+
+static void
+release(aatree_t *t, aatree_node_t *n)
+{
+    ((ttree_t *)t)->freefun((void *)tnode(n)->key);
+}
+
+void
+aatreet_destroy(void *root, void (*freefun)(void *))
+{
+    ttree_t *tree = root;
+
+    if (tree == NULL)
+        return;
+    if (freefun != NULL)
+    {
+        tree->freefun = freefun;
+        aatree_clear(&tree->base, release);
+    }
+    tree_free(tree);
+}
+
+#ifdef AATREE_TSEARCH
+
+void *
+tsearch(const void *key, void **rootp,
+        int (*compar)(const void *, const void *))
+{
+    return aatreet_search(key, rootp, compar);
+}
+
+void *
+tfind(const void *key, void *const *rootp,
+      int (*compar)(const void *, const void *))
+{
+    return aatreet_find(key, rootp, compar);
+}
+
+void *
+tdelete(const void *restrict key, void **restrict rootp,
+        int (*compar)(const void *, const void *))
+{
+    return aatreet_delete(key, rootp, compar);
+}
+
+typedef struct
+{
+    void (*action)(const void *, VISIT, int);
+} twalk_closure_t;
+
+typedef struct
+{
+    void (*action)(const void *, VISIT, void *);
+    void *closure;
+} twalk_r_closure_t;
+
+static void
+twalk_action(const void *nodep, aatreet_visit_t which, int depth,
+             void *closure)
+{
+    ((twalk_closure_t *)closure)->action(nodep, (VISIT)which, depth);
+}
+
+static void
+twalk_r_action(const void *nodep, aatreet_visit_t which, int depth,
+               void *closure)
+{
+    twalk_r_closure_t *c = closure;
+
+    UNUSED(depth);
+    c->action(nodep, (VISIT)which, c->closure);
+}
+
+void
+twalk(const void *root, void (*action)(const void *, VISIT, int))
+{
+    twalk_closure_t c = { .action = action };
+
+    walk_root(root, twalk_action, &c);
+}
+
+void
+twalk_r(const void *root, void (*action)(const void *, VISIT, void *),
+        void *closure)
+{
+    twalk_r_closure_t c = { .action = action, .closure = closure };
+
+    walk_root(root, twalk_r_action, &c);
+}
+
+void
+tdestroy(void *root, void (*freefun)(void *))
+{
+    aatreet_destroy(root, freefun);
+}
+
+#endif /* AATREE_TSEARCH */
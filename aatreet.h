@@ -0,0 +1,73 @@
+/*
+** pem 2026-10-19
+**
+** The tsearch(3) family of functions on an AA tree, with the same
+** signatures and behaviour, plus twalk_r() and tdestroy() as in glibc.
+** The nodes are allocated from a pool in each tree instead of one malloc
+** per node, which makes them smaller and insertions faster.
+**
+** As with tsearch(3), the root is a void pointer which must be NULL for
+** an empty tree, and is set back to NULL when the last key is deleted.
+** It points to the tree's head, not to a node, so it must only be passed
+** to these functions. A node pointer returned points to the key pointer,
+** just like glibc's, and stays valid until that key is deleted, since
+** deletions relink the nodes instead of moving keys between them. The
+** memory of deleted nodes is reused, and freed when the tree becomes
+** empty.
+**
+** With AATREE_TSEARCH defined when compiling aatreet.c, the library also
+** defines tsearch(), tfind(), tdelete(), twalk(), twalk_r() and
+** tdestroy(), so that existing programs can be relinked onto it.
+**
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+/* The same values as VISIT in <search.h> */
+typedef enum
+{
+    aatreet_preorder,           /* Before the left subtree */
+    aatreet_postorder,          /* After the left, before the right */
+    aatreet_endorder,           /* After the right subtree */
+    aatreet_leaf                /* A node without children */
+} aatreet_visit_t;
+
+typedef int aatreet_compare_fun_t(const void *, const void *);
+typedef void aatreet_action_fun_t(const void *nodep, aatreet_visit_t which,
+                                  int depth);
+typedef void aatreet_action_r_fun_t(const void *nodep, aatreet_visit_t which,
+                                    void *closure);
+
+/* Find the key, or insert it if not found. The tree is created if *rootp
+   is NULL.
+   Returns the node with the key, or NULL if memory could not be
+   allocated. */
+void *aatreet_search(const void *key, void **rootp,
+                     aatreet_compare_fun_t *compar);
+
+/* Returns the node with the key, or NULL if not found. */
+void *aatreet_find(const void *key, void *const *rootp,
+                   aatreet_compare_fun_t *compar);
+
+/* Delete the key from the tree, setting *rootp to NULL if it was the
+   last one. The key itself is not freed.
+   Returns NULL if not found. Otherwise, as glibc, it returns the parent
+   of the deleted node, or a pointer that must not be dereferenced if
+   the root was deleted. */
+void *aatreet_delete(const void *key, void **rootp,
+                     aatreet_compare_fun_t *compar);
+
+/* Call 'action' on each node, depth first from the root at depth 0:
+   with aatreet_preorder, aatreet_postorder and aatreet_endorder for a
+   node with children, and aatreet_leaf for one without. The keys are in
+   order at aatreet_postorder and aatreet_leaf. */
+void aatreet_walk(const void *root, aatreet_action_fun_t *action);
+
+/* As aatreet_walk(), passing 'closure' instead of the depth. */
+void aatreet_walk_r(const void *root, aatreet_action_r_fun_t *action,
+                    void *closure);
+
+/* Free the tree, calling 'freefun' (if not NULL) on each key. */
+void aatreet_destroy(void *root, void (*freefun)(void *));
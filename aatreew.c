@@ -0,0 +1,126 @@
+/*
+** pem 2026-10-19
+**
+** Write buffer in front of a tree.
+**
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aatreew.h"
+
+bool
+aatreew_init(aatreew_t *w, aatree_t *t, size_t size)
+{
+    if (size == 0)
+        size = 1;
+    w->t = t;
+    w->n = 0;
+    w->size = size;
+    w->buf = malloc(size * sizeof(aatree_node_t *));
+    return (w->buf != NULL);
+}
+
+void
+aatreew_fini(aatreew_t *w)
+{
+    aatreew_flush(w);
+    free(w->buf);
+    w->buf = NULL;
+    w->size = 0;
+}
+
+/* Returns the index of the first node in the buffer with a key that is
+   greater than (or, if 'equal', equal to) keyp, or n */
+static size_t
+buf_bound(aatreew_t *w, void *keyp, bool equal)
+{
+    aatree_t *t = w->t;
+    size_t lo = 0, hi = w->n;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = t->compare(t, keyp, w->buf[mid]);
+
+        if (cmp > 0 || (cmp == 0 && ! equal))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* After any equal keys, so they stay in the order they were added */
+void
+aatreew_insert_node(aatreew_t *w, aatree_node_t *n)
+{
+    size_t i;
+
+    if (w->n == w->size)
+        aatreew_flush(w);
+    i = buf_bound(w, w->t->key(w->t, n), false);
+    memmove(&w->buf[i+1], &w->buf[i], (w->n - i) * sizeof(aatree_node_t *));
+    w->buf[i] = n;
+    w->n += 1;
+}
+
+void
+aatreew_flush(aatreew_t *w)
+{
+    aatree_insert_sorted(w->t, w->buf, w->n);
+    w->n = 0;
+}
+
+/* Returns the index of the first matching node in the buffer, or n */
+static size_t
+buf_find(aatreew_t *w, void *keyp, aatree_condition_fun_t *cond)
+{
+    aatree_t *t = w->t;
+    size_t i;
+
+    for (i = buf_bound(w, keyp, true) ; i < w->n ; i++)
+    {
+        if (t->compare(t, keyp, w->buf[i]) != 0)
+            return w->n;
+        if (cond == NULL || cond(t, w->buf[i]))
+            break;
+    }
+    return i;
+}
+
+aatree_node_t *
+aatreew_find_key(aatreew_t *w, void *keyp, aatree_condition_fun_t *cond)
+{
+    aatree_node_t *n = aatree_find_key(w->t, keyp, cond);
+
+    if (n == NULL)
+    {
+        size_t i = buf_find(w, keyp, cond);
+
+        if (i < w->n)
+            n = w->buf[i];
+    }
+    return n;
+}
+
+aatree_node_t *
+aatreew_remove_node(aatreew_t *w, void *keyp, aatree_condition_fun_t *cond)
+{
+    aatree_node_t *n = aatree_remove_node(w->t, keyp, cond);
+
+    if (n == NULL)
+    {
+        size_t i = buf_find(w, keyp, cond);
+
+        if (i < w->n)
+        {
+            n = w->buf[i];
+            w->n -= 1;
+            memmove(&w->buf[i], &w->buf[i+1],
+                    (w->n - i) * sizeof(aatree_node_t *));
+        }
+    }
+    return n;
+}
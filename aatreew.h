@@ -0,0 +1,49 @@
+/*
+** pem 2026-10-19
+**
+** A write buffer in front of a tree, for bursts of insertions. Nodes
+** are added to the buffer, which is kept in key order, and inserted
+** into the tree in one go when it fills up, so the rebalancing is done
+** once per batch instead of once per node when the batch is large
+** enough compared to the tree.
+**
+** Lookups and removals check both the tree and the buffer, which is
+** searched by bisection. Adding a node moves the ones after it in the
+** buffer, so very large buffers make insertions slower. To iterate over
+** the tree, flush the buffer first.
+**
+*/
+
+#pragma once
+
+#include "aatree.h"
+
+typedef struct aatreew_s
+{
+    aatree_t *t;                /* Must have a key function */
+    size_t n;                   /* Nodes in the buffer */
+    size_t size;
+    aatree_node_t **buf;        /* In key order */
+} aatreew_t;
+
+/* Initialize a buffer of 'size' nodes in front of t.
+   Returns false if memory could not be allocated. */
+bool aatreew_init(aatreew_t *w, aatree_t *t, size_t size);
+
+/* Flush the buffer, and free it. */
+void aatreew_fini(aatreew_t *w);
+
+/* Add the node to the buffer, flushing it first if it's full. */
+void aatreew_insert_node(aatreew_t *w, aatree_node_t *n);
+
+/* Insert the buffered nodes into the tree. Equal keys end up in the
+   order they were added. */
+void aatreew_flush(aatreew_t *w);
+
+/* As aatree_find_key(), looking in the tree first, then the buffer. */
+aatree_node_t *aatreew_find_key(aatreew_t *w, void *keyp,
+                                aatree_condition_fun_t *cond);
+
+/* As aatree_remove_node(), looking in the tree first, then the buffer. */
+aatree_node_t *aatreew_remove_node(aatreew_t *w, void *keyp,
+                                   aatree_condition_fun_t *cond);
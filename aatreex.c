@@ -0,0 +1,701 @@
+/*
+** pem 2026-10-19
+**
+** An AA tree in shared memory, with offset links, an undo log for
+** crash consistency, and a sequence lock for the readers.
+**
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aatreex.h"
+
+#define UNUSED(x) ((void)(x))
+
+/* "aatreex" and the layout version */
+#define XMAGIC 0x6161747265657801
+/* Blocks are 32 << k bytes, for k in [0, XCLASSES) */
+#define XCLASSES 40
+#define XMIN_BLOCK 32
+/* An AA tree is at most twice as deep as a perfectly balanced one */
+#define XMAX_DEPTH 128
+/* A removal writes at most about 16 words per level on the way up, and
+   an insertion fewer, so this is enough for any depth up to
+   XMAX_DEPTH. */
+#define XLOG 4096
+/* Optimistic reads before a reader takes the mutex */
+#define XREAD_TRIES 16
+/* How long aatreex_open() waits for another process creating it */
+#define XOPEN_WAIT_MS 1000
+
+typedef _Atomic uint64_t xword_t;
+
+/* An old value of a word at an offset, to put back if the write doesn't
+   complete */
+typedef struct xlog_s
+{
+    uint64_t off;
+    uint64_t old;
+} xlog_t;
+
+/* At offset 0 */
+typedef struct xhead_s
+{
+    xword_t magic;              /* Set last, when initialized */
+    uint64_t size;
+    pthread_mutex_t lock;       /* Robust and process-shared */
+    xword_t seq;                /* Odd while writing */
+    /* Only changed through put() */
+    xword_t root;
+    xword_t count;
+    xword_t top;                /* Where the unallocated space starts */
+    xword_t free[XCLASSES];     /* Freed blocks, linked through 'left' */
+    /* The undo log of the write in progress, empty otherwise */
+    xword_t log_n;
+    xlog_t log[XLOG];
+} xhead_t;
+
+/* Offsets are 0 for none. The key follows, with its '\0'. */
+typedef struct xnode_s
+{
+    xword_t left, right;
+    xword_t level;
+    xword_t value;
+    xword_t keylen;
+    char key[];
+} xnode_t;
+
+struct aatreex_s
+{
+    char *base;
+    size_t size;
+    int fd;
+};
+
+/* The first block is aligned for any node */
+#define XHEAP ((sizeof(xhead_t) + 63) & ~(uint64_t)63)
+
+static inline xhead_t *
+xhead(aatreex_t *x)
+{
+    return (xhead_t *)x->base;
+}
+
+static inline xnode_t *
+xnode(aatreex_t *x, uint64_t off)
+{
+    return (xnode_t *)(x->base + off);
+}
+
+static inline uint64_t
+get(xword_t *w)
+{
+    return atomic_load_explicit(w, memory_order_relaxed);
+}
+
+/* Write a word of the tree, logging the old value first. The release
+   makes sure the log entry is in place before the word changes, even
+   if the process dies right after. */
+static void
+put(aatreex_t *x, xword_t *w, uint64_t v)
+{
+    xhead_t *h = xhead(x);
+    uint64_t old = get(w);
+    uint64_t n = get(&h->log_n);
+
+    if (old == v)
+        return;
+    if (n == XLOG)
+        abort();                /* Can't happen, see XLOG */
+    h->log[n].off = (uint64_t)((char *)w - x->base);
+    h->log[n].old = old;
+    atomic_store_explicit(&h->log_n, n + 1, memory_order_release);
+    atomic_store_explicit(w, v, memory_order_release);
+}
+
+/* Put back what the log has, latest first. Doing it again if this is
+   interrupted gives the same result. */
+static void
+rollback(aatreex_t *x)
+{
+    xhead_t *h = xhead(x);
+
+    for (uint64_t i = get(&h->log_n) ; i > 0 ; i--)
+        atomic_store_explicit((xword_t *)(x->base + h->log[i-1].off),
+                              h->log[i-1].old, memory_order_release);
+    atomic_store_explicit(&h->log_n, 0, memory_order_release);
+}
+
+/* Readers retry while 'seq' is odd, or if it changed during the read */
+static void
+begin(aatreex_t *x)
+{
+    xhead_t *h = xhead(x);
+
+    atomic_store_explicit(&h->seq, get(&h->seq) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void
+commit(aatreex_t *x)
+{
+    xhead_t *h = xhead(x);
+
+    atomic_store_explicit(&h->log_n, 0, memory_order_release);
+    atomic_store_explicit(&h->seq, get(&h->seq) + 1, memory_order_release);
+}
+
+static void
+abandon(aatreex_t *x)
+{
+    rollback(x);
+    commit(x);
+}
+
+/* Take the mutex, and if its owner died, undo what it was doing */
+static bool
+xlock(aatreex_t *x)
+{
+    xhead_t *h = xhead(x);
+    int r = pthread_mutex_lock(&h->lock);
+
+    if (r == EOWNERDEAD)
+    {
+        rollback(x);
+        if (get(&h->seq) & 1)
+            atomic_store_explicit(&h->seq, get(&h->seq) + 1,
+                                  memory_order_release);
+        r = pthread_mutex_consistent(&h->lock);
+    }
+    if (r != 0)
+    {
+        errno = r;
+        return false;
+    }
+    return true;
+}
+
+static void
+xunlock(aatreex_t *x)
+{
+    pthread_mutex_unlock(&xhead(x)->lock);
+}
+
+/*
+** Allocation
+*/
+
+static int
+size_class(uint64_t bytes)
+{
+    int k = 0;
+
+    while (k < XCLASSES && ((uint64_t)XMIN_BLOCK << k) < bytes)
+        k++;
+    return k;
+}
+
+static inline uint64_t
+node_bytes(uint64_t keylen)
+{
+    return sizeof(xnode_t) + keylen + 1;
+}
+
+/* Returns the offset of a block of at least 'bytes', or 0 if full */
+static uint64_t
+xalloc(aatreex_t *x, uint64_t bytes)
+{
+    xhead_t *h = xhead(x);
+    int k = size_class(bytes);
+    uint64_t off, top;
+
+    if (k == XCLASSES)
+        return 0;
+    if ((off = get(&h->free[k])) != 0)
+    {
+        put(x, &h->free[k], get(&xnode(x, off)->left));
+        return off;
+    }
+    top = get(&h->top);
+    if (top + ((uint64_t)XMIN_BLOCK << k) > h->size)
+        return 0;
+    put(x, &h->top, top + ((uint64_t)XMIN_BLOCK << k));
+    return top;
+}
+
+static void
+xfree(aatreex_t *x, uint64_t off)
+{
+    xhead_t *h = xhead(x);
+    xnode_t *n = xnode(x, off);
+    int k = size_class(node_bytes(get(&n->keylen)));
+
+    put(x, &n->left, get(&h->free[k]));
+    put(x, &h->free[k], off);
+}
+
+/*
+** The tree
+*/
+
+static inline uint64_t
+left(aatreex_t *x, uint64_t t)
+{
+    return get(&xnode(x, t)->left);
+}
+
+static inline uint64_t
+right(aatreex_t *x, uint64_t t)
+{
+    return get(&xnode(x, t)->right);
+}
+
+static inline uint64_t
+level(aatreex_t *x, uint64_t t)
+{
+    return (t == 0 ? 0 : get(&xnode(x, t)->level));
+}
+
+static inline void
+set_left(aatreex_t *x, uint64_t t, uint64_t l)
+{
+    put(x, &xnode(x, t)->left, l);
+}
+
+static inline void
+set_right(aatreex_t *x, uint64_t t, uint64_t r)
+{
+    put(x, &xnode(x, t)->right, r);
+}
+
+static inline void
+set_level(aatreex_t *x, uint64_t t, uint64_t lev)
+{
+    put(x, &xnode(x, t)->level, lev);
+}
+
+/* As strcmp(), with the lengths known */
+static int
+xcompare(aatreex_t *x, const char *key, size_t len, uint64_t t)
+{
+    xnode_t *n = xnode(x, t);
+    uint64_t nlen = get(&n->keylen);
+    int cmp = memcmp(key, n->key, (len < nlen ? len : nlen));
+
+    if (cmp != 0)
+        return cmp;
+    return (len > nlen) - (len < nlen);
+}
+
+/* A node a reader can look at without going outside the object. What
+   it finds may be garbage, but then 'seq' will have changed. */
+static bool
+valid(aatreex_t *x, uint64_t t)
+{
+    if (t < XHEAP || t % XMIN_BLOCK != 0 || t + sizeof(xnode_t) > x->size)
+        return false;
+    return (get(&xnode(x, t)->keylen) < x->size - t - sizeof(xnode_t));
+}
+
+static uint64_t
+skew(aatreex_t *x, uint64_t t)
+{
+    uint64_t l;
+
+    if (t == 0 || (l = left(x, t)) == 0 || level(x, l) != level(x, t))
+        return t;
+    set_left(x, t, right(x, l));
+    set_right(x, l, t);
+    return l;
+}
+
+static uint64_t
+split(aatreex_t *x, uint64_t t)
+{
+    uint64_t r;
+
+    if (t == 0 || (r = right(x, t)) == 0 || right(x, r) == 0 ||
+        level(x, right(x, r)) != level(x, t))
+        return t;
+    set_right(x, t, left(x, r));
+    set_left(x, r, t);
+    set_level(x, r, level(x, r) + 1);
+    return r;
+}
+
+static uint64_t
+insert(aatreex_t *x, uint64_t t, const char *key, size_t len, uint64_t n)
+{
+    if (t == 0)
+        return n;
+    if (xcompare(x, key, len, t) < 0)
+        set_left(x, t, insert(x, left(x, t), key, len, n));
+    else
+        set_right(x, t, insert(x, right(x, t), key, len, n));
+    return split(x, skew(x, t));
+}
+
+/* Lower the level if a child's is too low after a removal, and
+   rebalance */
+static uint64_t
+remove_fix(aatreex_t *x, uint64_t t)
+{
+    uint64_t l = level(x, left(x, t)), r = level(x, right(x, t));
+    uint64_t should = (l < r ? l : r) + 1;
+
+    if (should < level(x, t))
+    {
+        set_level(x, t, should);
+        if (level(x, right(x, t)) > should)
+            set_level(x, right(x, t), should);
+    }
+    t = skew(x, t);
+    set_right(x, t, skew(x, right(x, t)));
+    if (right(x, t) != 0)
+        set_right(x, right(x, t), skew(x, right(x, right(x, t))));
+    t = split(x, t);
+    set_right(x, t, split(x, right(x, t)));
+    return t;
+}
+
+static uint64_t
+remove_min(aatreex_t *x, uint64_t t, uint64_t *minp)
+{
+    if (left(x, t) == 0)
+    {
+        *minp = t;
+        return right(x, t);
+    }
+    set_left(x, t, remove_min(x, left(x, t), minp));
+    return remove_fix(x, t);
+}
+
+/* The node with the key is unlinked, and its successor, if it has two
+   children, takes its place; no keys are moved, since they differ in
+   size. */
+static uint64_t
+remove_key(aatreex_t *x, uint64_t t, const char *key, size_t len,
+       uint64_t *removedp)
+{
+    int cmp;
+
+    if (t == 0)
+        return 0;
+    if ((cmp = xcompare(x, key, len, t)) < 0)
+        set_left(x, t, remove_key(x, left(x, t), key, len, removedp));
+    else if (cmp > 0)
+        set_right(x, t, remove_key(x, right(x, t), key, len, removedp));
+    else
+    {
+        uint64_t s, r;
+
+        *removedp = t;
+        if (left(x, t) == 0)
+            return right(x, t);
+        if (right(x, t) == 0)
+            return left(x, t);
+        r = remove_min(x, right(x, t), &s);
+        set_left(x, s, left(x, t));
+        set_right(x, s, r);
+        set_level(x, s, level(x, t));
+        t = s;
+    }
+    return remove_fix(x, t);
+}
+
+/* Sets *tp to the node with the key, if any.
+   Returns 1 if found, 0 if not, or -1 if a reader went astray. */
+static int
+lookup(aatreex_t *x, const char *key, size_t len, uint64_t *tp)
+{
+    uint64_t t = get(&xhead(x)->root);
+
+    for (int depth = 0 ; t != 0 ; depth++)
+    {
+        int cmp;
+
+        if (depth > XMAX_DEPTH || ! valid(x, t))
+            return -1;
+        if ((cmp = xcompare(x, key, len, t)) == 0)
+        {
+            *tp = t;
+            return 1;
+        }
+        t = (cmp < 0 ? left(x, t) : right(x, t));
+    }
+    return 0;
+}
+
+static bool
+each(aatreex_t *x, uint64_t t, aatreex_each_fun_t *fun, void *arg)
+{
+    while (t != 0)
+    {
+        if (! each(x, left(x, t), fun, arg))
+            return false;
+        if (! fun(xnode(x, t)->key, get(&xnode(x, t)->value), arg))
+            return false;
+        t = right(x, t);
+    }
+    return true;
+}
+
+/*
+** The API
+*/
+
+static void
+sleep_ms(long ms)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = ms * 1000000 };
+
+    (void)nanosleep(&ts, NULL);
+}
+
+static bool
+create(aatreex_t *x, size_t size)
+{
+    xhead_t *h;
+    pthread_mutexattr_t attr;
+    bool ok;
+
+    if (size < XHEAP + 4096)
+        size = XHEAP + 4096;
+    if (ftruncate(x->fd, (off_t)size) < 0)
+        return false;
+    x->size = size;
+    x->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, x->fd, 0);
+    if (x->base == MAP_FAILED)
+        return false;
+    h = xhead(x);
+    h->size = size;
+    atomic_init(&h->seq, 0);
+    atomic_init(&h->root, 0);
+    atomic_init(&h->count, 0);
+    atomic_init(&h->top, XHEAP);
+    for (int k = 0 ; k < XCLASSES ; k++)
+        atomic_init(&h->free[k], 0);
+    atomic_init(&h->log_n, 0);
+    if (pthread_mutexattr_init(&attr) != 0)
+        return false;
+    ok = (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+          pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+          pthread_mutex_init(&h->lock, &attr) == 0);
+    pthread_mutexattr_destroy(&attr);
+    if (ok)
+        atomic_store_explicit(&h->magic, XMAGIC, memory_order_release);
+    return ok;
+}
+
+/* Wait for the creator to size and initialize it */
+static bool
+attach(aatreex_t *x)
+{
+    struct stat st;
+    int ms = 0;
+
+    while (true)
+    {
+        if (fstat(x->fd, &st) < 0)
+            return false;
+        if (st.st_size != 0 || ms == XOPEN_WAIT_MS)
+            break;
+        sleep_ms(1);
+        ms += 1;
+    }
+    if (st.st_size < (off_t)XHEAP)
+    {
+        errno = EAGAIN;
+        return false;
+    }
+    x->size = (size_t)st.st_size;
+    x->base = mmap(NULL, x->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   x->fd, 0);
+    if (x->base == MAP_FAILED)
+        return false;
+    while (atomic_load_explicit(&xhead(x)->magic, memory_order_acquire) == 0
+           && ms < XOPEN_WAIT_MS)
+    {
+        sleep_ms(1);
+        ms += 1;
+    }
+    if (atomic_load_explicit(&xhead(x)->magic, memory_order_acquire) != XMAGIC
+        || xhead(x)->size != x->size)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+aatreex_t *
+aatreex_open(const char *name, size_t size)
+{
+    aatreex_t *x = malloc(sizeof(aatreex_t));
+    bool ok;
+
+    if (x == NULL)
+        return NULL;
+    x->base = MAP_FAILED;
+    if ((x->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0)
+        ok = create(x, size);
+    else if (errno == EEXIST && (x->fd = shm_open(name, O_RDWR, 0)) >= 0)
+        ok = attach(x);
+    else
+        ok = false;
+    if (! ok)
+    {
+        int err = errno;
+
+        if (x->base != MAP_FAILED)
+            munmap(x->base, x->size);
+        if (x->fd >= 0)
+            close(x->fd);
+        free(x);
+        errno = err;
+        return NULL;
+    }
+    return x;
+}
+
+void
+aatreex_close(aatreex_t *x)
+{
+    munmap(x->base, x->size);
+    close(x->fd);
+    free(x);
+}
+
+bool
+aatreex_unlink(const char *name)
+{
+    return (shm_unlink(name) == 0);
+}
+
+bool
+aatreex_replace(aatreex_t *x, const char *key, uint64_t value)
+{
+    xhead_t *h = xhead(x);
+    size_t len = strlen(key);
+    uint64_t n;
+
+    if (! xlock(x))
+        return false;
+    begin(x);
+    if (lookup(x, key, len, &n) > 0)
+        put(x, &xnode(x, n)->value, value);
+    else if ((n = xalloc(x, node_bytes(len))) == 0)
+    {
+        abandon(x);
+        xunlock(x);
+        errno = ENOMEM;
+        return false;
+    }
+    else
+    {
+        /* Not in the tree yet, so no need to log these */
+        xnode_t *node = xnode(x, n);
+
+        atomic_store_explicit(&node->left, 0, memory_order_relaxed);
+        atomic_store_explicit(&node->right, 0, memory_order_relaxed);
+        atomic_store_explicit(&node->level, 1, memory_order_relaxed);
+        atomic_store_explicit(&node->value, value, memory_order_relaxed);
+        atomic_store_explicit(&node->keylen, len, memory_order_relaxed);
+        memcpy(node->key, key, len + 1);
+        put(x, &h->root, insert(x, get(&h->root), key, len, n));
+        put(x, &h->count, get(&h->count) + 1);
+    }
+    commit(x);
+    xunlock(x);
+    return true;
+}
+
+bool
+aatreex_delete(aatreex_t *x, const char *key, uint64_t *valuep)
+{
+    xhead_t *h = xhead(x);
+    uint64_t removed = 0;
+
+    if (! xlock(x))
+        return false;
+    begin(x);
+    put(x, &h->root,
+        remove_key(x, get(&h->root), key, strlen(key), &removed));
+    if (removed != 0)
+    {
+        if (valuep != NULL)
+            *valuep = get(&xnode(x, removed)->value);
+        xfree(x, removed);
+        put(x, &h->count, get(&h->count) - 1);
+    }
+    commit(x);
+    xunlock(x);
+    return (removed != 0);
+}
+
+bool
+aatreex_find(aatreex_t *x, const char *key, uint64_t *valuep)
+{
+    xhead_t *h = xhead(x);
+    size_t len = strlen(key);
+    uint64_t t, value = 0;
+    int r = -1;
+
+    for (int i = 0 ; i < XREAD_TRIES && r < 0 ; i++)
+    {
+        uint64_t seq = atomic_load_explicit(&h->seq, memory_order_acquire);
+
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        if ((r = lookup(x, key, len, &t)) > 0)
+            value = get(&xnode(x, t)->value);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&h->seq, memory_order_relaxed) != seq)
+            r = -1;
+    }
+    /* Too many writers, or one died while writing */
+    if (r < 0)
+    {
+        if (! xlock(x))
+            return false;
+        if ((r = lookup(x, key, len, &t)) > 0)
+            value = get(&xnode(x, t)->value);
+        xunlock(x);
+    }
+    if (r > 0 && valuep != NULL)
+        *valuep = value;
+    return (r > 0);
+}
+
+size_t
+aatreex_count(aatreex_t *x)
+{
+    return (size_t)atomic_load_explicit(&xhead(x)->count,
+                                        memory_order_acquire);
+}
+
+bool
+aatreex_each(aatreex_t *x, aatreex_each_fun_t *fun, void *arg)
+{
+    bool ok;
+
+    if (! xlock(x))
+        return false;
+    ok = each(x, get(&xhead(x)->root), fun, arg);
+    xunlock(x);
+    return ok;
+}
@@ -0,0 +1,70 @@
+/*
+** pem 2026-10-19
+**
+** An AA tree in a shared memory object, for processes on the same host
+** sharing one ordered index. The nodes and keys are allocated in the
+** object, and linked with offsets from its start, so each process can
+** map it at any address.
+**
+** Writers take a robust process-shared mutex. Readers don't; they
+** check a sequence number that writers make odd while writing, and try
+** again if it changed, falling back to the mutex if it keeps changing.
+** Each write first logs the old contents of what it changes, so if a
+** writer dies half way, the next process to take the mutex undoes it,
+** allocation included.
+**
+** Keys are strings, and values are 64 bit integers, since pointers are
+** only meaningful in one process. Keys are unique.
+**
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct aatreex_s aatreex_t;
+
+/* Called in key order by aatreex_each(). Must not modify the tree.
+   Returns false to stop. */
+typedef bool aatreex_each_fun_t(const char *key, uint64_t value, void *arg);
+
+/* Open the tree in the shared memory object 'name' (see shm_open(3)),
+   creating it with 'size' bytes if it doesn't exist. The size is fixed
+   when created, and is ignored otherwise.
+   Returns NULL, with errno set, on failure. */
+aatreex_t *aatreex_open(const char *name, size_t size);
+
+/* Unmap the tree. It stays in the object for other processes, until
+   aatreex_unlink(). */
+void aatreex_close(aatreex_t *x);
+
+/* Remove the shared memory object. Processes that have it open can
+   still use it, until they close it.
+   Returns false, with errno set, on failure. */
+bool aatreex_unlink(const char *name);
+
+/* Insert the key with the value, or replace the value if the key is
+   already in the tree.
+   Returns false, with errno set, if the object is full or the mutex
+   could not be taken. */
+bool aatreex_replace(aatreex_t *x, const char *key, uint64_t value);
+
+/* Delete the key. If found, *valuep is set to its value, unless valuep
+   is NULL.
+   Returns true if found and deleted. */
+bool aatreex_delete(aatreex_t *x, const char *key, uint64_t *valuep);
+
+/* Find the key, without taking the mutex unless writers keep getting
+   in the way. If found, *valuep is set to its value, unless valuep is
+   NULL.
+   Returns true if found. */
+bool aatreex_find(aatreex_t *x, const char *key, uint64_t *valuep);
+
+/* Returns the number of keys in the tree. */
+size_t aatreex_count(aatreex_t *x);
+
+/* Call 'fun' on each key and value in key order, holding the mutex.
+   Returns false if 'fun' did, or the mutex could not be taken. */
+bool aatreex_each(aatreex_t *x, aatreex_each_fun_t *fun, void *arg);
@@ -123,6 +123,92 @@ tst "Conditional delete in one" -d b:2 b:2
 tst "No conditional delete in 6" -d b:7 a:1 b:2 c:3 b:4 d:5 b:6
 tst "Conditional delete one in 6" -d b:4 a:1 b:2 c:3 b:4 d:5 b:6
 tst "Conditional delete two in 6" -d b:6 a:1 b:2 c:3 b:4 d:5 b:6
+tst "Conditional delete on the left" -d a:1 a:1 a:2 a:3
+
+tst "Shards, unique keys" -S 3 5 9 1 7 3 8 2 6 4
+tst "Shards, dup. keys" -S 3 e b a g c c d f h i c
+tst "Shards, one key" -S 4 a
+
+tst "Build in empty" -B 2
+tst "Build unique keys" -B 2 f:6 g:7 a:1 c:3 b:2 d:4 e:5 i:9 h:8
+tst "Build dup. keys" -B 3 f:9 a:1 e:6 c:4 c:3 b:2 c:5 d:7 e:8
+
+tst "Aggregate in range" -A c/g d b f a c e g h c
+tst "Aggregate unbounded" -A -/- 04 10 02 08 12 01 03 05 09 11 13 07 06
+tst "Aggregate from" -A 07/- 04 10 02 08 12 01 03 05 09 11 13 07 06
+
+tst "Intervals overlapping" -I 5/9 1-3 2-8 4-5 6-7 9-12 8-9 0-20 5-6 5-5
+tst "Intervals stabbing" -I 6 1-3 2-8 4-5 6-7 9-12 8-9 0-20 5-6
+tst "Intervals none" -I 30/40 1-3 2-8 4-5
+
+tst "Wide tree unique keys" -W 20/45 3 10 17 24 31 38 45 52 59 6 13 20 27 34 41 48 55 2 9 16 23 30 37 44 51 58 5 12 19 26 33 40 47 54 1 8
+tst "Wide tree dup. keys" -W 4/5 4:a 9:b 4:b 1:c 4:c 4:d 7:e 4:e 4:f 2:g 4:g 4:h 4:i 5:j 4:j 4:k 3:l 4:l 4:m 4:n 4:o 6:p 4:p 4:q 0:r 4:r
+tst "Wide tree empty" -W 0/10
+
+tst "Compact sorted keys" -C -H a b c d e f g h i j k l m n o p q r s t
+tst "Compact then delete" -C -d e:5 h:8 c:3 a:1 e:5 b:2 g:7 d:4 f:6
+tst "Compact then rename" -C -R c/x c:1 a:2 c:3 b:4 c:5 d:6
+
+tst "Write buffer of 4" -w 4 e:1 b:2 h:3 a:4 c:5 e:6 g:7 d:8 f:9 b:10
+tst "Write buffer not flushed" -w 100 e:1 b:2 h:3 a:4 c:5 e:6 g:7 d:8 f:9 b:10
+tst "Write buffer of 1" -w 1 e:1 b:2 h:3 a:4 c:5 e:6 g:7 d:8 f:9 b:10
+
+tst "Destroy in steps" -x 3 e b h a c g d f i
+tst "Destroy at once" -x 100 e b h a c g d f i
+tst "Destroy empty" -x 2
+
+tst "Pop below a key" -P 3/d e:1 b:2 h:3 a:4 c:5 e:6 g:7 b:8 f:9 h:10
+tst "Pop all" -P 100 e:1 b:2 h:3 a:4 c:5 e:6 g:7 b:8 f:9 h:10
+tst "Pop from one" -P 2 a
+
+tst "Cache find" -K 8 -f c e:1 b:2 h:3 a:4 c:5 g:6 d:7 f:8
+tst "Cache then delete" -K 4 -d c c:1 a:2 c:3 b:4 c:5 d:6 a:7
+tst "Cache then rename" -K 64 -R c/x c:1 a:2 c:3 b:4 c:5 d:6
+
+tst "Index then delete" -X -d c c:1 a:2 c:3 b:4 c:5 d:6 a:7
+tst "Index then rename" -X -R c/x c:1 a:2 c:3 b:4 c:5 d:6
+tst "Index with replace" -X -r a:1 b:2 c:3 b:4 d:5 a:6
+tst "Index compact then delete" -X -C -d e h c a e b g d f
+
+tst "Bloom find none" -F 16 -f zz e b h a c g d f
+tst "Bloom after delete" -F 16 -d c c:1 a:2 c:3 b:4 c:5 d:6 a:7
+tst "Bloom with cache and rename" -F 1 -K 8 -R c/x c:1 a:2 c:3 b:4 c:5 d:6
+
+tst "Tsearch dup. keys" -T e b h a c e g d f b
+tst "Tsearch one key" -T a
+tst "Tsearch parent" -T a b c d e f g
+tst "Tsearch empty" -T
+
+tst "Expire with budget" -E 5/2 e:3 b:9 h:1 a:5 c:2 g:6 d:5 f
+tst "Expire none" -E 0/10 e:3 b:9 h:1
+tst "Expire dup. keys" -E 4/10 c:1 a:2 c:3 b:4 c:5 d:6 c
+
+tst "Capacity with lookups" -L 3 a b c +a d +b e +c +a f g
+tst "Capacity all referenced" -L 2 a b +a +b c +a +c d
+tst "Capacity of one" -L 1 a b +a +b c
+
+tst "Feed to replica" -G 4096 e:1 b:2 h a c -b =h:9 c/x g -zz =q:5
+tst "Feed rename to dup. keys" -G 4096 a:1 b:2 c:3 a/b -c
+tst "Feed overflow" -G 256 key1234561 key1234562 key1234563 key1234564 key1234565 key1234566 key1234567
+
+tst "Log and recover" -J 4096 e:1 b:2 h a c -b =h:9 c/x g
+tst "Log with snapshots" -J 4096 e:1 b:2 h ! a c -b =h:9 c/x ! g -e
+tst "Log in small groups" -J 1 a:1 b:2 c:3 -a =b:4 c/d
+tst "Log empty snapshot" -J 1 !
+tst "Log cut in a record" -J 4096/cut a:1 b:2 c:3 d:4
+tst "Log with a bad crc" -J 4096/crc a:1 b:2 c:3 =d:4
+
+tst "Prefix scan" -N ab a ab abc abd b aa abz ac ab
+tst "Prefix dup. keys" -N b b a b c ba b bb
+tst "Prefix none" -N zz a b c
+
+tst "Binary keys" -Y a%00b:1 a ab a%00 %ff ?a%00b ?a%00c =ab:2 a/%00%00 -a%00 ?%00%00 b b/c %25
+tst "Binary prefix keys" -Y ab a abc a%00 a%00%00 %00 ?a ?abc -abc ?abc ?a%00%00%00
+tst "Binary dup. keys" -Y a%00:1 a%00:2 a%00:3 -a%00 a%00/b ?b ?a%00
+
+tst "Shared memory tree" -M 65536 d:4 b a:7 c e f g h i j k
+tst "Shared memory dup. keys" -M 4096 c:1 a:2 c:3 b c:5
+tst "Shared memory one key" -M 4096 a
 
 echo
 if [ $xit -ne 0 ]; then